@@ -0,0 +1,40 @@
+#!/bin/sh
+# Builtin fast path: run a generated script of N `test`/`echo` lines once
+# as builtins and once through the external binaries (/usr/bin/test,
+# /bin/echo), and report commands/sec for each.
+#
+# Usage: bench/builtin_bench.sh [shell] [count]
+
+SHELL_BIN=${1:-./miell}
+COUNT=${2:-100000}
+TEST_BIN=/usr/bin/test
+ECHO_BIN=/bin/echo
+BUILTIN=$(mktemp)
+EXTERNAL=$(mktemp)
+trap 'rm -f "$BUILTIN" "$EXTERNAL"' EXIT
+
+awk -v n="$COUNT" -v builtin="$BUILTIN" -v external="$EXTERNAL" \
+    -v test_bin="$TEST_BIN" -v echo_bin="$ECHO_BIN" 'BEGIN {
+    for (i = 0; i < n; i++) {
+        if (i % 2 == 0) {
+            print "test -f /etc/passwd" > builtin
+            print test_bin " -f /etc/passwd" > external
+        } else {
+            print "echo line " i > builtin
+            print echo_bin " line " i > external
+        }
+    }
+}'
+
+run() {
+    start=$(date +%s%N)
+    "$SHELL_BIN" "$2" > /dev/null 2>&1
+    end=$(date +%s%N)
+    elapsed_ns=$((end - start))
+    [ "$elapsed_ns" -gt 0 ] || elapsed_ns=1
+    echo "$SHELL_BIN ($1): $COUNT commands in $((elapsed_ns / 1000000)) ms," \
+         "$((COUNT * 1000000000 / elapsed_ns)) commands/sec"
+}
+
+run builtin "$BUILTIN"
+run external "$EXTERNAL"
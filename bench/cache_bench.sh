@@ -0,0 +1,36 @@
+#!/bin/sh
+# Result cache: run an expensive, deterministic pipeline N times plain
+# and N times as `cached` (one miss, then hits) against a fresh cache
+# directory, and report the time per run for each.
+#
+# Usage: bench/cache_bench.sh [shell] [runs]
+
+SHELL_BIN=${1:-./miell}
+RUNS=${2:-20}
+CACHE=$(mktemp -d)
+PLAIN=$(mktemp)
+CACHED=$(mktemp)
+trap 'rm -rf "$CACHE" "$PLAIN" "$CACHED"' EXIT
+
+PIPELINE="seq 1 1000000 | sort -r | md5sum"
+i=0
+while [ "$i" -lt "$RUNS" ]; do
+    echo "$PIPELINE" >> "$PLAIN"
+    echo "cached $PIPELINE" >> "$CACHED"
+    i=$((i + 1))
+done
+echo cached >> "$CACHED"
+
+run() {
+    start=$(date +%s%N)
+    MIELL_CACHE_DIR=$CACHE "$SHELL_BIN" "$2" > "$CACHE.out" 2>&1
+    end=$(date +%s%N)
+    elapsed_ns=$((end - start))
+    echo "$1: $RUNS runs in $((elapsed_ns / 1000000)) ms," \
+         "$((elapsed_ns / RUNS / 1000)) us/run"
+}
+
+run plain "$PLAIN"
+run cached "$CACHED"
+tail -1 "$CACHE.out"
+rm -f "$CACHE.out"
@@ -0,0 +1,151 @@
+/*
+ * Tab completion benchmark.
+ *
+ * Builds a directory of N files (100k by default) and a PATH of D
+ * directories (64 by default) with 200 executables each, then times
+ * complete_word() for file names and command names: the first (cold)
+ * completion, and the average of warm ones, against a readdir() of the
+ * directory per Tab.
+ *
+ * Usage: bench/complete_bench [-n files] [-p path-dirs] [-d dir] [-r rounds]
+ */
+#define main miell_main
+#include "../miell.c"
+#undef main
+
+#include <stdarg.h>
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// snprintf into a path buffer; a path that does not fit stops the run
+static void format_path(char* path, size_t size, const char* format, ...) {
+    va_list ap;
+    va_start(ap, format);
+    int len = vsnprintf(path, size, format, ap);
+    va_end(ap);
+    if (len < 0 || (size_t)len >= size) {
+        fprintf(stderr, "complete_bench: path too long: %s\n", path);
+        exit(1);
+    }
+}
+
+static void make_file(const char* path, mode_t mode) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, mode);
+    if (fd == -1) {
+        perror(path);
+        exit(1);
+    }
+    close(fd);
+}
+
+// Count names starting with prefix by reading the directory, as with no cache
+static size_t scan_dir(const char* dir, const char* prefix) {
+    size_t len = strlen(prefix), count = 0;
+    DIR* d = opendir(dir);
+    struct dirent* entry;
+    while ((entry = readdir(d)) != NULL) {
+        count += strncmp(entry->d_name, prefix, len) == 0;
+    }
+    closedir(d);
+    return count;
+}
+
+static void time_line(const char* label, const char* line, int rounds, const char* scan_dir_path,
+                      const char* scan_prefix) {
+    struct completion c = { 0 };
+    double start = now_us();
+    complete_word(line, strlen(line), &c);
+    double cold = now_us() - start;
+
+    start = now_us();
+    for (int i = 0; i < rounds; i++) {
+        complete_word(line, strlen(line), &c);
+    }
+    double warm = (now_us() - start) / rounds;
+
+    printf("%-26s %8zu %12.1f %12.2f", label, c.count, cold, warm);
+    if (scan_dir_path != NULL) {
+        start = now_us();
+        for (int i = 0; i < 5; i++) {
+            scan_dir(scan_dir_path, scan_prefix);
+        }
+        printf(" %12.1f", (now_us() - start) / 5);
+    }
+    printf("\n");
+}
+
+int main(int argc, char** argv) {
+    const char* root = "/tmp/miell_complete_bench";
+    int files = 100000;
+    int path_dirs = 64;
+    int rounds = 1000;
+    int opt;
+    char path[4096];
+
+    init_vars();
+    while ((opt = getopt(argc, argv, "n:p:d:r:")) != -1) {
+        switch (opt) {
+        case 'n': files = atoi(optarg); break;
+        case 'p': path_dirs = atoi(optarg); break;
+        case 'd': root = optarg; break;
+        case 'r': rounds = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-n files] [-p path-dirs] [-d dir] [-r rounds]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    mkdir(root, 0755);
+    format_path(path, sizeof(path), "%s/files", root);
+    mkdir(path, 0755);
+    for (int i = 0; i < files; i++) {
+        format_path(path, sizeof(path), "%s/files/file%06d.%s", root, i, (i % 4 == 0) ? "log" : "txt");
+        make_file(path, 0644);
+    }
+
+    size_t search_len = 0;
+    char* search = malloc(path_dirs * (strlen(root) + 16) + 1);
+    search[0] = '\0';
+    for (int d = 0; d < path_dirs; d++) {
+        format_path(path, sizeof(path), "%s/bin%02d", root, d);
+        mkdir(path, 0755);
+        search_len += sprintf(search + search_len, "%s%s", d ? ":" : "", path);
+        for (int i = 0; i < 200; i++) {
+            format_path(path, sizeof(path), "%s/bin%02d/tool%02d-%03d", root, d, d, i);
+            make_file(path, 0755);
+        }
+    }
+    var_set("PATH", search, 1);
+
+    char files_dir[4096], line[4096];
+    format_path(files_dir, sizeof(files_dir), "%s/files", root);
+    printf("%d files, %d PATH directories of 200 commands, warm average of %d\n", files, path_dirs, rounds);
+    printf("%-26s %8s %12s %12s %12s\n", "completing", "matches", "cold (us)", "warm (us)", "readdir (us)");
+    format_path(line, sizeof(line), "cat %s/file09999", files_dir);
+    time_line("file name, 10 matches", line, rounds, files_dir, "file09999");
+    format_path(line, sizeof(line), "cat %s/file099", files_dir);
+    time_line("file name, 1000 matches", line, rounds, files_dir, "file099");
+    time_line("command, 1 match", "tool42-017", rounds, NULL, NULL);
+    time_line("command, 200 matches", "tool42-", rounds, NULL, NULL);
+
+    for (int d = 0; d < path_dirs; d++) {
+        for (int i = 0; i < 200; i++) {
+            format_path(path, sizeof(path), "%s/bin%02d/tool%02d-%03d", root, d, d, i);
+            unlink(path);
+        }
+        format_path(path, sizeof(path), "%s/bin%02d", root, d);
+        rmdir(path);
+    }
+    for (int i = 0; i < files; i++) {
+        format_path(path, sizeof(path), "%s/files/file%06d.%s", root, i, (i % 4 == 0) ? "log" : "txt");
+        unlink(path);
+    }
+    rmdir(files_dir);
+    rmdir(root);
+    free(search);
+    return 0;
+}
@@ -0,0 +1,24 @@
+#!/bin/sh
+# Commands-per-second benchmark: feed N trivial commands to the shell on
+# stdin and report how many it completes per second.
+#
+# Usage: bench/cps.sh [shell] [count]
+
+SHELL_BIN=${1:-./miell}
+COUNT=${2:-2000}
+INPUT=$(mktemp)
+trap 'rm -f "$INPUT"' EXIT
+
+i=0
+while [ "$i" -lt "$COUNT" ]; do
+    echo true
+    i=$((i + 1))
+done > "$INPUT"
+
+start=$(date +%s%N)
+"$SHELL_BIN" < "$INPUT" > /dev/null 2>&1
+end=$(date +%s%N)
+
+elapsed_ns=$((end - start))
+echo "$SHELL_BIN: $COUNT commands in $((elapsed_ns / 1000000)) ms," \
+     "$((COUNT * 1000000000 / elapsed_ns)) commands/sec"
@@ -0,0 +1,48 @@
+#!/bin/sh
+# Variables and environment: run a script of N variable assignments and
+# expansions through builtins, and N spawns of /bin/true, first with the
+# inherited environment and then with VARS extra exported variables,
+# and report commands/sec for each. Every spawn copies the environment
+# into the new process, so only the expansion rate should stay flat.
+#
+# Usage: bench/env_bench.sh [shell] [count] [vars]
+
+SHELL_BIN=${1:-./miell}
+COUNT=${2:-20000}
+VARS=${3:-5000}
+EXPAND=$(mktemp)
+SPAWN=$(mktemp)
+ENVFILE=$(mktemp)
+trap 'rm -f "$EXPAND" "$SPAWN" "$ENVFILE"' EXIT
+
+awk -v n="$COUNT" -v vars="$VARS" -v expand="$EXPAND" -v spawn="$SPAWN" -v envfile="$ENVFILE" 'BEGIN {
+    for (i = 0; i < n; i++) {
+        print "v" (i % 100) "=value" i "; echo $v" (i % 100) " ${HOME}/x \"$v" ((i + 1) % 100) "\"" > expand
+        print "/bin/true" > spawn
+    }
+    for (i = 0; i < vars; i++) {
+        print "BENCH_VAR_" i "=some-value-" i > envfile
+    }
+}'
+
+run() {
+    start=$(date +%s%N)
+    "$SHELL_BIN" "$1" > /dev/null 2>&1
+    end=$(date +%s%N)
+    elapsed_ns=$((end - start))
+    [ "$elapsed_ns" -gt 0 ] || elapsed_ns=1
+    echo "$((COUNT * 1000000000 / elapsed_ns)) commands/sec"
+}
+
+report() {
+    echo "$SHELL_BIN, $1 environment ($(env | wc -l) variables):"
+    echo "  expansion: $(run "$EXPAND")"
+    echo "  spawn:     $(run "$SPAWN")"
+}
+
+report inherited
+(
+    set -a
+    . "$ENVFILE"
+    report large
+)
@@ -0,0 +1,39 @@
+#!/bin/sh
+# Output fan-out throughput: write a file to three copies with repeated
+# redirections (`> a > b > c`, fanned out by the shell with tee/splice)
+# and with `| tee a b > c`, and report MB/s for each (best of three).
+#
+# Usage: bench/fanout_bench.sh [shell] [megabytes] [dir]
+
+SHELL_BIN=${1:-./miell}
+MB=${2:-1024}
+DIR=$(mktemp -d ${3:+"$3/fanout.XXXXXX"})
+trap 'rm -rf "$DIR"' EXIT
+
+head -c "${MB}M" /dev/urandom > "$DIR/src"
+cat "$DIR/src" > /dev/null
+
+run() {
+    elapsed_us=0
+    for round in 1 2 3; do
+        rm -f "$DIR/a" "$DIR/b" "$DIR/c"
+        start=$(date +%s%N)
+        env "$@" "$SHELL_BIN" -c "$COMMAND"
+        end=$(date +%s%N)
+        us=$(((end - start) / 1000))
+        [ "$us" -gt 0 ] || us=1
+        if [ "$elapsed_us" -eq 0 ] || [ "$us" -lt "$elapsed_us" ]; then
+            elapsed_us=$us
+        fi
+    done
+    for copy in a b c; do
+        cmp -s "$DIR/src" "$DIR/$copy" || echo "warning: $DIR/$copy differs from the source" >&2
+    done
+    echo "$LABEL: $MB MB to 3 files in $((elapsed_us / 1000)) ms, $((MB * 1000000 / elapsed_us)) MB/s"
+}
+
+COMMAND="cat < $DIR/src > $DIR/a > $DIR/b > $DIR/c"
+LABEL="> a > b > c, 1 MiB fan-out pipe" run MIELL_PIPE_SIZE=
+LABEL="> a > b > c, 64 KiB fan-out pipe" run MIELL_PIPE_SIZE=64k
+COMMAND="cat < $DIR/src | tee $DIR/a $DIR/b > $DIR/c"
+LABEL="| tee a b > c" run MIELL_PIPE_SIZE=
@@ -0,0 +1,36 @@
+#!/bin/sh
+# Descriptor hygiene: run a script of N commands mixing pipelines,
+# redirections, here-documents, process substitution and builtins, and
+# fail if the shell holds more descriptors at the end than at the start.
+#
+# Usage: bench/fd_check.sh [shell] [count]
+
+SHELL_BIN=${1:-./miell}
+COUNT=${2:-10000}
+SCRIPT=$(mktemp)
+SCRATCH=$(mktemp)
+trap 'rm -f "$SCRIPT" "$SCRATCH"' EXIT
+
+awk -v n="$COUNT" -v scratch="$SCRATCH" 'BEGIN {
+    print "ls /proc/$$/fd | wc -l"
+    c[0] = "echo a | tr a b | cat > " scratch
+    c[1] = "cat < " scratch " > /dev/null 2>&1"
+    c[2] = "cat > /dev/null > " scratch " <<< x"
+    c[3] = "cat <(echo a) > /dev/null"
+    c[4] = "echo b > >(cat > /dev/null)"
+    c[5] = "echo c 2>&1 >> " scratch " | cat"
+    c[6] = "test -f /nonexistent > " scratch " || true"
+    c[7] = "cat < /nonexistent 2> /dev/null"
+    for (i = 0; i < n; i++) print c[i % 8]
+    print "ls /proc/$$/fd | wc -l"
+}' > "$SCRIPT"
+
+start=$(date +%s%N)
+counts=$("$SHELL_BIN" "$SCRIPT" 2> /dev/null | tail -n 2 | tr '\n' ' ')
+end=$(date +%s%N)
+set -- $counts
+elapsed_ns=$((end - start))
+[ "$elapsed_ns" -gt 0 ] || elapsed_ns=1
+echo "$SHELL_BIN: $COUNT commands in $((elapsed_ns / 1000000)) ms," \
+     "open descriptors ${1:-?} before, ${2:-?} after"
+[ -n "$2" ] && [ "$2" -le "$1" ]
@@ -0,0 +1,159 @@
+/*
+ * Glob engine benchmark.
+ *
+ * Builds a flat directory of N files (100k by default) and compares the
+ * shell's glob_expand() against glob(3) on `*` and `*.log` style
+ * patterns. Then builds a tree and times a recursive `** / *.c` walk with
+ * one thread and with the full worker pool.
+ *
+ * Usage: bench/glob_bench [-n files] [-d dir] [-r rounds]
+ */
+#define main miell_main
+#include "../miell.c"
+#undef main
+
+#include <glob.h>
+#include <stdarg.h>
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// snprintf into a path buffer; a path that does not fit stops the run
+static void format_path(char* path, size_t size, const char* format, ...) {
+    va_list ap;
+    va_start(ap, format);
+    int len = vsnprintf(path, size, format, ap);
+    va_end(ap);
+    if (len < 0 || (size_t)len >= size) {
+        fprintf(stderr, "glob_bench: path too long: %s\n", path);
+        exit(1);
+    }
+}
+
+static void make_file(const char* path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        perror(path);
+        exit(1);
+    }
+    close(fd);
+}
+
+static void populate_flat(const char* dir, int files) {
+    char path[4096];
+    mkdir(dir, 0755);
+    for (int i = 0; i < files; i++) {
+        format_path(path, sizeof(path), "%s/file%06d.%s", dir, i, (i % 4 == 0) ? "log" : "txt");
+        make_file(path);
+    }
+}
+
+static void populate_tree(const char* dir, int files) {
+    char path[4096];
+    int dirs = files / 500 + 1;
+    mkdir(dir, 0755);
+    for (int d = 0; d < dirs; d++) {
+        format_path(path, sizeof(path), "%s/d%03d", dir, d);
+        mkdir(path, 0755);
+        format_path(path, sizeof(path), "%s/d%03d/sub", dir, d);
+        mkdir(path, 0755);
+        for (int i = 0; i < 500 && d * 500 + i < files; i++) {
+            format_path(path, sizeof(path), "%s/d%03d/%s/f%03d.%s", dir, d,
+                     (i % 2) ? "sub" : ".", i, (i % 3 == 0) ? "c" : "h");
+            make_file(path);
+        }
+    }
+}
+
+static void compare(const char* pattern, int rounds) {
+    double ours = 0, libc = 0;
+    size_t ours_count = 0, libc_count = 0;
+
+    for (int r = 0; r < rounds; r++) {
+        struct glob_result result = { NULL, 0, 0 };
+        glob_t g;
+        double t0 = now_ms();
+        ours_count = glob_expand(pattern, &result);
+        double t1 = now_ms();
+        glob(pattern, 0, NULL, &g);
+        double t2 = now_ms();
+        libc_count = g.gl_pathc;
+        glob_result_free(&result);
+        globfree(&g);
+        ours += t1 - t0;
+        libc += t2 - t1;
+    }
+    printf("%-34s %8zu %10.2f %10.2f %7.1fx%s\n", pattern, ours_count, libc / rounds, ours / rounds,
+           libc / ours, ours_count == libc_count ? "" : "  (match counts differ!)");
+}
+
+static void recursive(const char* pattern, int rounds) {
+    int cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    double single = 0, pooled = 0;
+    size_t count = 0, pooled_count = 0;
+
+    for (int r = 0; r < rounds; r++) {
+        struct glob_result result = { NULL, 0, 0 };
+        glob_threads = 1;
+        double t0 = now_ms();
+        count = glob_expand(pattern, &result);
+        double t1 = now_ms();
+        glob_result_free(&result);
+        glob_threads = cpus > 1 ? cpus : 2;
+        pooled_count = glob_expand(pattern, &result);
+        double t2 = now_ms();
+        glob_result_free(&result);
+        single += t1 - t0;
+        pooled += t2 - t1;
+    }
+    printf("%-34s %8zu %10.2f %10.2f  (1 thread vs %d threads, %d CPUs)%s\n", pattern, count,
+           single / rounds, pooled / rounds, cpus > 1 ? cpus : 2, cpus,
+           count == pooled_count ? "" : "  (match counts differ!)");
+}
+
+int main(int argc, char** argv) {
+    const char* base = "/tmp/miell-glob-bench";
+    int files = 100000;
+    int rounds = 5;
+    int opt;
+    char flat[4096], tree[4096], pattern[4096];
+
+    while ((opt = getopt(argc, argv, "n:d:r:")) != -1) {
+        switch (opt) {
+        case 'n': files = atoi(optarg); break;
+        case 'd': base = optarg; break;
+        case 'r': rounds = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-n files] [-d dir] [-r rounds]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    mkdir(base, 0755);
+    format_path(flat, sizeof(flat), "%s/flat%d", base, files);
+    format_path(tree, sizeof(tree), "%s/tree%d", base, files);
+    if (access(flat, F_OK) != 0) {
+        populate_flat(flat, files);
+    }
+    if (access(tree, F_OK) != 0) {
+        populate_tree(tree, files);
+    }
+
+    printf("%-34s %8s %10s %10s %8s\n", "pattern", "matches", "glob(3) ms", "miell ms", "speedup");
+    format_path(pattern, sizeof(pattern), "%s/*", flat);
+    compare(pattern, rounds);
+    format_path(pattern, sizeof(pattern), "%s/*.log", flat);
+    compare(pattern, rounds);
+    format_path(pattern, sizeof(pattern), "%s/file00[0-4]*7.txt", flat);
+    compare(pattern, rounds);
+    format_path(pattern, sizeof(pattern), "%s/*/sub/*.c", tree);
+    compare(pattern, rounds);
+
+    printf("\n%-34s %8s %10s %10s\n", "recursive pattern", "matches", "serial ms", "pool ms");
+    format_path(pattern, sizeof(pattern), "%s/**/*.c", tree);
+    recursive(pattern, rounds);
+    return 0;
+}
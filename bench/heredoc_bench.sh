@@ -0,0 +1,46 @@
+#!/bin/sh
+# Here-documents and here-strings: feed a small and a large body to
+# `wc -c` through `<<<` and `<<`, and through the `echo ... |` pipelines
+# they replace, N times each, and report commands/sec. The large body
+# does not fit in a pipe, so the shell hands it over in a memfd.
+#
+# Usage: bench/heredoc_bench.sh [shell] [count] [large-bytes]
+
+SHELL_BIN=${1:-./miell}
+COUNT=${2:-2000}
+LARGE=${3:-1000000}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+awk -v n="$COUNT" -v large="$LARGE" -v dir="$DIR" 'BEGIN {
+    small = "the quick brown fox jumps over the lazy dog"
+    body = ""
+    while (length(body) < large) {
+        body = body small "\n"
+    }
+    print "s=\x27" small "\x27" > (dir "/small_string")
+    print "s=\x27" small "\x27" > (dir "/small_echo")
+    print "b=\x27" body "\x27" > (dir "/large_heredoc")
+    print "b=\x27" body "\x27" > (dir "/large_echo")
+    for (i = 0; i < n; i++) {
+        print "wc -c <<< \"$s\"" > (dir "/small_string")
+        print "echo \"$s\" | wc -c" > (dir "/small_echo")
+        print "wc -c <<EOF\n$b\nEOF" > (dir "/large_heredoc")
+        print "echo \"$b\" | wc -c" > (dir "/large_echo")
+    }
+}'
+
+run() {
+    start=$(date +%s%N)
+    "$SHELL_BIN" "$DIR/$1" > /dev/null 2>&1
+    end=$(date +%s%N)
+    elapsed_ns=$((end - start))
+    [ "$elapsed_ns" -gt 0 ] || elapsed_ns=1
+    echo "$SHELL_BIN: $2: $COUNT commands in $((elapsed_ns / 1000000)) ms," \
+         "$((COUNT * 1000000000 / elapsed_ns)) commands/sec"
+}
+
+run small_string "wc -c <<< \"\$s\"  "
+run small_echo   "echo \"\$s\" | wc -c"
+run large_heredoc "wc -c <<EOF \$b  "
+run large_echo   "echo \"\$b\" | wc -c"
@@ -0,0 +1,109 @@
+/*
+ * History benchmark.
+ *
+ * Writes a history file of N lines (1,000,000 by default), then times
+ * what the shell does with it: opening and mapping it at startup, the
+ * first recall (splitting it into entries), building the Ctrl-R index,
+ * and incremental searches typed one key at a time, against a plain
+ * backward scan for the same keystrokes.
+ *
+ * Usage: bench/history_bench [-n lines] [-f file]
+ */
+#define main miell_main
+#include "../miell.c"
+#undef main
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void write_history(const char* path, int lines) {
+    FILE* out = fopen(path, "w");
+    if (out == NULL) {
+        perror(path);
+        exit(1);
+    }
+    for (int i = 0; i < lines; i++) {
+        if (i == 10) {
+            // Rare, and old: the worst case for a backward scan
+            fprintf(out, "kubectl rollout restart deploy/canary-7781\n");
+            continue;
+        }
+        switch (i % 6) {
+        case 0: fprintf(out, "git commit -m 'fix issue %d'\n", i); break;
+        case 1: fprintf(out, "cd /srv/app%d && make -j8\n", i % 977); break;
+        case 2: fprintf(out, "grep -rn pattern%d src/ | less\n", i); break;
+        case 3: fprintf(out, "ssh host%d.example.com uptime\n", i % 311); break;
+        case 4: fprintf(out, "ls -la /var/log/service%d\n", i % 53); break;
+        default: fprintf(out, "vim notes/%d.md\n", i); break;
+        }
+    }
+    fclose(out);
+}
+
+static size_t scan_search(const char* query, size_t len, size_t before) {
+    for (size_t id = before; id-- > 0;) {
+        if (memmem(history.entries[id].text, history.entries[id].len, query, len) != NULL) {
+            return id;
+        }
+    }
+    return SIZE_MAX;
+}
+
+// Type the query a key at a time, searching after each one as Ctrl-R does
+static double type_query(const char* query, int indexed, size_t* found) {
+    size_t match = SIZE_MAX;
+    double start = now_ms();
+    for (size_t len = 1; len <= strlen(query); len++) {
+        size_t before = match == SIZE_MAX ? history.count : match + 1;
+        match = indexed ? history_search(query, len, before) : scan_search(query, len, before);
+    }
+    *found = match;
+    return now_ms() - start;
+}
+
+int main(int argc, char** argv) {
+    const char* path = "/tmp/miell_history_bench";
+    int lines = 1000000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:f:")) != -1) {
+        switch (opt) {
+        case 'n': lines = atoi(optarg); break;
+        case 'f': path = optarg; break;
+        default:
+            fprintf(stderr, "usage: %s [-n lines] [-f file]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    write_history(path, lines);
+
+    double start = now_ms();
+    history_open(path);
+    printf("%d lines, %zu bytes\n", lines, history.map_len);
+    printf("%-28s %10.2f ms\n", "open and map", now_ms() - start);
+
+    start = now_ms();
+    history_load();
+    printf("%-28s %10.2f ms\n", "first recall (split)", now_ms() - start);
+
+    start = now_ms();
+    history_build_index();
+    printf("%-28s %10.2f ms\n", "first Ctrl-R (index)", now_ms() - start);
+
+    const char* queries[] = { "canary-7781", "pattern424242", "host17.example", "make -j8", "nothing-like-this" };
+    printf("\n%-20s %14s %14s\n", "typed query", "index (ms)", "scan (ms)");
+    for (size_t i = 0; i < sizeof(queries) / sizeof(queries[0]); i++) {
+        size_t indexed_match, scan_match;
+        double indexed = type_query(queries[i], 1, &indexed_match);
+        double scan = type_query(queries[i], 0, &scan_match);
+        printf("%-20s %14.3f %14.3f%s\n", queries[i], indexed, scan,
+               indexed_match == scan_match ? "" : "  MISMATCH");
+    }
+
+    unlink(path);
+    return 0;
+}
@@ -0,0 +1,29 @@
+#!/bin/sh
+# Batch-mode throughput: run a generated script of N lines that never
+# fork (the `cd .` builtin, interleaved with comments and blank lines)
+# and report lines/sec.
+#
+# Usage: bench/lines_bench.sh [shell] [lines]
+
+SHELL_BIN=${1:-./miell}
+LINES=${2:-200000}
+SCRIPT=$(mktemp)
+trap 'rm -f "$SCRIPT"' EXIT
+
+awk -v n="$LINES" 'BEGIN {
+    for (i = 0; i < n; i++) {
+        if (i % 10 == 0) print "# comment line " i
+        else if (i % 10 == 5) print ""
+        else print "cd ."
+    }
+}' > "$SCRIPT"
+bytes=$(wc -c < "$SCRIPT")
+
+start=$(date +%s%N)
+"$SHELL_BIN" "$SCRIPT" > /dev/null 2>&1
+end=$(date +%s%N)
+
+elapsed_ns=$((end - start))
+[ "$elapsed_ns" -gt 0 ] || elapsed_ns=1
+echo "$SHELL_BIN: $LINES lines ($bytes bytes) in $((elapsed_ns / 1000000)) ms," \
+     "$((LINES * 1000000000 / elapsed_ns)) lines/sec"
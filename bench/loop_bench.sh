@@ -0,0 +1,79 @@
+#!/bin/sh
+# Control flow: run 1,000,000 passes of a loop body made of builtins (six
+# nested `for` loops over ten items), then 100,000 calls of a small shell
+# function, in each shell given, and report iterations/sec. First check
+# that break, continue and return leave the loop or function when they
+# run as commands (with a redirection, or a count in a variable).
+#
+# Usage: bench/loop_bench.sh [shell...]
+
+[ $# -gt 0 ] || set -- ./miell
+LOOP=$(mktemp)
+CALLS=$(mktemp)
+CHECK=$(mktemp)
+trap 'rm -f "$LOOP" "$CALLS" "$CHECK"' EXIT
+
+cat > "$CHECK" <<'EOF'
+while true; do break 2>/dev/null; done; echo out
+for i in 1 2 3; do { continue; } >/dev/null; echo $i; done
+n=1; for i in 1 2 3; do echo $i; break $n; done
+f() { return 3 >/dev/null; echo notreached; }
+f; echo $?
+EOF
+CHECK_WANT="out 1 3"
+
+cat > "$LOOP" <<'EOF'
+for a in 0 1 2 3 4 5 6 7 8 9; do
+  for b in 0 1 2 3 4 5 6 7 8 9; do
+    for c in 0 1 2 3 4 5 6 7 8 9; do
+      for d in 0 1 2 3 4 5 6 7 8 9; do
+        for e in 0 1 2 3 4 5 6 7 8 9; do
+          for f in 0 1 2 3 4 5 6 7 8 9; do
+            x=$a$b$c$d$e$f
+            if test "$f" = 9; then :; fi
+          done
+        done
+      done
+    done
+  done
+done
+EOF
+
+cat > "$CALLS" <<'EOF'
+count() {
+  n=$1
+  if test "$n" = 9; then return 1; fi
+  return 0
+}
+for a in 0 1 2 3 4 5 6 7 8 9; do
+  for b in 0 1 2 3 4 5 6 7 8 9; do
+    for c in 0 1 2 3 4 5 6 7 8 9; do
+      for d in 0 1 2 3 4 5 6 7 8 9; do
+        for e in 0 1 2 3 4 5 6 7 8 9; do
+          count $e || :
+        done
+      done
+    done
+  done
+done
+EOF
+
+run() {
+    start=$(date +%s%N)
+    "$1" "$3" > /dev/null 2>&1
+    status=$?
+    end=$(date +%s%N)
+    [ "$status" -eq 0 ] || echo "warning: $1 exited with status $status" >&2
+    elapsed_ns=$((end - start))
+    [ "$elapsed_ns" -gt 0 ] || elapsed_ns=1
+    echo "$1 ($2): $4 iterations in $((elapsed_ns / 1000000)) ms," \
+         "$(($4 * 1000000000 / elapsed_ns)) iterations/sec"
+}
+
+for shell in "$@"; do
+    got=$(timeout 10 "$shell" "$CHECK" 2>&1)
+    got=$(echo $got)
+    [ "$got" = "$CHECK_WANT" ] || echo "warning: $shell: break/continue/return check printed '$got', want '$CHECK_WANT'" >&2
+    run "$shell" loop "$LOOP" 1000000
+    run "$shell" function "$CALLS" 100000
+done
@@ -0,0 +1,88 @@
+/*
+ * Run one command and report its wall time and peak RSS.
+ *
+ * The command's stdin comes from -i FILE (default /dev/null) and its
+ * output is discarded. Prints "<wall microseconds> <max RSS KB> <exit
+ * status>" on stdout. Peak RSS is the largest of the command and all of
+ * its waited-for descendants, as wait4() reports it. With -t, a command
+ * still running after that many seconds is killed (status 137), so one
+ * hung shell cannot stall a whole benchmark run.
+ *
+ * Usage: bench/measure [-i input] [-t seconds] command [args...]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <spawn.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+extern char** environ;
+
+static pid_t child;
+
+static void on_alarm(int sig) {
+    (void)sig;
+    kill(child, SIGKILL);
+}
+
+int main(int argc, char** argv) {
+    posix_spawn_file_actions_t actions;
+    const char* input = "/dev/null";
+    unsigned int limit = 0;
+    struct timespec start, end;
+    struct rusage usage;
+    int argi = 1;
+    int status;
+    pid_t pid;
+
+    while (argi + 1 < argc && argv[argi][0] == '-') {
+        if (strcmp(argv[argi], "-i") == 0) {
+            input = argv[argi + 1];
+        } else if (strcmp(argv[argi], "-t") == 0) {
+            limit = atoi(argv[argi + 1]);
+        } else {
+            break;
+        }
+        argi += 2;
+    }
+    if (argi >= argc) {
+        fprintf(stderr, "usage: %s [-i input] [-t seconds] command [args...]\n", argv[0]);
+        return 2;
+    }
+
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, input, O_RDONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int err = posix_spawnp(&pid, argv[argi], &actions, NULL, argv + argi, environ);
+    if (err != 0) {
+        fprintf(stderr, "%s: %s\n", argv[argi], strerror(err));
+        return 127;
+    }
+    child = pid;
+    if (limit > 0) {
+        signal(SIGALRM, on_alarm);
+        alarm(limit);
+    }
+    while (wait4(pid, &status, 0, &usage) == -1) {
+        if (errno != EINTR) {
+            perror("wait4");
+            return 1;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    posix_spawn_file_actions_destroy(&actions);
+
+    long long wall_us = (end.tv_sec - start.tv_sec) * 1000000LL + (end.tv_nsec - start.tv_nsec) / 1000;
+    printf("%lld %ld %d\n", wall_us, usage.ru_maxrss,
+           WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+    return 0;
+}
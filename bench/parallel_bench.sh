@@ -0,0 +1,41 @@
+#!/bin/sh
+# parallel builtin: time many short jobs and a few long ones through
+# `parallel -j N`, against running the same commands one after another
+# and against `xargs -P N`.
+#
+# Usage: bench/parallel_bench.sh [shell] [short-jobs]
+
+SHELL_BIN=${1:-./miell}
+SHORT=${2:-2000}
+SLOTS=$(nproc)
+LONG=$((SLOTS * 4))
+INPUTS=$(mktemp)
+SERIAL=$(mktemp)
+trap 'rm -f "$INPUTS" "$SERIAL"' EXIT
+
+run() {
+    label=$1
+    count=$2
+    shift 2
+    start=$(date +%s%N)
+    "$@" > /dev/null 2>&1
+    end=$(date +%s%N)
+    elapsed_ns=$((end - start))
+    [ "$elapsed_ns" -gt 0 ] || elapsed_ns=1
+    echo "$label: $count jobs in $((elapsed_ns / 1000000)) ms," \
+         "$((count * 1000000000 / elapsed_ns)) jobs/sec"
+}
+
+echo "short jobs (/bin/echo), $SLOTS slots"
+seq "$SHORT" > "$INPUTS"
+sed 's|^|/bin/echo |' "$INPUTS" > "$SERIAL"
+run "  serial" "$SHORT" "$SHELL_BIN" "$SERIAL"
+run "  parallel" "$SHORT" "$SHELL_BIN" -c "parallel -j $SLOTS /bin/echo < $INPUTS"
+run "  xargs -P" "$SHORT" sh -c "xargs -P $SLOTS -n 1 /bin/echo < $INPUTS"
+
+echo "long jobs (sleep 0.25), $SLOTS slots"
+seq "$LONG" | sed 's/.*/0.25/' > "$INPUTS"
+sed 's/^/sleep /' "$INPUTS" > "$SERIAL"
+run "  serial" "$LONG" "$SHELL_BIN" "$SERIAL"
+run "  parallel" "$LONG" "$SHELL_BIN" -c "parallel -j $SLOTS sleep < $INPUTS"
+run "  parallel -j $LONG" "$LONG" "$SHELL_BIN" -c "parallel -j $LONG sleep < $INPUTS"
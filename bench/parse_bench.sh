@@ -0,0 +1,35 @@
+#!/bin/sh
+# Parser throughput: parse (but do not run, `-n`) a corpus of realistic
+# command lines and report lines/sec and MB/sec.
+#
+# Usage: bench/parse_bench.sh [shell] [lines]
+
+SHELL_BIN=${1:-./miell}
+LINES=${2:-200000}
+CORPUS=$(mktemp)
+trap 'rm -f "$CORPUS"' EXIT
+
+awk -v n="$LINES" 'BEGIN {
+    c[0] = "ls -la /var/log | grep -v \"^total\" | sort -k5 -n | tail -20 > /tmp/biggest.txt"
+    c[1] = "cd /srv/app && make -j8 CFLAGS=\"-O2 -g\" 2>&1 | tee build.log || echo \"build failed\" >> errors.log"
+    c[2] = "find . -name \x27*.c\x27 -newer Makefile | xargs grep -l \"TODO\\|FIXME\" ; echo done"
+    c[3] = "cat < input.csv | cut -d, -f2,5 | awk \x27{ s += $2 } END { print s }\x27 >> totals.txt &"
+    c[4] = "git log --pretty=format:\"%h %an %s\" --since=\"2 weeks ago\" | wc -l"
+    c[5] = "tar czf backup-\\$(date).tgz src/ docs/ && scp backup*.tgz host:/backups/ || true"
+    c[6] = "echo \x27single \"quoted\" text\x27 \"double \\\"escaped\\\" text\" plain\\ word"
+    c[7] = "sort -u names.txt 2>/dev/null | comm -23 - seen.txt > new.txt; wc -l new.txt"
+    for (i = 0; i < n; i++) print c[i % 8]
+}' > "$CORPUS"
+bytes=$(wc -c < "$CORPUS")
+
+start=$(date +%s%N)
+"$SHELL_BIN" -n "$CORPUS"
+status=$?
+end=$(date +%s%N)
+[ "$status" -eq 0 ] || echo "warning: $SHELL_BIN -n exited with status $status" >&2
+
+elapsed_ns=$((end - start))
+[ "$elapsed_ns" -gt 0 ] || elapsed_ns=1
+echo "$SHELL_BIN: parsed $LINES lines ($bytes bytes) in $((elapsed_ns / 1000000)) ms," \
+     "$((LINES * 1000000000 / elapsed_ns)) lines/sec," \
+     "$((bytes * 1000 / elapsed_ns)) MB/sec"
@@ -0,0 +1,38 @@
+#!/bin/sh
+# Pipeline throughput: push a multi-GB file through two-stage pipelines
+# with cat(1) copying through user space, with the shell's splice pump
+# (a bare `cat` stage), and with the pump plus 1 MiB pipes
+# (MIELL_PIPE_SIZE), and report GB/s for each.
+#
+# Usage: bench/pipe_bench.sh [shell] [gigabytes]
+
+SHELL_BIN=${1:-./miell}
+GB=${2:-4}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+# A sparse file: the bytes come from the page cache, not the disk
+truncate -s "${GB}G" "$DIR/big"
+cat "$DIR/big" > /dev/null
+
+run() {
+    label=$1
+    shift
+    start=$(date +%s%N)
+    env "$@" "$SHELL_BIN" -c "$PIPELINE"
+    end=$(date +%s%N)
+    elapsed_us=$(((end - start) / 1000))
+    [ "$elapsed_us" -gt 0 ] || elapsed_us=1
+    centi=$((GB * 100000000 / elapsed_us))   # hundredths of a GB/s
+    printf '%s: %d GB in %d ms, %d.%02d GB/s\n' "$label" "$GB" \
+        $((elapsed_us / 1000)) $((centi / 100)) $((centi % 100))
+}
+
+PIPELINE="/bin/cat < $DIR/big | /bin/cat > /dev/null"
+run "cat(1), default pipes" MIELL_PIPE_SIZE=
+PIPELINE="cat < $DIR/big | cat > /dev/null"
+run "splice pump, default pipes" MIELL_PIPE_SIZE=
+run "splice pump, 1 MiB pipes" MIELL_PIPE_SIZE=1m
+PIPELINE="cat < $DIR/big | wc -c > /dev/null"
+run "pump into wc, default pipes" MIELL_PIPE_SIZE=
+run "pump into wc, 1 MiB pipes" MIELL_PIPE_SIZE=1m
@@ -0,0 +1,29 @@
+#!/bin/sh
+# Process substitution: combine the output of two commands with
+# `paste <(...) <(...)`, and the old way through two temporary files,
+# ROUNDS times each, and report the time per round.
+#
+# Usage: bench/procsub_bench.sh [shell] [lines] [rounds]
+
+SHELL_BIN=${1:-./miell}
+LINES=${2:-1000000}
+ROUNDS=${3:-20}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+i=0
+while [ "$i" -lt "$ROUNDS" ]; do
+    echo "paste <(seq $LINES) <(seq $LINES) | wc -l" >> "$DIR/substitution"
+    echo "seq $LINES > $DIR/a; seq $LINES > $DIR/b; paste $DIR/a $DIR/b | wc -l; rm $DIR/a $DIR/b" >> "$DIR/files"
+    i=$((i + 1))
+done
+
+run() {
+    start=$(date +%s%N)
+    "$SHELL_BIN" "$DIR/$1" > /dev/null 2>&1
+    end=$(date +%s%N)
+    echo "$SHELL_BIN: $2: $(((end - start) / ROUNDS / 1000)) us per round"
+}
+
+run substitution "paste <(seq) <(seq)"
+run files        "temporary files    "
@@ -0,0 +1,103 @@
+#!/bin/sh
+# Benchmark suite: drive each shell non-interactively through the hot
+# paths and report one line per measurement, with the peak RSS of the
+# run, so a change can be checked for regressions against the baseline
+# numbers of both shells.
+#
+#   trivial      commands/sec for /bin/true lines read from stdin
+#   parse        lines/sec parsed without running (`-n`; shells with -c only)
+#   spawn xN     launch latency per stage for N-stage pipelines of /bin/true
+#   pipe         GB/s for `cat FILE | wc -c` over a sparse file
+#   glob         time per expansion of a pattern over a 100k-file directory
+#
+# Usage: bench/run.sh [shell...]   (default: ./miell bench/main_shell)
+#
+# SCALE=n multiplies every workload (default 1). A run that takes
+# longer than LIMIT seconds (default 60) is killed and reported as such.
+
+MEASURE=$(dirname "$0")/measure
+SCALE=${SCALE:-1}
+LIMIT=${LIMIT:-60}
+[ $# -gt 0 ] || set -- ./miell bench/main_shell
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+if [ ! -x "$MEASURE" ]; then
+    echo "$MEASURE is missing; run \`make bench/measure\`" >&2
+    exit 1
+fi
+
+TRIVIAL=$((2000 * SCALE))
+PARSE=$((100000 * SCALE))
+PIPELINES=$((200 * SCALE))
+PIPE_GB=$((1 * SCALE))
+GLOBS=$((10 * SCALE))
+FILES=100000
+
+# Inputs shared by every shell
+awk -v n="$TRIVIAL" 'BEGIN { for (i = 0; i < n; i++) print "/bin/true" }' > "$DIR/trivial"
+awk -v n="$PARSE" 'BEGIN {
+    c[0] = "ls -la /var/log | grep -v \"^total\" | sort -k5 -n | tail -20 > /tmp/biggest.txt"
+    c[1] = "cd /srv/app && make -j8 CFLAGS=\"-O2 -g\" 2>&1 | tee build.log || echo failed >> errors.log"
+    c[2] = "find . -name \x27*.c\x27 -newer Makefile | xargs grep -l TODO ; echo done"
+    c[3] = "cat < input.csv | cut -d, -f2,5 | awk \x27{ s += $2 } END { print s }\x27 >> totals.txt &"
+    for (i = 0; i < n; i++) print c[i % 4]
+}' > "$DIR/parse"
+for depth in 1 4 10; do
+    awk -v n="$PIPELINES" -v d="$depth" 'BEGIN {
+        line = "/bin/true"
+        for (i = 1; i < d; i++) line = line " | /bin/true"
+        for (i = 0; i < n; i++) print line
+    }' > "$DIR/spawn$depth"
+done
+truncate -s "${PIPE_GB}G" "$DIR/big"
+cat "$DIR/big" > /dev/null
+echo "cat $DIR/big | wc -c" > "$DIR/pipe"
+mkdir "$DIR/files"
+(cd "$DIR/files" && awk -v n="$FILES" 'BEGIN { for (i = 0; i < n; i++) printf "file_%06d\n", i }' | xargs touch)
+awk -v n="$GLOBS" -v dir="$DIR/files" 'BEGIN { for (i = 0; i < n; i++) print "true " dir "/*99*" }' > "$DIR/glob"
+
+# measure INPUT SHELL [ARGS...]: sets wall_us, rss_kb and killed
+measure() {
+    input=$1
+    shift
+    set -- $("$MEASURE" -i "$input" -t "$LIMIT" "$@")
+    wall_us=${1:-0}
+    rss_kb=${2:-0}
+    killed=0
+    [ "${3:-0}" -ne 137 ] || killed=1
+    [ "$wall_us" -gt 0 ] || wall_us=1
+}
+
+report() {
+    result=$2
+    [ "$killed" -eq 0 ] || result="killed after ${LIMIT}s"
+    printf '%-22s %-10s %18s %10s KB\n' "$SHELL_BIN" "$1" "$result" "$rss_kb"
+}
+
+printf '%-22s %-10s %18s %13s\n' shell benchmark result "peak RSS"
+for SHELL_BIN in "$@"; do
+    measure "$DIR/trivial" "$SHELL_BIN"
+    report trivial "$((TRIVIAL * 1000000 / wall_us)) cmds/s"
+
+    if [ "$("$SHELL_BIN" -c 'echo probe' < /dev/null 2>/dev/null)" = probe ]; then
+        measure /dev/null "$SHELL_BIN" -n "$DIR/parse"
+        report parse "$((PARSE * 1000000 / wall_us)) lines/s"
+    else
+        rss_kb=-
+        killed=0
+        report parse "n/a"
+    fi
+
+    for depth in 1 4 10; do
+        measure "$DIR/spawn$depth" "$SHELL_BIN"
+        report "spawn x$depth" "$((wall_us / (PIPELINES * depth))) us/stage"
+    done
+
+    measure "$DIR/pipe" "$SHELL_BIN"
+    centi=$((PIPE_GB * 100000000 / wall_us))
+    report pipe "$((centi / 100)).$(printf %02d $((centi % 100))) GB/s"
+
+    measure "$DIR/glob" "$SHELL_BIN"
+    report glob "$((wall_us / GLOBS / 1000)) ms/expansion"
+done
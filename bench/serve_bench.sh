@@ -0,0 +1,37 @@
+#!/bin/sh
+# Server mode latency: run the same command N times through a warm
+# `miell --serve` with the miellc client, and by starting `miell -c` for
+# each one, and report the mean latency per invocation.
+#
+# Usage: bench/serve_bench.sh [shell] [client] [count] [command]
+
+SHELL_BIN=${1:-./miell}
+CLIENT=${2:-./miellc}
+COUNT=${3:-1000}
+COMMAND=${4:-true}
+DIR=$(mktemp -d)
+SOCKET=$DIR/miell.sock
+
+"$SHELL_BIN" --serve "$SOCKET" &
+SERVER=$!
+trap 'kill $SERVER; rm -rf "$DIR"' EXIT
+while [ ! -S "$SOCKET" ]; do
+    sleep 0.01
+done
+
+run() {
+    label=$1
+    shift
+    start=$(date +%s%N)
+    i=0
+    while [ "$i" -lt "$COUNT" ]; do
+        "$@" "$COMMAND" > /dev/null
+        i=$((i + 1))
+    done
+    end=$(date +%s%N)
+    echo "$label: $COUNT x '$COMMAND' in $(((end - start) / 1000000)) ms," \
+         "$(((end - start) / COUNT / 1000)) us each"
+}
+
+run "miell -c" "$SHELL_BIN" -c
+run "miellc  " "$CLIENT" "$SOCKET"
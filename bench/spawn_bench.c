@@ -0,0 +1,122 @@
+/*
+ * Spawn latency microbenchmark.
+ *
+ * Launches 1-, 4- and 10-stage pipelines of `true` through the shell's
+ * spawn_stage() and through the old fork()+dup2+execvp path, and reports
+ * the average launch latency per stage. The shell's address space is
+ * padded with -m MB of touched memory so the page-table copy that fork()
+ * pays is visible.
+ *
+ * Usage: bench/spawn_bench [-m MB] [-n iterations]
+ */
+#define main miell_main
+#include "../miell.c"
+#undef main
+
+#define MAX_STAGES 10
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static pid_t fork_exec_stage(char** args, const int* io, const int* close_fds, int close_count) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        for (int fd = 0; fd < 3; fd++) {
+            if (io[fd] != fd) {
+                dup2(io[fd], fd);
+            }
+        }
+        for (int i = 0; i < close_count; i++) {
+            close(close_fds[i]);
+        }
+        execvp(args[0], args);
+        _exit(127);
+    }
+    return pid;
+}
+
+static double run_pipeline(int stages, int use_fork) {
+    char* args[] = { "true", NULL };
+    int pipes[MAX_STAGES][2];
+    int fds[2 * MAX_STAGES];
+    int fd_count = 0;
+    pid_t pids[MAX_STAGES];
+
+    for (int i = 0; i < stages - 1; i++) {
+        if (pipe2(pipes[i], O_CLOEXEC) == -1) {
+            perror("pipe");
+            exit(1);
+        }
+        fds[fd_count++] = pipes[i][0];
+        fds[fd_count++] = pipes[i][1];
+    }
+
+    double start = now_us();
+    for (int i = 0; i < stages; i++) {
+        int io[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+        if (i > 0) {
+            io[0] = pipes[i-1][0];
+        }
+        if (i < stages - 1) {
+            io[1] = pipes[i][1];
+        }
+        pids[i] = use_fork ? fork_exec_stage(args, io, fds, fd_count)
+                           : spawn_stage(args, environ, io, -1);
+    }
+    double elapsed = now_us() - start;
+
+    for (int i = 0; i < fd_count; i++) {
+        close(fds[i]);
+    }
+    for (int i = 0; i < stages; i++) {
+        waitpid(pids[i], NULL, 0);
+    }
+    return elapsed;
+}
+
+int main(int argc, char** argv) {
+    size_t ballast_mb = 256;
+    int iterations = 200;
+    int opt;
+
+    init_vars();
+
+    while ((opt = getopt(argc, argv, "m:n:")) != -1) {
+        switch (opt) {
+        case 'm': ballast_mb = strtoul(optarg, NULL, 10); break;
+        case 'n': iterations = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-m MB] [-n iterations]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    // Touch every page so it is mapped and has to be copied by fork()
+    char* ballast = malloc(ballast_mb << 20);
+    if (ballast_mb && ballast == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    memset(ballast, 1, ballast_mb << 20);
+
+    int depths[] = { 1, 4, 10 };
+    printf("spawn latency per stage, shell RSS padded by %zu MB, %d iterations\n",
+           ballast_mb, iterations);
+    printf("%-8s %14s %14s %8s\n", "stages", "fork (us)", "spawn (us)", "speedup");
+    for (size_t d = 0; d < sizeof(depths) / sizeof(depths[0]); d++) {
+        double fork_total = 0, spawn_total = 0;
+        for (int i = 0; i < iterations; i++) {
+            fork_total += run_pipeline(depths[d], 1);
+            spawn_total += run_pipeline(depths[d], 0);
+        }
+        double per_fork = fork_total / iterations / depths[d];
+        double per_spawn = spawn_total / iterations / depths[d];
+        printf("%-8d %14.1f %14.1f %7.1fx\n", depths[d], per_fork, per_spawn, per_fork / per_spawn);
+    }
+
+    free(ballast);
+    return 0;
+}
@@ -0,0 +1,31 @@
+#!/bin/sh
+# Guarded commands: run N `true` commands as they are, under the `timeout`
+# and `limit` prefixes, and under coreutils timeout(1) (a watchdog process
+# per command), and report commands/sec for each.
+#
+# Usage: bench/timeout_bench.sh [shell] [count]
+
+SHELL_BIN=${1:-./miell}
+COUNT=${2:-5000}
+TIMEOUT_BIN=$(command -v timeout)
+TRUE_BIN=/bin/true
+SCRIPT=$(mktemp)
+trap 'rm -f "$SCRIPT"' EXIT
+
+run() {
+    awk -v n="$COUNT" -v line="$2" 'BEGIN { for (i = 0; i < n; i++) print line }' > "$SCRIPT"
+    start=$(date +%s%N)
+    "$SHELL_BIN" "$SCRIPT" > /dev/null 2>&1
+    end=$(date +%s%N)
+    elapsed_ns=$((end - start))
+    [ "$elapsed_ns" -gt 0 ] || elapsed_ns=1
+    echo "$SHELL_BIN ($1): $COUNT commands in $((elapsed_ns / 1000000)) ms," \
+         "$((COUNT * 1000000000 / elapsed_ns)) commands/sec"
+}
+
+run plain "$TRUE_BIN"
+run timeout "timeout 60 $TRUE_BIN"
+run limit "limit --nofile 256 --mem 1g $TRUE_BIN"
+if [ -n "$TIMEOUT_BIN" ]; then
+    run "timeout(1)" "$TIMEOUT_BIN 60 $TRUE_BIN"
+fi
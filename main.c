@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,11 +7,14 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <glob.h>
+#include <spawn.h>
 
 #define MAX_INPUT_SIZE 1024
 #define MAX_ARGS 64
 #define MAX_PIPES 20
 
+extern char **environ;
+
 int execute_builtin(char **args);
 int execute_command(char **args, int input_fd, int output_fd, int background, int is_last_command);
 void parse_and_execute(char *input);
@@ -124,17 +128,15 @@ void parse_and_execute(char *input) {
         return;
     }
 
-    fprintf(stderr, "DEBUG: Parsing command: %s\n", input);
-
     char **commands = tokenize(input, "|");
     int num_commands = 0;
     while (commands[num_commands] != NULL) num_commands++;
 
-    fprintf(stderr, "DEBUG: Number of commands in pipeline: %d\n", num_commands);
-
+    // Close-on-exec, so each command only keeps the ends dup2()ed onto its
+    // stdin and stdout
     int pipes[MAX_PIPES][2];
     for (int i = 0; i < num_commands - 1; i++) {
-        if (pipe(pipes[i]) == -1) {
+        if (pipe2(pipes[i], O_CLOEXEC) == -1) {
             perror("pipe");
             return;
         }
@@ -147,8 +149,6 @@ void parse_and_execute(char *input) {
         commands[num_commands-1][strlen(commands[num_commands-1]) - 1] = '\0';
     }
 
-    fprintf(stderr, "DEBUG: Background execution: %s\n", background ? "yes" : "no");
-
     int last_command_status = 0;
 
     for (int i = 0; i < num_commands; i++) {
@@ -164,12 +164,6 @@ void parse_and_execute(char *input) {
         free(args);
         args = expanded_args;
 
-        fprintf(stderr, "DEBUG: Command %d: ", i);
-        for (int j = 0; args[j] != NULL; j++) {
-            fprintf(stderr, "%s ", args[j]);
-        }
-        fprintf(stderr, "\n");
-
         if (args[0] == NULL) {
             fprintf(stderr, "Error: Empty command\n");
             // Free memory and continue to next command
@@ -193,7 +187,7 @@ void parse_and_execute(char *input) {
         for (int j = 0; args[j] != NULL; j++) {
             if (strcmp(args[j], "<") == 0) {
                 if (args[j + 1] != NULL) {
-                    input_fd = open(args[j + 1], O_RDONLY);
+                    input_fd = open(args[j + 1], O_RDONLY | O_CLOEXEC);
                     if (input_fd == -1) {
                         perror("open");
                         return;
@@ -211,7 +205,7 @@ void parse_and_execute(char *input) {
         for (int j = 0; args[j] != NULL; j++) {
             if (strcmp(args[j], ">") == 0) {
                 if (args[j + 1] != NULL) {
-                    output_fd = open(args[j + 1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                    output_fd = open(args[j + 1], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
                     if (output_fd == -1) {
                         perror("open");
                         return;
@@ -233,8 +227,6 @@ void parse_and_execute(char *input) {
             output_fd = pipes[i][1];
         }
 
-        fprintf(stderr, "DEBUG: Command %d - input_fd: %d, output_fd: %d\n", i, input_fd, output_fd);
-
         int is_last_command = (i == num_commands - 1);
         int command_status = execute_command(args, input_fd, output_fd, (is_last_command && background), is_last_command);
 
@@ -273,44 +265,30 @@ void parse_and_execute(char *input) {
     if (last_command_status != 0 && !background) {
         fprintf(stderr, "Pipeline exited with non-zero status %d\n", last_command_status);
     }
-
-    fprintf(stderr, "DEBUG: Command execution completed\n");
 }
 
 int execute_command(char **args, int input_fd, int output_fd, int background, int is_last_command) {
-    pid_t pid = fork();
-
-    if (pid == -1) {
-        perror("fork");
-        return -1;
-    } else if (pid == 0) {
-        // Child process
-        if (input_fd != STDIN_FILENO) {
-            dup2(input_fd, STDIN_FILENO);
-            close(input_fd);
-        }
-
-        if (output_fd != STDOUT_FILENO) {
-            dup2(output_fd, STDOUT_FILENO);
-            close(output_fd);
-        }
+    posix_spawn_file_actions_t actions;
+    pid_t pid;
+
+    // The child-side fd setup is done by posix_spawn file actions, so the
+    // shell's address space is never copied. Pipes and redirected files are
+    // close-on-exec; dup2() clears the flag on the copies made here.
+    posix_spawn_file_actions_init(&actions);
+    if (input_fd != STDIN_FILENO) {
+        posix_spawn_file_actions_adddup2(&actions, input_fd, STDIN_FILENO);
+    }
 
-        // Close all other pipe file descriptors
-        for (int i = 3; i < 20; i++) {  // Assuming max file descriptor is less than 20
-            if (i != input_fd && i != output_fd) {
-                close(i);
-            }
-        }
+    if (output_fd != STDOUT_FILENO) {
+        posix_spawn_file_actions_adddup2(&actions, output_fd, STDOUT_FILENO);
+    }
 
-        fprintf(stderr, "DEBUG: Executing command: %s\n", args[0]);
-        for (int i = 0; args[i] != NULL; i++) {
-            fprintf(stderr, "DEBUG: arg[%d] = %s\n", i, args[i]);
-        }
+    int err = posix_spawnp(&pid, args[0], &actions, NULL, args, environ);
+    posix_spawn_file_actions_destroy(&actions);
 
-        execvp(args[0], args);
-        // If execvp returns, it must have failed
+    if (err != 0) {
         fprintf(stderr, "Error: Command not found or failed to execute: %s\n", args[0]);
-        exit(1);
+        return 1;
     } else {
         // Parent process
         if (!background) {
@@ -318,7 +296,6 @@ int execute_command(char **args, int input_fd, int output_fd, int background, in
             waitpid(pid, &status, 0);
             if (WIFEXITED(status)) {
                 int exit_status = WEXITSTATUS(status);
-                fprintf(stderr, "DEBUG: Command '%s' exited with status %d\n", args[0], exit_status);
                 return exit_status;
             } else if (WIFSIGNALED(status)) {
                 fprintf(stderr, "Command '%s' killed by signal %d\n", args[0], WTERMSIG(status));
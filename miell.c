@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,420 +7,8193 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <time.h>
-#include <stdarg.h>
-#include <glob.h>
+#include <dirent.h>
+#include <pwd.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/signalfd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <signal.h>
+#include <ctype.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/prctl.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/file.h>
+#include <sys/sendfile.h>
 
-#define MAX_INPUT_SIZE 1024
-#define MAX_ARG_COUNT 64
-#define MAX_PIPE_COUNT 10
-#define DEBUG 0  // Set to 0 to disable debug logging
+#define READ_BUFFER_SIZE (256 * 1024)
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define GLOB_MAX_THREADS 8
+#define CMD_HASH_SIZE 128
+#define SERVE_SPARES 4        // --serve: forks kept waiting for a connection
+#define SERVE_REQUEST_MAX (1 << 20)   // --serve: longest command text accepted
+#define PUMP_CHUNK (1 << 30)  // upper bound per splice/copy_file_range call
+#define TRACE_EVENTS 4096     // ring buffer slots; must be a power of two
+#define FAN_OUT_PIPE_SIZE (1 << 20)   // "> a > b" pipe unless MIELL_PIPE_SIZE is set
+#define HISTORY_BUCKETS 65536 // bigram/trigram buckets in the reverse-search index
+#define HISTORY_BLOCK 64      // history entries per index posting
+#define DIR_CACHE_SIZE 64     // buckets of cached directory listings
+#define CACHE_FILES_SIZE 256  // buckets of remembered file digests for `cached`
+#define CACHE_DEFAULT_LIMIT (256LL << 20)   // result cache cap unless MIELL_CACHE_SIZE is set
+#define CACHE_MAGIC "MIELLC1"
+#define FUNCTION_BUCKETS 64   // shell functions by name
+#define FUNCTION_NESTING 1000 // calls deep before a runaway recursion is stopped
+#define TIMEOUT_KILL_AFTER 5  // seconds from SIGTERM to SIGKILL for `timeout` unless -k says
+#define TIMEOUT_STATUS 124    // exit status of a pipeline stopped by `timeout`
+
+extern char** environ;
+
+// Remembered command locations, filled on first lookup (see `hash`)
+struct cmd_hash_entry {
+    char* name;
+    char* path;
+    unsigned int hits;
+    struct cmd_hash_entry* next;
+};
+
+static struct cmd_hash_entry* cmd_hash[CMD_HASH_SIZE];
+static char* cmd_hash_path = NULL;  // $PATH the table was filled under
+
+/*
+ * Shell variables, in an open-addressing table (linear probing, power of
+ * two size). Exported ones also own a "NAME=value" string in env_vec,
+ * which is what environ points at: it is patched in place when an
+ * exported variable changes, so a spawn passes it along as it is.
+ */
+struct var {
+    char* name;             // NULL: never used; VAR_DELETED: removed
+    char* value;            // NULL while exported but not yet set
+    int exported;
+    int env_index;          // slot in env_vec, or -1
+};
+
+static char var_deleted[] = "";
+#define VAR_DELETED var_deleted
+
+static struct var* var_table = NULL;
+static size_t var_capacity = 0;     // power of two
+static size_t var_used = 0;         // live entries plus VAR_DELETED slots
+static char** env_vec = NULL;       // NULL-terminated; environ points here
+static int env_count = 0;
+static int env_capacity = 0;
+static pid_t shell_pid = 0;         // $$, the same in every subshell
+
+// Process substitutions started for the command being run
+struct substitution {
+    pid_t pid;
+    int fd;                 // the shell's end, named by /dev/fd/N
+    int output;
+};
+
+static struct substitution* substitutions = NULL;
+static int substitution_count = 0;
+static int substitution_capacity = 0;
+
+enum job_state { JOB_RUNNING, JOB_STOPPED, JOB_DONE };
+
+// Report styles for the `time` keyword: plain, -p (POSIX) and -j (JSON)
+enum time_format { TIME_NONE, TIME_HUMAN, TIME_POSIX, TIME_JSON };
+
+// What `time` records about one pipeline stage
+struct stage_timing {
+    pid_t pid;
+    char* name;             // argv[0]
+    long long launched_ns;  // CLOCK_MONOTONIC when the launch began
+    long long launch_ns;    // launch call to exec (or fork return)
+    long long reaped_ns;
+    struct rusage usage;
+};
+
+// A pipeline started by handle_pipes(), tracked until it is reaped
+struct job {
+    int id;
+    pid_t pgid;             // -1 when the stages share the shell's group
+    int count;
+    int live;               // stages not yet reaped
+    enum job_state state;
+    int foreground;
+    int notified;           // "Stopped" already reported
+    char* command;
+    pid_t* pids;            // -1 for stages that failed to spawn
+    int* statuses;
+    enum time_format timed;
+    long long started_ns;
+    struct stage_timing* timing;    // per stage, only for timed jobs
+    int timer_fd;           // `timeout` deadline (a timerfd), or -1
+    long long kill_after_ns;        // from SIGTERM to SIGKILL; 0 never sends SIGKILL
+    int expired;            // the deadline passed: 1 after SIGTERM, 2 after SIGKILL
+};
+
+/*
+ * Line source for the main loop. Input is read in large blocks and lines
+ * are terminated in place, so there is no length limit and no per-line
+ * copy; the buffer only grows when a single line outgrows it.
+ */
+struct line_reader {
+    int fd;                 // -1 for an in-memory string (`-c`)
+    char* buf;
+    size_t cap;
+    size_t start;           // first unconsumed byte
+    size_t end;             // end of valid data
+    int eof;
+};
+
+/*
+ * Command history. The file is opened O_APPEND, so each new line lands
+ * whole even with several shells writing, and is mmap'd at startup
+ * rather than read: entries[] is only built from the mapping the first
+ * time history is recalled, and the search index the first time Ctrl-R
+ * is pressed.
+ */
+struct history_entry {
+    const char* text;       // in the mapping, or malloc'd for this session
+    uint32_t len;
+};
+
+// Blocks (HISTORY_BLOCK entries each) holding some line with a bigram or
+// trigram that hashes to this bucket, oldest first
+struct history_posting {
+    uint32_t* blocks;
+    uint32_t count;
+    uint32_t capacity;
+};
+
+struct history {
+    int fd;                 // -1: nothing is saved
+    char* map;              // the file as it was at startup
+    size_t map_len;
+    int loaded;             // entries[] includes the mapped lines
+    struct history_entry* entries;
+    size_t count;
+    size_t capacity;
+    struct history_posting* index;  // HISTORY_BUCKETS lists, or NULL
+};
+
+/*
+ * Tab completion. Directory listings are cached, sorted, until the
+ * directory's mtime changes; the command trie is built from the
+ * listings of the $PATH directories and the builtins.
+ */
+#define ENTRY_DIR 1
+#define ENTRY_EXEC 2
+#define entry_kind(name) ((unsigned char)(name)[-1])   // ENTRY_* flags
+
+struct dir_listing {
+    char* path;
+    struct timespec mtime;
+    unsigned long generation;   // bumped whenever it is read again
+    char* pool;             // each name follows its ENTRY_* byte
+    char** names;           // sorted
+    size_t count;
+    int exec_checked;       // ENTRY_EXEC has been filled in
+    struct dir_listing* next;
+};
+
+struct trie_node {
+    unsigned char* labels;  // sorted, one per child
+    struct trie_node** children;
+    int count;
+    const char* name;       // a command ends here
+};
+
+// What the word before the cursor can become
+struct completion {
+    size_t start;           // first byte of the line that is replaced
+    const char** names;     // sorted
+    unsigned char* kinds;   // ENTRY_* flags
+    size_t count;
+    size_t capacity;
+};
+
+// Raw-mode editing of one terminal line; see edit_line()
+struct line_editor {
+    int active;             // the terminal is in raw mode for a line
+    struct termios cooked;
+    const char* prompt;
+    char* buf;
+    size_t len;
+    size_t cap;
+    size_t cursor;
+    size_t recall;          // history entry shown, or history.count
+    char* draft;            // the line as typed, kept while recalling
+    int searching;          // Ctrl-R
+    char query[256];
+    size_t query_len;
+    size_t match;           // entry the query was found in
+    int failed;
+};
+
+/*
+ * Bump allocator for everything a command line needs while it is parsed
+ * and run (argv arrays, pipeline arrays, expanded words). It is reset once
+ * per line and keeps its chunks, so steady-state parsing never touches
+ * the heap.
+ */
+struct arena_chunk {
+    struct arena_chunk* next;
+    size_t size;
+    size_t used;
+    char data[];
+};
+
+struct arena {
+    struct arena_chunk* first;
+    struct arena_chunk* current;
+    size_t allocs;          // since the last reset
+    size_t bytes;
+    size_t chunk_mallocs;
+};
+
+// A point in an arena to roll back to: loops free each pass's expansions
+struct arena_mark {
+    struct arena_chunk* chunk;
+    size_t used;
+};
+
+/*
+ * The chunks of a line that defines functions. The bodies stay where they
+ * were parsed, so instead of being reset for the next line the chunks are
+ * handed to the functions, and freed once nothing refers to them.
+ */
+struct source {
+    struct arena_chunk* chunks;
+    int refs;
+};
+
+static struct arena line_arena;
+static int show_stats = 0;   // --stats: report arena usage per line
+static int no_exec = 0;      // -n: parse input but run nothing
+static const char* serve_path = NULL;   // --serve: socket to accept requests on
+static int serve_client = -1;           // connection a forked request child answers
+
+// A $NAME or ${NAME} in a word, cut out of its text by the lexer and
+// put back, with the variable's current value, when the word is expanded.
+// A <(list) or >(list) is kept the same way and becomes a /dev/fd path.
+struct word_var {
+    const char* name;       // also "?" and "$"; the list's text for <(...)
+    size_t offset;          // where the value goes in text
+    size_t pattern_offset;  // and in pattern
+    int quoted;             // inside "...": no field splitting or globbing
+    struct node* command;   // process substitution, or NULL
+    int output;             // >(...) rather than <(...)
+    struct word_var* next;
+};
+
+// A word after quote removal. `pattern` is only set when the word has
+// unquoted glob characters or variables; quoted characters are
+// backslash-escaped in it.
+struct word {
+    char* text;
+    char* pattern;
+    struct word_var* vars;  // in text order
+    int assign;             // length of NAME in a leading NAME=value, else 0
+};
+
+// Paths produced by the glob engine; each one is malloc'd
+struct glob_result {
+    char** paths;
+    size_t count;
+    size_t capacity;
+};
+
+enum redirect_type { REDIR_IN, REDIR_OUT, REDIR_APPEND, REDIR_DUP, REDIR_HEREDOC, REDIR_HERESTRING };
+
+struct redirect {
+    enum redirect_type type;
+    int fd;                 // descriptor being redirected
+    struct word target;     // file name, source descriptor for REDIR_DUP,
+                            // here-document delimiter, or here-string
+    struct word body;       // REDIR_HEREDOC: the text, read after the line
+    int strip_tabs;         // <<-
+    int expand;             // delimiter was unquoted: $ works in the body
+    struct redirect* next;
+};
+
+// One stage of a pipeline; argv is filled in just before it runs
+struct command {
+    struct word* assigns;   // NAME=value words before the command name
+    int assign_count;
+    struct word* words;
+    int word_count;
+    struct redirect* redirects;
+    char** argv;
+    int argc;
+    struct node* body;      // a compound command (if, for, { ... }, f() ...) instead of words
+};
+
+// The `cached` keyword: run through the result cache, or `cached -c`
+enum cache_mode { CACHE_NONE, CACHE_RUN, CACHE_CLEAR };
+
+// 128-bit key of a `cached` pipeline, or of one file's contents
+struct digest {
+    uint64_t a;
+    uint64_t b;
+    uint64_t len;           // bytes folded in so far
+};
+
+struct file_digest {
+    dev_t dev;
+    ino_t ino;
+    off_t size;             // -1: not valid
+    struct timespec mtime;
+    struct timespec ctime;
+    struct digest digest;
+    struct file_digest* next;
+};
+
+// A result cache entry is this header, then stdout, then stderr
+struct cache_header {
+    char magic[8];
+    int32_t status;
+    uint32_t unused;
+    uint64_t out_len;
+    uint64_t err_len;
+};
+
+enum { CACHE_HITS, CACHE_MISSES, CACHE_STORES, CACHE_EVICTIONS, CACHE_COUNTERS };
+enum { CACHE_PEEK = -2, CACHE_RESET = -1 };     // cache_count() without a counter
+
+struct cache_stats {
+    uint64_t counts[CACHE_COUNTERS];
+};
+
+// `limit` options, in the order of limit_options[]
+enum { LIMIT_CPU, LIMIT_MEM, LIMIT_NOFILE, LIMIT_COUNT };
+
+/*
+ * `timeout` and `limit` prefixes. The values stay words until the
+ * pipeline runs, so a loop can vary them.
+ */
+struct guard {
+    struct word* timeout;       // DURATION, or NULL
+    struct word* kill_after;    // -k DURATION, or NULL for the default
+    struct word* limits[LIMIT_COUNT];   // NULL where not given
+};
+
+// The limits of one run of a guarded pipeline, applied in each stage
+struct limits {
+    int set;                    // bit per LIMIT_*
+    rlim_t values[LIMIT_COUNT];
+};
+
+struct pipeline {
+    struct command* commands;
+    int count;
+    enum time_format timed;     // prefixed with the `time` keyword
+    enum cache_mode cached;
+    int negated;                // prefixed with !
+    struct guard* guard;        // prefixed with `timeout` or `limit`, or NULL
+};
+
+enum node_type {
+    NODE_PIPELINE, NODE_AND, NODE_OR, NODE_SEQUENCE, NODE_BACKGROUND,
+    NODE_IF, NODE_WHILE, NODE_UNTIL, NODE_FOR, NODE_GROUP, NODE_FUNCTION
+};
+
+/*
+ * Parsed command line: pipelines joined by ;, &, && and ||. Compound
+ * commands hang off a command's body:
+ *   NODE_IF        if left; then right; else other; fi (other may be an elif NODE_IF)
+ *   NODE_WHILE     while left; do right; done, and NODE_UNTIL the same
+ *   NODE_FOR       for name in words; do right; done (word_count -1: no `in`)
+ *   NODE_GROUP     { left; }
+ *   NODE_FUNCTION  name() left
+ * Each is compiled to a program when it is parsed.
+ */
+struct node {
+    enum node_type type;
+    struct node* left;
+    struct node* right;         // unused by NODE_PIPELINE and NODE_BACKGROUND
+    struct pipeline pipeline;   // NODE_PIPELINE only
+    struct node* other;
+    const char* name;
+    struct word* words;
+    int word_count;
+    struct program* code;
+};
+
+/*
+ * Compound commands run as bytecode: a flat array of instructions with
+ * jumps for the control flow, and the pipelines inside them as they were
+ * parsed. A loop body is parsed and compiled once; each pass only expands
+ * its words again.
+ */
+enum opcode {
+    OP_EXEC,        // run ref (a pipeline or background node)
+    OP_JUMP,        // go to target
+    OP_JUMP_FAIL,   // go to target if the status is not 0
+    OP_JUMP_OK,     // go to target if it is
+    OP_STATUS,      // the status is arg
+    OP_LOOP,        // enter a while/until loop
+    OP_FOR,         // enter a for loop over ref's words
+    OP_NEXT,        // next item into ref's variable, or go to target when done
+    OP_TOP,         // start another pass of a while/until loop
+    OP_SAVE,        // remember the status as the loop's
+    OP_EXIT,        // leave a loop with its status
+    OP_UNWIND,      // break/continue: leave arg loops and go to target
+    OP_RETURN,      // leave the function, with ref (a word) as the status if set
+    OP_DEFINE       // define the function ref
+};
+
+struct instr {
+    enum opcode op;
+    int arg;
+    int target;
+    void* ref;
+};
+
+struct program {
+    struct instr* code;
+    int count;
+    int capacity;
+    int loop_depth;         // deepest loop nesting
+};
+
+// A loop being run: the arena position each pass starts from, and for
+// `for` the items left
+struct loop_frame {
+    struct arena_mark mark;
+    char** items;
+    int count;
+    int index;
+    int status;
+    int top;                // where the next pass starts
+    int end;                // just past the loop
+};
+
+struct function {
+    char* name;
+    struct node* def;           // NODE_FUNCTION
+    struct source* source;      // holds def, or NULL
+    struct function* next;
+};
+
+enum token_type {
+    TOK_WORD, TOK_PIPE, TOK_AMP, TOK_SEMI, TOK_AND, TOK_OR,
+    TOK_LESS, TOK_GREAT, TOK_DGREAT, TOK_LESSAND, TOK_GREATAND,
+    TOK_DLESS, TOK_DLESSDASH, TOK_TLESS,
+    TOK_END, TOK_ERROR
+};
+
+struct token {
+    enum token_type type;
+    int io_number;          // leading descriptor of a redirection, or -1
+    struct word word;
+    int quoted;             // the word had quotes or backslashes in it
+};
+
+/*
+ * Single-pass lexer: bytes are consumed exactly once, left to right, and
+ * words come out with quotes and escapes already resolved. The parser
+ * pulls one token of lookahead at a time; when a construct is left open
+ * at the end of a line (a trailing |, && or ||, an open quote, or a
+ * backslash-newline) the next line is requested through next_line.
+ */
+struct lexer {
+    const char* p;
+    struct token current;
+    char* (*next_line)(void);
+    int error;
+    struct redirect** heredocs; // << redirections still waiting for a body
+    int heredoc_count;
+    int heredoc_capacity;
+    int function_depth;         // inside this many function bodies
+    int functions;              // function definitions parsed
+};
+
+enum trace_type {
+    TRACE_LINE,         // text: the command line
+    TRACE_PIPELINE,     // a: stage count, b: 1 if in the background
+    TRACE_PIPE,         // a: read fd, b: write fd
+    TRACE_REDIRECT,     // a: fd, b: the descriptor opened for it, text: target
+    TRACE_SPAWN,        // a: pid, text: argv[0]
+    TRACE_CHILD,        // logged by a forked child before it runs; a: parent pid, text: role
+    TRACE_BUILTIN,      // text: name; run in the shell process
+    TRACE_REAP,         // a: pid, b: wait status
+    TRACE_JOB,          // a: job id, b: pgid, text: command; started in the background
+    TRACE_HASH,         // a: HASH_*, text: path
+    TRACE_CACHE,        // a: 1 on a hit, b: its status, text: entry
+    TRACE_TIMEOUT,      // a: pgid, b: the signal sent, text: command
+    TRACE_ERROR         // a: errno, b: detail, text: what failed
+};
+
+enum { HASH_ADDED, HASH_STALE, HASH_CLEARED };
+
+/*
+ * Trace ring, shared (MAP_SHARED) with every child the shell forks so
+ * their events land in the same buffer. Writers claim a slot with an
+ * atomic increment of head and publish it by storing its sequence
+ * number last; a reader skips slots whose number does not match.
+ */
+struct trace_event {
+    uint64_t seq;           // claim index + 1 once the event is complete
+    uint64_t ns;            // CLOCK_MONOTONIC
+    int32_t pid;
+    uint16_t type;
+    uint16_t unused;
+    int64_t a;
+    int64_t b;
+    char text[88];
+};
+
+struct trace_ring {
+    uint64_t head;
+    uint64_t base_ns;       // times are reported relative to this
+    struct trace_event events[TRACE_EVENTS];
+};
+
+static struct trace_ring* trace_ring = NULL;
+static int trace_enabled = 0;
+static pid_t trace_pid = 0;         // this process, cached for trace()
+static pid_t trace_owner = 0;       // the shell that writes MIELL_TRACE on exit
+static char* trace_file = NULL;
+
+static struct file_digest* file_digests[CACHE_FILES_SIZE];   // `cached` argument files
+
+static struct job** jobs = NULL;
+static int job_count = 0;
+static int job_capacity = 0;
+
+static int shell_interactive = 0;
+static pid_t shell_pgid = 0;
+static int signal_fd = -1;   // SIGCHLD delivered as readable events
+static int event_fd = -1;    // epoll set: signal_fd, plus stdin when interactive
+static int deadline_fd = -1; // epoll set: signal_fd and `timeout` timers; itself in event_fd
+static int deadline_count = 0;      // jobs with a timer armed
+static int job_timed_out = 0;       // the last job waited for ran out of time
+static const struct limits* stage_limits = NULL;    // set while a `limit` pipeline starts
+static const char* limit_options[LIMIT_COUNT] = { "--cpu", "--mem", "--nofile" };
+static const int limit_resources[LIMIT_COUNT] = { RLIMIT_CPU, RLIMIT_AS, RLIMIT_NOFILE };
+static int last_status = 0;
+static struct line_reader* input_reader = NULL;
+static int line_editing = 0;         // stdin is a terminal we edit lines on
+static struct history history = { -1, NULL, 0, 0, NULL, 0, 0, NULL };
+static struct line_editor editor;
+static struct dir_listing* dir_cache[DIR_CACHE_SIZE];
+static unsigned long listing_generation = 0;
+static struct trie_node* command_trie = NULL;
+static char* command_trie_path = NULL;          // $PATH the trie was built for
+static unsigned long command_trie_generation = 0;   // newest listing in it
+static struct function* functions[FUNCTION_BUCKETS];
+static int function_count = 0;
+static int call_depth = 0;
+static int function_return = 0;     // `return` ran; unwinding to the call
+static int loops_running = 0;       // loops around the command running now, in this function
+static int loop_unwind = 0;         // a `break`/`continue` ran: loops still to leave
+static int loop_continue = 0;       // ... and then start the next pass of the last one
+static struct source* current_source = NULL;    // holds the code running now
+static const char* script_name = "miell";       // $0
+static char** positional = NULL;                // $1, $2, ...
+static int positional_count = 0;
 
 // Function prototypes
-char** parse_input(char* input, int* arg_count);
-int execute_builtin(char** args);
-void execute_command(char** args, int input_fd, int output_fd, int is_background);
-void handle_pipes(char*** commands, int command_count, int is_background);
-void handle_redirection(char** args, int* arg_count, int* input_fd, int* output_fd);
-void free_commands(char*** commands, int command_count);
-void debug_log(const char* format, ...);
-char** expand_wildcards(char** args, int* arg_count);
-void execute_background_commands(char* input);
+void lexer_init(struct lexer* lx, const char* input, char* (*next_line)(void));
+void trace(enum trace_type type, long a, long b, const char* text);
+void trace_child(const char* role);
+int builtin_trace(char** args);
+struct node* parse_list(struct lexer* lx);
+int execute_node(struct node* node);
+struct builtin;
+const struct builtin* find_builtin(const char* name);
+int execute_builtin(const struct builtin* builtin, struct command* cmd);
+pid_t spawn_builtin(const struct builtin* builtin, char** args, const int* io,
+                    pid_t pgid);
+pid_t spawn_pump(struct command* cmd, const int* io, pid_t pgid);
+int builtin_cd(char** args);
+int builtin_exit(char** args);
+int builtin_fg(char** args);
+int builtin_bg(char** args);
+int builtin_echo(char** args);
+int builtin_printf(char** args);
+int builtin_test(char** args);
+int builtin_true(char** args);
+int builtin_false(char** args);
+int builtin_pwd(char** args);
+int builtin_export(char** args);
+int builtin_unset(char** args);
+int builtin_break(char** args);
+int builtin_return(char** args);
+int builtin_shift(char** args);
+void init_vars(void);
+const char* var_get(const char* name);
+void var_set(const char* name, const char* value, int export);
+void var_unset(const char* name);
+int builtin_parallel(char** args);
+int time_builtin(const struct builtin* builtin, struct pipeline* pipeline);
+static int status_code(int status);
+static unsigned int hash_string(const char* str);
+static pid_t fork_stage(const int* io, pid_t pgid, const int* keep, int keep_count);
+static void editor_refresh(void);
+static long long monotonic_ns(void);
+static int valid_name(const char* name, size_t len);
+void report_timing(enum time_format format, long long real_ns, const struct stage_timing* stages,
+                   int count, const int* statuses);
+int handle_pipes(struct pipeline* pipeline, int is_background, const int* std_io);
+int run_cached(struct pipeline* pipeline);
+int cache_report(int clear);
+struct program* compile(struct node* node, int in_function);
+int run_program(const struct program* program);
+int run_compound(struct node* node);
+pid_t spawn_compound(struct node* node, const int* io, pid_t pgid);
+const struct function* find_function(const char* name);
+void define_function(struct node* def);
+int call_function(char** args);
+pid_t spawn_stage(char** args, char** envp, const int* io, pid_t pgid);
+const char* hash_lookup(const char* name);
+void hash_forget(const char* name);
+void hash_clear(void);
+int builtin_hash(char** args);
+int handle_redirection(struct redirect* redirects, int* io);
+void* arena_alloc(struct arena* arena, size_t size);
+char* arena_strdup(struct arena* arena, const char* str);
+void arena_reset(struct arena* arena);
+struct arena_mark arena_mark(struct arena* arena);
+void arena_release(struct arena* arena, struct arena_mark mark);
+static struct source* arena_detach(struct arena* arena);
+static void source_release(struct source* source);
+char** expand_words(struct word* words, int word_count, int* arg_count);
+char* expand_word(struct word* word);
+size_t glob_expand(const char* pattern, struct glob_result* result);
+void glob_result_free(struct glob_result* result);
+char* describe_pipeline(struct pipeline* pipeline);
 void display_prompt(void);
+void reader_init_fd(struct line_reader* reader, int fd);
+void reader_init_string(struct line_reader* reader, const char* str);
+char* reader_read_line(struct line_reader* reader);
+int reader_has_line(struct line_reader* reader);
+void history_open(const char* path);
+void history_add(const char* line);
+size_t history_search(const char* query, size_t len, size_t before);
+char* edit_line(struct line_reader* reader, const char* prompt);
+void complete_word(const char* line, size_t cursor, struct completion* c);
+void run_line(char* input);
+void init_job_control(void);
+void init_trace(void);
+int serve(const char* path);
+int wait_for_input(struct line_reader* reader);
+void reap_children(void);
+void notify_jobs(void);
+struct job* add_job(const char* command, int command_count, const pid_t* pids, pid_t pgid, int is_background);
+void remove_job(struct job* job);
+int wait_for_job(struct job* job, int foreground);
+static int init_events(void);
+static int watch_deadline(struct job* job, long long timeout_ns, long long kill_after_ns);
+static int run_deadlines(int timeout_ms);
+static int resolve_guard(struct guard* guard, long long* timeout_ns, long long* kill_after_ns,
+                         struct limits* limits);
+static int apply_limits(const struct limits* limits);
+int builtin_jobs(char** args);
+int builtin_fg_bg(char** args, int foreground);
+int builtin_wait(char** args);
+
+int main(int argc, char** argv) {
+    struct line_reader reader;
+    char* input;
+    int argi = 1;
+
+    init_vars();
+
+    while (argi < argc && (strcmp(argv[argi], "--stats") == 0 || strcmp(argv[argi], "-n") == 0)) {
+        if (argv[argi][1] == 'n') {
+            no_exec = 1;
+        } else {
+            show_stats = 1;
+        }
+        argi++;
+    }
+    if (argi < argc && strcmp(argv[argi], "--serve") == 0) {
+        if (argi + 1 >= argc) {
+            fprintf(stderr, "miell: --serve: option requires a socket path\n");
+            return 2;
+        }
+        serve_path = argv[argi + 1];
+        init_trace();
+        init_job_control();
+        return serve(serve_path);
+    }
+    if (argi + 1 < argc && strcmp(argv[argi], "-c") == 0) {
+        reader_init_string(&reader, argv[argi + 1]);
+        // miell -c command [name [args...]]
+        if (argi + 2 < argc) {
+            script_name = argv[argi + 2];
+            positional = argv + argi + 3;
+            positional_count = argc - argi - 3;
+        }
+    } else if (argi < argc && strcmp(argv[argi], "-c") == 0) {
+        fprintf(stderr, "miell: -c: option requires an argument\n");
+        return 2;
+    } else if (argi < argc) {
+        int fd = open(argv[argi], O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            fprintf(stderr, "miell: %s: %s\n", argv[argi], strerror(errno));
+            return 127;
+        }
+        reader_init_fd(&reader, fd);
+        script_name = argv[argi];
+        positional = argv + argi + 1;
+        positional_count = argc - argi - 1;
+    } else {
+        reader_init_fd(&reader, STDIN_FILENO);
+    }
+
+    input_reader = &reader;
+    init_trace();
+    init_job_control();
+    if (reader.fd != STDIN_FILENO) {
+        // Scripts and -c strings never prompt or wait on the terminal
+        shell_interactive = 0;
+    }
+    if (shell_interactive) {
+        const char* term = var_get("TERM");
+        const char* file = var_get("HISTFILE");
+        const char* home = var_get("HOME");
+        char path[PATH_MAX];
+
+        line_editing = isatty(STDOUT_FILENO) && tcgetattr(STDIN_FILENO, &editor.cooked) == 0 &&
+                       (term == NULL || strcmp(term, "dumb") != 0);
+        if (file == NULL && home != NULL) {
+            snprintf(path, sizeof(path), "%s/.miell_history", home);
+            file = path;
+        }
+        if (file != NULL && *file != '\0') {
+            history_open(file);
+        }
+    }
+
+    while (1) {
+        reap_children();
+        notify_jobs();
+        display_prompt();
+
+        if (line_editing) {
+            if ((input = edit_line(&reader, "miell> ")) == NULL) {
+                break;
+            }
+        } else if (!wait_for_input(&reader) || (input = reader_read_line(&reader)) == NULL) {
+            break;
+        }
+        if (shell_interactive) {
+            history_add(input);
+        }
+        trace(TRACE_LINE, 0, 0, input);
+
+        run_line(input);
+    }
+
+    return last_status;
+}
+
+static void report_stats(void) {
+    if (show_stats) {
+        fprintf(stderr, "stats: %zu arena allocations, %zu bytes, %zu heap chunks allocated\n",
+                line_arena.allocs, line_arena.bytes, line_arena.chunk_mallocs);
+    }
+}
+
+// Continuation lines for constructs left open at the end of a line
+static char* next_input_line(void) {
+    if (line_editing) {
+        return edit_line(input_reader, "> ");
+    }
+    if (shell_interactive) {
+        printf("> ");
+        fflush(stdout);
+    }
+    if (!wait_for_input(input_reader)) {
+        return NULL;
+    }
+    return reader_read_line(input_reader);
+}
+
+void run_line(char* input) {
+    struct lexer lx;
+
+    arena_reset(&line_arena);
+    lexer_init(&lx, input, input_reader ? next_input_line : NULL);
+    struct node* tree = parse_list(&lx);
+    if (lx.error) {
+        last_status = 2;
+    } else if (tree != NULL && !no_exec) {
+        // Function bodies defined here outlive the line
+        struct source* source = lx.functions > 0 ? arena_detach(&line_arena) : NULL;
+        current_source = source;
+        last_status = execute_node(tree);
+        current_source = NULL;
+        source_release(source);
+    }
+    report_stats();
+}
+
+// atexit handler: a request child tells its client how the request ended
+static void serve_reply(void) {
+    if (serve_client != -1) {
+        int32_t status = last_status;
+        fflush(stdout);
+        send(serve_client, &status, sizeof(status), MSG_NOSIGNAL);
+        serve_client = -1;
+    }
+}
+
+// Turn a request down: the client gets status 2 instead of a dropped connection
+static void serve_refuse(int client, const char* why) {
+    fprintf(stderr, "miell: request refused: %s\n", why);
+    serve_client = client;
+    last_status = 2;
+    exit(last_status);
+}
+
+/*
+ * Run one request in a forked copy of the server. The client sends a
+ * 32-bit length with its stdin, stdout and stderr attached (SCM_RIGHTS),
+ * then the command text; the reply is the 32-bit exit status.
+ */
+static void serve_request(int client) {
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    uint32_t len;
+    struct iovec iov = { &len, sizeof(len) };
+    struct msghdr msg = { 0 };
+    int fds[3];
+    int nfds = 0;
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(client, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC) != sizeof(len)) {
+        _exit(1);
+    }
+    for (struct cmsghdr* c = CMSG_FIRSTHDR(&msg); c != NULL; c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+            int count = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (int i = 0; i < count; i++) {
+                int fd;
+                memcpy(&fd, CMSG_DATA(c) + i * sizeof(int), sizeof(int));
+                if (nfds < 3) {
+                    fds[nfds] = fd;
+                } else {
+                    close(fd);
+                }
+                nfds++;
+            }
+        }
+    }
+    if (nfds != 3) {
+        for (int i = 0; i < nfds && i < 3; i++) {
+            close(fds[i]);
+        }
+        serve_refuse(client, "expected stdin, stdout and stderr descriptors");
+    }
+    if (len > SERVE_REQUEST_MAX) {
+        serve_refuse(client, "command too long");
+    }
+
+    char* text = malloc((size_t)len + 1);
+    size_t got = 0;
+    if (text == NULL) {
+        serve_refuse(client, strerror(errno));
+    }
+    while (got < len) {
+        ssize_t n = read(client, text + got, len - got);
+        if (n <= 0) {
+            _exit(1);
+        }
+        got += n;
+    }
+    text[len] = '\0';
+
+    for (int fd = 0; fd < 3; fd++) {
+        dup2(fds[fd], fd);
+        close(fds[fd]);
+    }
+    serve_client = client;
+
+    struct line_reader reader;
+    char* input;
+    reader_init_string(&reader, text);
+    input_reader = &reader;
+    while ((input = reader_read_line(&reader)) != NULL) {
+        trace(TRACE_LINE, 0, 0, input);
+        run_line(input);
+        reap_children();
+        notify_jobs();
+    }
+    exit(last_status);
+}
+
+// Fork a request worker that waits in accept(); see serve()
+static pid_t serve_spawn_worker(int listen_fd, int notify_fd) {
+    pid_t server = getpid();
+    pid_t pid = fork();
+
+    if (pid == -1) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        trace_child("worker");
+        close(event_fd);
+        event_fd = -1;
+        // An idle worker goes away with the server; one running a request does not
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+        if (getppid() != server) {
+            _exit(0);
+        }
+        int client;
+        while ((client = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC)) == -1) {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                _exit(1);
+            }
+        }
+        prctl(PR_SET_PDEATHSIG, 0);
+        // Have the server start our replacement while we run the request
+        write(notify_fd, "", 1);
+        close(notify_fd);
+        close(listen_fd);
+        serve_request(client);
+    }
+    trace(TRACE_SPAWN, pid, 0, "worker");
+    return pid;
+}
+
+/*
+ * --serve PATH: keep one shell warm and run each command line sent to
+ * the UNIX socket at PATH (see miellc.c) in a fork of it, with the
+ * client's own stdio. SERVE_SPARES forks wait in accept() ahead of
+ * time, so a request never waits for a fork; each one that takes a
+ * connection asks for a replacement, so any number of requests can run
+ * at once. The server itself only tops up the pool and reaps.
+ */
+int serve(const char* path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct epoll_event ev = { .events = EPOLLIN };
+    struct stat st;
+    int listen_fd, notify[2];
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "miell: %s: socket path too long\n", path);
+        return 2;
+    }
+    strcpy(addr.sun_path, path);
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd == -1 || pipe2(notify, O_CLOEXEC | O_NONBLOCK) == -1) {
+        perror("socket");
+        return 1;
+    }
+    // A socket left behind by an earlier server is replaced; anything else is not
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+    if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(listen_fd, SOMAXCONN) == -1) {
+        fprintf(stderr, "miell: %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    atexit(serve_reply);
+    ev.data.fd = notify[0];
+    epoll_ctl(event_fd, EPOLL_CTL_ADD, notify[0], &ev);
+    for (int i = 0; i < SERVE_SPARES; i++) {
+        serve_spawn_worker(listen_fd, notify[1]);
+    }
+
+    while (1) {
+        struct epoll_event events[2];
+        int n = epoll_wait(event_fd, events, 2, -1);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            return 1;
+        }
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.fd == signal_fd) {
+                reap_children();
+                continue;
+            }
+            char taken[64];
+            ssize_t count;
+            while ((count = read(notify[0], taken, sizeof(taken))) > 0) {
+                while (count-- > 0) {
+                    serve_spawn_worker(listen_fd, notify[1]);
+                }
+            }
+        }
+    }
+}
+
+void display_prompt(void) {
+    if (!shell_interactive) {
+        return;
+    }
+    if (editor.active) {
+        // A job notice was printed over the line being edited
+        editor_refresh();
+        return;
+    }
+    printf("\nmiell> ");
+    fflush(stdout);
+}
+
+void reader_init_fd(struct line_reader* reader, int fd) {
+    reader->fd = fd;
+    reader->cap = READ_BUFFER_SIZE;
+    reader->buf = malloc(reader->cap);
+    reader->start = 0;
+    reader->end = 0;
+    reader->eof = 0;
+}
+
+void reader_init_string(struct line_reader* reader, const char* str) {
+    reader->fd = -1;
+    reader->end = strlen(str);
+    reader->cap = reader->end + 1;
+    reader->buf = malloc(reader->cap);
+    memcpy(reader->buf, str, reader->end);
+    reader->start = 0;
+    reader->eof = 1;
+}
+
+int reader_has_line(struct line_reader* reader) {
+    return reader->eof || memchr(reader->buf + reader->start, '\n', reader->end - reader->start) != NULL;
+}
+
+/*
+ * Return the next line without its newline, or NULL at end of input.
+ * The line lives in the reader's buffer until the next call.
+ */
+char* reader_read_line(struct line_reader* reader) {
+    size_t scanned = reader->start;
+
+    while (1) {
+        char* nl = memchr(reader->buf + scanned, '\n', reader->end - scanned);
+        if (nl != NULL) {
+            char* line = reader->buf + reader->start;
+            *nl = '\0';
+            reader->start = nl - reader->buf + 1;
+            return line;
+        }
+        scanned = reader->end;
+
+        if (reader->eof) {
+            if (reader->start == reader->end) {
+                return NULL;
+            }
+            // Last line without a trailing newline
+            if (reader->end == reader->cap) {
+                reader->cap *= 2;
+                reader->buf = realloc(reader->buf, reader->cap);
+            }
+            char* line = reader->buf + reader->start;
+            reader->buf[reader->end] = '\0';
+            reader->start = reader->end;
+            return line;
+        }
+
+        // Make room: slide the partial line down, then grow if it fills
+        // the whole buffer
+        if (reader->start > 0) {
+            memmove(reader->buf, reader->buf + reader->start, reader->end - reader->start);
+            reader->end -= reader->start;
+            scanned -= reader->start;
+            reader->start = 0;
+        }
+        if (reader->end == reader->cap) {
+            reader->cap *= 2;
+            reader->buf = realloc(reader->buf, reader->cap);
+        }
+
+        ssize_t n = read(reader->fd, reader->buf + reader->end, reader->cap - reader->end);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("read");
+            reader->eof = 1;
+        } else if (n == 0) {
+            reader->eof = 1;
+        } else {
+            reader->end += n;
+        }
+    }
+}
+
+// Index bucket of the two or three bytes at s
+static unsigned int gram_bucket(const unsigned char* s, int n) {
+    uint32_t key = n == 3 ? (uint32_t)s[0] << 16 | (uint32_t)s[1] << 8 | s[2]
+                          : 1u << 24 | (uint32_t)s[0] << 8 | s[1];
+    return (key * 2654435761u) >> 16;
+}
+
+static void history_post(unsigned int bucket, uint32_t block) {
+    struct history_posting* post = &history.index[bucket];
+
+    if (post->count > 0 && post->blocks[post->count - 1] == block) {
+        return;
+    }
+    if (post->count == post->capacity) {
+        post->capacity = post->capacity ? post->capacity * 2 : 4;
+        post->blocks = realloc(post->blocks, post->capacity * sizeof(uint32_t));
+    }
+    post->blocks[post->count++] = block;
+}
+
+static void history_index_entry(size_t id) {
+    const unsigned char* text = (const unsigned char*)history.entries[id].text;
+    uint32_t len = history.entries[id].len;
+    uint32_t block = id / HISTORY_BLOCK;
+
+    for (uint32_t i = 0; i + 2 <= len; i++) {
+        history_post(gram_bucket(text + i, 2), block);
+        if (i + 3 <= len) {
+            history_post(gram_bucket(text + i, 3), block);
+        }
+    }
+}
+
+static void history_push(const char* text, size_t len) {
+    if (history.count == history.capacity) {
+        history.capacity = history.capacity ? history.capacity * 2 : 256;
+        history.entries = realloc(history.entries, history.capacity * sizeof(struct history_entry));
+    }
+    history.entries[history.count].text = text;
+    history.entries[history.count].len = len;
+    history.count++;
+    if (history.index != NULL) {
+        history_index_entry(history.count - 1);
+    }
+}
+
+void history_open(const char* path) {
+    struct stat st;
+    int fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+
+    if (fd == -1) {
+        fprintf(stderr, "miell: %s: %s\n", path, strerror(errno));
+        return;
+    }
+    history.fd = fd;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            history.map = map;
+            history.map_len = st.st_size;
+        }
+    }
+}
+
+// Split the mapped file into entries, ahead of the lines added since startup
+static void history_load(void) {
+    struct history_entry* session = history.entries;
+    size_t session_count = history.count;
+    const char* p = history.map;
+    const char* end = history.map + history.map_len;
+
+    if (history.loaded) {
+        return;
+    }
+    history.loaded = 1;
+    history.entries = NULL;
+    history.count = 0;
+    history.capacity = 0;
+    while (p < end) {
+        const char* nl = memchr(p, '\n', end - p);
+        size_t len = (nl != NULL ? nl : end) - p;
+        if (len > 0) {
+            history_push(p, len);
+        }
+        p += len + 1;
+    }
+    for (size_t i = 0; i < session_count; i++) {
+        history_push(session[i].text, session[i].len);
+    }
+    free(session);
+}
+
+static void history_build_index(void) {
+    history_load();
+    history.index = calloc(HISTORY_BUCKETS, sizeof(struct history_posting));
+    for (size_t id = 0; id < history.count; id++) {
+        history_index_entry(id);
+    }
+}
+
+// Record a line typed at the prompt, in memory and at the end of the file
+void history_add(const char* line) {
+    size_t len = strlen(line);
+
+    if (line[strspn(line, " \t")] == '\0') {
+        return;
+    }
+    if (history.count > 0 && history.entries[history.count - 1].len == len &&
+        memcmp(history.entries[history.count - 1].text, line, len) == 0) {
+        return;
+    }
+    char* copy = malloc(len + 1);
+    memcpy(copy, line, len);
+    if (history.fd != -1) {
+        // One write per line: O_APPEND keeps it whole next to other shells'
+        copy[len] = '\n';
+        if (write(history.fd, copy, len + 1) == -1) {
+            close(history.fd);
+            history.fd = -1;
+        }
+    }
+    copy[len] = '\0';
+    history_push(copy, len);
+}
+
+static int posting_has(const struct history_posting* post, uint32_t block) {
+    uint32_t lo = 0, hi = post->count;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (post->blocks[mid] < block) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < post->count && post->blocks[lo] == block;
+}
+
+/*
+ * Newest entry before `before` that contains query, or SIZE_MAX. Only
+ * blocks that every trigram of the query hits (its bigram, for two
+ * bytes) are looked at, walking the shortest posting list; a single
+ * byte is found by scanning back from `before`.
+ */
+size_t history_search(const char* query, size_t len, size_t before) {
+    history_load();
+    if (before > history.count) {
+        before = history.count;
+    }
+    if (len < 2) {
+        for (size_t id = before; id-- > 0;) {
+            if (memmem(history.entries[id].text, history.entries[id].len, query, len) != NULL) {
+                return id;
+            }
+        }
+        return SIZE_MAX;
+    }
+    if (history.index == NULL) {
+        history_build_index();
+    }
+
+    const unsigned char* q = (const unsigned char*)query;
+    int n = len >= 3 ? 3 : 2;
+    struct history_posting* rarest = NULL;
+    for (size_t i = 0; i + n <= len; i++) {
+        struct history_posting* post = &history.index[gram_bucket(q + i, n)];
+        if (rarest == NULL || post->count < rarest->count) {
+            rarest = post;
+        }
+    }
+
+    for (uint32_t k = rarest->count; k-- > 0;) {
+        uint32_t block = rarest->blocks[k];
+        size_t first = (size_t)block * HISTORY_BLOCK;
+        if (first >= before) {
+            continue;
+        }
+        int candidate = 1;
+        for (size_t i = 0; i + n <= len && candidate; i++) {
+            candidate = posting_has(&history.index[gram_bucket(q + i, n)], block);
+        }
+        if (!candidate) {
+            continue;
+        }
+        size_t last = first + HISTORY_BLOCK < before ? first + HISTORY_BLOCK : before;
+        for (size_t id = last; id-- > first;) {
+            if (memmem(history.entries[id].text, history.entries[id].len, query, len) != NULL) {
+                return id;
+            }
+        }
+    }
+    return SIZE_MAX;
+}
+
+// Next byte of terminal input; job notices are handled while waiting
+static int editor_getc(struct line_reader* reader) {
+    while (reader->start == reader->end) {
+        if (reader->eof || !wait_for_input(reader)) {
+            return -1;
+        }
+        reader->start = 0;
+        reader->end = 0;
+        ssize_t n = read(reader->fd, reader->buf, reader->cap);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            reader->eof = 1;
+            return -1;
+        }
+        reader->end = n;
+    }
+    return (unsigned char)reader->buf[reader->start++];
+}
 
-int main(void) {
-    char input[MAX_INPUT_SIZE];
-    char*** commands = NULL;
-    int command_count;
+// Screen columns, counting each UTF-8 sequence as one
+static size_t editor_columns(const char* s, size_t len) {
+    size_t columns = 0;
+    for (size_t i = 0; i < len; i++) {
+        columns += ((unsigned char)s[i] & 0xC0) != 0x80;
+    }
+    return columns;
+}
+
+static size_t editor_prev(size_t pos) {
+    while (pos > 0 && ((unsigned char)editor.buf[--pos] & 0xC0) == 0x80) {
+    }
+    return pos;
+}
+
+static size_t editor_next(size_t pos) {
+    while (pos < editor.len && ((unsigned char)editor.buf[++pos] & 0xC0) == 0x80) {
+    }
+    return pos;
+}
+
+// Terminal output; there is nothing useful to do if it fails
+static void editor_write(const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(STDOUT_FILENO, data, len);
+        if (n <= 0 && errno != EINTR) {
+            return;
+        }
+        if (n > 0) {
+            data += n;
+            len -= n;
+        }
+    }
+}
+
+static void editor_reserve(size_t extra) {
+    if (editor.len + extra < editor.cap) {
+        return;
+    }
+    while (editor.len + extra >= editor.cap) {
+        editor.cap = editor.cap ? editor.cap * 2 : 256;
+    }
+    editor.buf = realloc(editor.buf, editor.cap);
+}
+
+static void editor_set(const char* text, size_t len) {
+    editor.len = 0;
+    editor_reserve(len);
+    memcpy(editor.buf, text, len);
+    editor.len = len;
+    editor.cursor = len;
+}
+
+static void editor_delete(size_t from, size_t to) {
+    memmove(editor.buf + from, editor.buf + to, editor.len - to);
+    editor.len -= to - from;
+    editor.cursor = from;
+}
+
+/*
+ * Redraw the prompt and line in one write. A line wider than the
+ * terminal scrolls sideways so that the cursor stays in view.
+ */
+static void editor_refresh(void) {
+    char search_prompt[sizeof(editor.query) + 32];
+    const char* prompt = editor.prompt;
+    struct winsize ws;
+    size_t width = 80;
+
+    if (editor.searching) {
+        snprintf(search_prompt, sizeof(search_prompt), "(%sreverse-i-search)`%.*s': ",
+                 editor.failed ? "failed " : "", (int)editor.query_len, editor.query);
+        prompt = search_prompt;
+    }
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0) {
+        width = ws.ws_col;
+    }
+    size_t prompt_len = strlen(prompt);
+    size_t prompt_cols = editor_columns(prompt, prompt_len);
+    size_t first = 0;
+    size_t last = editor.len;
+    while (first < editor.cursor &&
+           prompt_cols + editor_columns(editor.buf + first, editor.cursor - first) >= width) {
+        first = editor_next(first);
+    }
+    while (last > editor.cursor &&
+           prompt_cols + editor_columns(editor.buf + first, last - first) >= width) {
+        last = editor_prev(last);
+    }
+
+    char* out = malloc(prompt_len + (last - first) + 32);
+    size_t n = 0;
+    out[n++] = '\r';
+    memcpy(out + n, prompt, prompt_len);
+    n += prompt_len;
+    memcpy(out + n, editor.buf + first, last - first);
+    n += last - first;
+    n += sprintf(out + n, "\x1b[K\r");
+    size_t cursor_cols = prompt_cols + editor_columns(editor.buf + first, editor.cursor - first);
+    if (cursor_cols > 0) {
+        n += sprintf(out + n, "\x1b[%zuC", cursor_cols);
+    }
+    fflush(stdout);
+    editor_write(out, n);
+    free(out);
+}
+
+static void editor_keep_draft(void) {
+    free(editor.draft);
+    editor.draft = malloc(editor.len + 1);
+    memcpy(editor.draft, editor.buf, editor.len);
+    editor.draft[editor.len] = '\0';
+}
+
+// Up (older) and Down (newer) through history; past the newest is the draft
+static void editor_recall(int older) {
+    size_t pos;
+
+    history_load();
+    pos = editor.recall == SIZE_MAX ? history.count : editor.recall;
+    if (older) {
+        if (pos == 0) {
+            return;
+        }
+        pos--;
+    } else {
+        if (editor.recall == SIZE_MAX) {
+            return;
+        }
+        pos++;
+    }
+    if (editor.recall == SIZE_MAX) {
+        editor_keep_draft();
+    }
+    if (pos == history.count) {
+        editor_set(editor.draft, strlen(editor.draft));
+        editor.recall = SIZE_MAX;
+    } else {
+        editor_set(history.entries[pos].text, history.entries[pos].len);
+        editor.recall = pos;
+    }
+}
+
+// Look for the query in entries older than `before` and show the match
+static void editor_search(size_t before) {
+    size_t id = history_search(editor.query, editor.query_len, before);
+
+    editor.failed = id == SIZE_MAX;
+    if (editor.failed) {
+        return;
+    }
+    editor.match = id;
+    editor_set(history.entries[id].text, history.entries[id].len);
+    editor.cursor = (const char*)memmem(editor.buf, editor.len, editor.query, editor.query_len) - editor.buf;
+}
+
+/*
+ * A key typed during Ctrl-R. Returns 0 for keys that end the search and
+ * should then act on the matched line as usual (Enter, arrows, ...).
+ */
+static int editor_search_key(int c) {
+    if (c == 18) {                          // ^R: next older match
+        if (editor.query_len > 0 && !editor.failed) {
+            editor_search(editor.match);
+        }
+    } else if (c == 127 || c == 8) {
+        if (editor.query_len > 0) {
+            editor.query_len--;
+            editor.match = SIZE_MAX;
+            editor.failed = 0;
+            if (editor.query_len > 0) {
+                editor_search(SIZE_MAX);
+            }
+        }
+    } else if (c == 7 || c == 3) {          // ^G, ^C: back to the line as it was
+        editor_set(editor.draft, strlen(editor.draft));
+        editor.searching = 0;
+    } else if (c >= 32 && editor.query_len < sizeof(editor.query)) {
+        editor.query[editor.query_len++] = c;
+        if (!editor.failed) {
+            // A longer query can still match the entry shown
+            editor_search(editor.match == SIZE_MAX ? SIZE_MAX : editor.match + 1);
+        }
+    } else {
+        editor.searching = 0;
+        editor.recall = editor.match;
+        return 0;
+    }
+    editor_refresh();
+    return 1;
+}
+
+static void editor_insert(const char* text, size_t len) {
+    editor_reserve(len);
+    memmove(editor.buf + editor.cursor + len, editor.buf + editor.cursor, editor.len - editor.cursor);
+    memcpy(editor.buf + editor.cursor, text, len);
+    editor.cursor += len;
+    editor.len += len;
+}
+
+// Put a completed name in place of the typed part, escaped for the lexer
+static void editor_insert_name(const char* name, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (strchr(" \t\\'\"|&;<>()$`*?[]#", name[i]) != NULL) {
+            editor_insert("\\", 1);
+        }
+        editor_insert(name + i, 1);
+    }
+}
+
+// Candidates in columns under the line, then the line again
+static void editor_list(const struct completion* c) {
+    struct winsize ws;
+    size_t width = 80, longest = 0;
+    size_t shown = c->count < 500 ? c->count : 500;
+
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0) {
+        width = ws.ws_col;
+    }
+    for (size_t i = 0; i < shown; i++) {
+        size_t len = editor_columns(c->names[i], strlen(c->names[i])) + ((c->kinds[i] & ENTRY_DIR) != 0);
+        if (len > longest) {
+            longest = len;
+        }
+    }
+    size_t columns = width / (longest + 2) ? width / (longest + 2) : 1;
+    size_t rows = (shown + columns - 1) / columns;
+    printf("\n");
+    for (size_t row = 0; row < rows; row++) {
+        for (size_t col = 0; col < columns; col++) {
+            size_t i = col * rows + row;
+            if (i >= shown) {
+                break;
+            }
+            int dir = (c->kinds[i] & ENTRY_DIR) != 0;
+            size_t len = editor_columns(c->names[i], strlen(c->names[i])) + dir;
+            printf("%s%s%*s", c->names[i], dir ? "/" : "", (int)(longest + 2 - len), "");
+        }
+        printf("\n");
+    }
+    if (shown < c->count) {
+        printf("(%zu more)\n", c->count - shown);
+    }
+}
+
+/*
+ * Tab: complete the word before the cursor as far as all candidates
+ * agree; a second Tab in a row lists them when they disagree.
+ */
+static void editor_complete(int again) {
+    static struct completion c;
+
+    complete_word(editor.buf, editor.cursor, &c);
+    if (c.count == 0) {
+        editor_write("\a", 1);
+        return;
+    }
+    size_t common = strlen(c.names[0]);
+    for (size_t i = 1; i < c.count && common > 0; i++) {
+        size_t same = 0;
+        while (same < common && c.names[i][same] == c.names[0][same]) {
+            same++;
+        }
+        common = same;
+    }
+    size_t typed = 0;
+    for (size_t i = c.start; i < editor.cursor; i++) {
+        if (editor.buf[i] != '\\' || (i > c.start && editor.buf[i - 1] == '\\')) {
+            typed++;
+        }
+    }
+
+    if (c.count == 1 || common > typed) {
+        editor_delete(c.start, editor.cursor);
+        editor_insert_name(c.names[0], common);
+        if (c.count == 1) {
+            editor_insert((c.kinds[0] & ENTRY_DIR) ? "/" : " ", 1);
+        }
+    } else if (again) {
+        editor_list(&c);
+    } else {
+        editor_write("\a", 1);
+    }
+}
+
+/*
+ * Read a line from the terminal with editing: the terminal is in raw
+ * mode only while the line is typed, and the prompt is already on the
+ * screen. Bytes typed ahead or pasted stay in the reader's buffer for the
+ * next line. Returns NULL at end of input (^D on an empty line).
+ */
+char* edit_line(struct line_reader* reader, const char* prompt) {
+    struct termios raw = editor.cooked;
+    char* line = NULL;
+    int done = 0;
+    int cancelled = 0;
+    int last = -1;
+
+    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    fflush(stdout);
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+
+    editor.active = 1;
+    editor.prompt = prompt;
+    editor.len = 0;
+    editor.cursor = 0;
+    editor.recall = SIZE_MAX;
+    editor.searching = 0;
+    editor_reserve(1);
+
+    while (!done) {
+        int c = editor_getc(reader);
+
+        if (editor.searching && c != -1 && editor_search_key(c)) {
+            continue;
+        }
+        switch (c) {
+        case -1:
+            line = editor.len > 0 ? editor.buf : NULL;
+            done = 1;
+            break;
+        case '\r':
+        case '\n':
+            line = editor.buf;
+            done = 1;
+            break;
+        case 4:                             // ^D: end of input on an empty line
+            if (editor.len == 0) {
+                done = 1;
+            } else if (editor.cursor < editor.len) {
+                editor_delete(editor.cursor, editor_next(editor.cursor));
+            }
+            break;
+        case 3:                             // ^C: drop the line
+            cancelled = 1;
+            editor.len = 0;
+            last_status = 130;
+            line = editor.buf;
+            done = 1;
+            break;
+        case 127:
+        case 8:
+            if (editor.cursor > 0) {
+                editor_delete(editor_prev(editor.cursor), editor.cursor);
+            }
+            break;
+        case 1: editor.cursor = 0; break;                    // ^A
+        case 5: editor.cursor = editor.len; break;           // ^E
+        case 2: editor.cursor = editor_prev(editor.cursor); break;  // ^B
+        case 6: editor.cursor = editor_next(editor.cursor); break;  // ^F
+        case 11: editor.len = editor.cursor; break;          // ^K
+        case 21: editor_delete(0, editor.cursor); break;     // ^U
+        case 23: {                                           // ^W
+            size_t from = editor.cursor;
+            while (from > 0 && editor.buf[from - 1] == ' ') {
+                from--;
+            }
+            while (from > 0 && editor.buf[from - 1] != ' ') {
+                from--;
+            }
+            editor_delete(from, editor.cursor);
+            break;
+        }
+        case 12:                                             // ^L
+            editor_write("\x1b[H\x1b[2J", 7);
+            break;
+        case '\t':
+            editor_complete(last == '\t');
+            break;
+        case 16: editor_recall(1); break;                    // ^P
+        case 14: editor_recall(0); break;                    // ^N
+        case 18:                                             // ^R
+            editor_keep_draft();
+            editor.searching = 1;
+            editor.query_len = 0;
+            editor.match = SIZE_MAX;
+            editor.failed = 0;
+            break;
+        case 27: {
+            // Arrows, Home, End and Delete: ESC [ x, ESC O x or ESC [ n ~
+            int kind = editor_getc(reader);
+            int key = editor_getc(reader);
+            if (kind != '[' && kind != 'O') {
+                break;
+            }
+            if (key >= '0' && key <= '9') {
+                int end = editor_getc(reader);
+                while (end != -1 && end != '~' && end >= '0' && end <= ';') {
+                    end = editor_getc(reader);
+                }
+                if (key == '3' && editor.cursor < editor.len) {
+                    editor_delete(editor.cursor, editor_next(editor.cursor));
+                } else if (key == '1' || key == '7') {
+                    editor.cursor = 0;
+                } else if (key == '4' || key == '8') {
+                    editor.cursor = editor.len;
+                }
+                break;
+            }
+            switch (key) {
+            case 'A': editor_recall(1); break;
+            case 'B': editor_recall(0); break;
+            case 'C': editor.cursor = editor_next(editor.cursor); break;
+            case 'D': editor.cursor = editor_prev(editor.cursor); break;
+            case 'H': editor.cursor = 0; break;
+            case 'F': editor.cursor = editor.len; break;
+            }
+            break;
+        }
+        default:
+            if (c >= 32) {
+                char ch = c;
+                editor_insert(&ch, 1);
+            }
+            break;
+        }
+        if (!done) {
+            editor_refresh();
+        }
+        last = c;
+    }
+
+    // Leave the finished line on screen as typed, with the usual prompt
+    editor.searching = 0;
+    if (cancelled) {
+        editor_write("^C", 2);
+    } else {
+        editor.cursor = editor.len;
+        editor_refresh();
+    }
+    editor_write("\n", 1);
+    editor.buf[editor.len] = '\0';
+    editor.active = 0;
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &editor.cooked);
+    return line;
+}
+
+// Scratch space for the word being lexed; reused, so it only grows
+static char* word_text = NULL;
+static char* word_pattern = NULL;
+static size_t word_cap = 0;
+static size_t word_len = 0;
+static size_t pattern_len = 0;
+
+static void word_reserve(size_t extra) {
+    if (word_len + extra < word_cap && pattern_len + extra < word_cap) {
+        return;
+    }
+    while (word_len + extra >= word_cap || pattern_len + extra >= word_cap) {
+        word_cap = word_cap ? word_cap * 2 : 256;
+    }
+    word_text = realloc(word_text, word_cap);
+    word_pattern = realloc(word_pattern, word_cap);
+}
+
+static void word_add(char c, int quoted) {
+    word_reserve(2);
+    word_text[word_len++] = c;
+    if (quoted && strchr("*?[]\\", c) != NULL) {
+        word_pattern[pattern_len++] = '\\';
+    }
+    word_pattern[pattern_len++] = c;
+}
+
+static int is_operator_char(char c) {
+    return c == '|' || c == '&' || c == ';' || c == '<' || c == '>';
+}
+
+static const char* token_name(struct token* t) {
+    switch (t->type) {
+    case TOK_WORD: return t->word.text;
+    case TOK_PIPE: return "|";
+    case TOK_AMP: return "&";
+    case TOK_SEMI: return ";";
+    case TOK_AND: return "&&";
+    case TOK_OR: return "||";
+    case TOK_LESS: return "<";
+    case TOK_GREAT: return ">";
+    case TOK_DGREAT: return ">>";
+    case TOK_LESSAND: return "<&";
+    case TOK_GREATAND: return ">&";
+    case TOK_DLESS: return "<<";
+    case TOK_DLESSDASH: return "<<-";
+    case TOK_TLESS: return "<<<";
+    default: return "newline";
+    }
+}
+
+static void syntax_error(struct lexer* lx, const char* message) {
+    if (!lx->error) {
+        if (message != NULL) {
+            fprintf(stderr, "miell: syntax error: %s\n", message);
+        } else {
+            fprintf(stderr, "miell: syntax error near unexpected token `%s'\n", token_name(&lx->current));
+        }
+    }
+    lx->error = 1;
+    lx->current.type = TOK_ERROR;
+}
+
+// Fetch a continuation line into the lexer; 0 at end of input
+static int lex_more(struct lexer* lx) {
+    char* line = lx->next_line ? lx->next_line() : NULL;
+    if (line == NULL) {
+        return 0;
+    }
+    lx->p = line;
+    return 1;
+}
+
+static void lex_next(struct lexer* lx);
+
+static int is_name_char(char c) {
+    return isalnum((unsigned char)c) || c == '_';
+}
+
+/*
+ * Lex the $ at p. A variable reference is recorded in *tail at the
+ * current end of the word and left out of its text; anything else is a
+ * literal $. Returns the position after it, or NULL on a syntax error.
+ */
+static const char* lex_variable(struct lexer* lx, const char* p, int quoted, struct word_var*** tail) {
+    const char* name = p + 1;
+    const char* end = name;
+    const char* next;
+
+    if (*name == '{') {
+        name++;
+        end = name;
+        while (is_name_char(*end)) {
+            end++;
+        }
+        if (end == name && *end != '\0' && strchr("?$#@*", *end) != NULL) {
+            end++;
+        }
+        // ${10}: all digits is a positional parameter
+        if (*end != '}' || end == name ||
+            (isdigit((unsigned char)*name) && strspn(name, "0123456789") != (size_t)(end - name))) {
+            syntax_error(lx, "bad substitution");
+            return NULL;
+        }
+        next = end + 1;
+    } else if (*name != '\0' && (strchr("?$#@*", *name) != NULL || isdigit((unsigned char)*name))) {
+        end = next = name + 1;
+    } else if (isalpha((unsigned char)*name) || *name == '_') {
+        while (is_name_char(*end)) {
+            end++;
+        }
+        next = end;
+    } else {
+        word_add('$', quoted);
+        return p + 1;
+    }
+
+    struct word_var* var = arena_alloc(&line_arena, sizeof(*var));
+    char* copy = arena_alloc(&line_arena, end - name + 1);
+    memcpy(copy, name, end - name);
+    copy[end - name] = '\0';
+    var->name = copy;
+    var->offset = word_len;
+    var->pattern_offset = pattern_len;
+    var->quoted = quoted;
+    var->command = NULL;
+    var->output = 0;
+    var->next = NULL;
+    **tail = var;
+    *tail = &var->next;
+    return next;
+}
+
+static void lex_word(struct lexer* lx) {
+    const char* p = lx->p;
+    int has_glob = 0;
+    int quoted = 0;
+    int assign = 0;
+    int name_ok = 1;        // the word so far could be the NAME of NAME=value
+    struct word_var* vars = NULL;
+    struct word_var** tail = &vars;
+
+    word_len = 0;
+    pattern_len = 0;
+    while (1) {
+        char c = *p;
+        if (c == '\0' || c == ' ' || c == '\t' || is_operator_char(c)) {
+            break;
+        }
+        if (c == '=' && name_ok && word_len > 0) {
+            assign = word_len;
+            name_ok = 0;
+        } else if (!is_name_char(c) || (word_len == 0 && isdigit((unsigned char)c))) {
+            name_ok = 0;
+        }
+        if (c == '\'') {
+            p++;
+            quoted = 1;
+            while (*p != '\'') {
+                if (*p == '\0') {
+                    if (!lex_more(lx)) {
+                        syntax_error(lx, "unexpected end of file while looking for matching `''");
+                        return;
+                    }
+                    word_add('\n', 1);
+                    p = lx->p;
+                    continue;
+                }
+                word_add(*p++, 1);
+            }
+            p++;
+        } else if (c == '"') {
+            p++;
+            quoted = 1;
+            while (*p != '"') {
+                if (*p == '\0' || (*p == '\\' && p[1] == '\0')) {
+                    int newline = (*p == '\0');
+                    if (!lex_more(lx)) {
+                        syntax_error(lx, "unexpected end of file while looking for matching `\"'");
+                        return;
+                    }
+                    if (newline) {
+                        word_add('\n', 1);
+                    }
+                    p = lx->p;
+                    continue;
+                }
+                if (*p == '$') {
+                    if ((p = lex_variable(lx, p, 1, &tail)) == NULL) {
+                        return;
+                    }
+                    continue;
+                }
+                if (*p == '\\' && strchr("\"\\$`", p[1]) != NULL) {
+                    p++;
+                }
+                word_add(*p++, 1);
+            }
+            p++;
+        } else if (c == '$') {
+            if ((p = lex_variable(lx, p, 0, &tail)) == NULL) {
+                return;
+            }
+        } else if (c == '\\') {
+            if (p[1] == '\0') {
+                // Backslash-newline joins the next line onto this word
+                if (!lex_more(lx)) {
+                    p++;
+                    break;
+                }
+                p = lx->p;
+                continue;
+            }
+            word_add(p[1], 1);
+            quoted = 1;
+            p += 2;
+        } else {
+            if (c == '*' || c == '?' || c == '[') {
+                has_glob = 1;
+            }
+            word_add(c, 0);
+            p++;
+        }
+    }
+    lx->p = p;
+    if (word_len == 0 && !quoted && vars == NULL) {
+        // Only a backslash-newline: there was no word here after all
+        lex_next(lx);
+        return;
+    }
+
+    word_text[word_len] = '\0';
+    word_pattern[pattern_len] = '\0';
+    lx->current.type = TOK_WORD;
+    lx->current.quoted = quoted;
+    lx->current.word.text = arena_strdup(&line_arena, word_text);
+    lx->current.word.pattern = (has_glob || vars) ? arena_strdup(&line_arena, word_pattern) : NULL;
+    lx->current.word.vars = vars;
+    lx->current.word.assign = assign;
+}
+
+/*
+ * Read the body of a here-document, up to the line holding only its
+ * delimiter, into r->body. Unless the delimiter was quoted, $ references
+ * are recorded as in a double-quoted word and \$, \`, \\ and
+ * backslash-newline are unescaped.
+ */
+static void read_heredoc(struct lexer* lx, struct redirect* r) {
+    const char* delimiter = r->target.text;
+    struct word_var* vars = NULL;
+    struct word_var** tail = &vars;
+
+    word_len = 0;
+    pattern_len = 0;
+    while (1) {
+        const char* p = lx->next_line ? lx->next_line() : NULL;
+        if (p == NULL) {
+            fprintf(stderr, "miell: warning: here-document delimited by end-of-file (wanted `%s')\n", delimiter);
+            break;
+        }
+        if (r->strip_tabs) {
+            while (*p == '\t') {
+                p++;
+            }
+        }
+        if (strcmp(p, delimiter) == 0) {
+            break;
+        }
+        int joined = 0;
+        while (*p != '\0') {
+            if (!r->expand) {
+                word_add(*p++, 1);
+            } else if (*p == '\\' && p[1] == '\0') {
+                joined = 1;
+                p++;
+            } else if (*p == '\\' && strchr("$`\\", p[1]) != NULL) {
+                word_add(p[1], 1);
+                p += 2;
+            } else if (*p == '$') {
+                if ((p = lex_variable(lx, p, 1, &tail)) == NULL) {
+                    return;
+                }
+            } else {
+                word_add(*p++, 1);
+            }
+        }
+        if (!joined) {
+            word_add('\n', 1);
+        }
+    }
+    word_text[word_len] = '\0';
+    word_pattern[pattern_len] = '\0';
+    r->body.text = arena_strdup(&line_arena, word_text);
+    r->body.pattern = vars ? arena_strdup(&line_arena, word_pattern) : NULL;
+    r->body.vars = vars;
+}
+
+/*
+ * Lex <(list) or >(list) at p as a word of its own. The list runs to the
+ * matching parenthesis (quotes and nested parentheses are skipped over)
+ * and is parsed now; it is run when the word is expanded.
+ */
+static void lex_substitution(struct lexer* lx, const char* p) {
+    const char* start = p + 2;
+    const char* end = start;
+    int depth = 1;
+
+    while (depth > 0) {
+        if (*end == '\0') {
+            syntax_error(lx, "unexpected end of file while looking for matching `)'");
+            return;
+        }
+        if (*end == '\'' || *end == '"') {
+            char quote = *end++;
+            while (*end != quote && *end != '\0') {
+                end += (quote == '"' && *end == '\\' && end[1] != '\0') ? 2 : 1;
+            }
+            if (*end == '\0') {
+                continue;
+            }
+        } else if (*end == '\\' && end[1] != '\0') {
+            end++;
+        } else if (*end == '(') {
+            depth++;
+        } else if (*end == ')') {
+            depth--;
+        }
+        end++;
+    }
+
+    struct word_var* var = arena_alloc(&line_arena, sizeof(*var));
+    char* text = arena_alloc(&line_arena, end - start);
+    memcpy(text, start, end - start - 1);
+    text[end - start - 1] = '\0';
+
+    struct lexer sub;
+    lexer_init(&sub, text, NULL);
+    memset(var, 0, sizeof(*var));
+    var->command = parse_list(&sub);
+    if (sub.error) {
+        lx->error = 1;
+        lx->current.type = TOK_ERROR;
+        return;
+    }
+    var->name = text;
+    var->quoted = 1;
+    var->output = (*p == '>');
+
+    lx->p = end;
+    lx->current.type = TOK_WORD;
+    lx->current.quoted = 0;
+    lx->current.word.text = "";
+    lx->current.word.pattern = "";
+    lx->current.word.vars = var;
+    lx->current.word.assign = 0;
+}
+
+static int is_redirect_token(enum token_type type) {
+    return type >= TOK_LESS && type <= TOK_TLESS;
+}
+
+static void lex_next(struct lexer* lx) {
+    struct token* t = &lx->current;
+    const char* p = lx->p;
+
+    if (lx->error) {
+        return;
+    }
+    t->io_number = -1;
+    while (*p == ' ' || *p == '\t') {
+        p++;
+    }
+    if (*p == '#') {
+        p += strlen(p);
+    }
+    if (*p == '\0') {
+        lx->p = p;
+        t->type = TOK_END;
+        // Here-document bodies start on the line after their operator
+        for (int i = 0; i < lx->heredoc_count && !lx->error; i++) {
+            read_heredoc(lx, lx->heredocs[i]);
+        }
+        lx->heredoc_count = 0;
+        return;
+    }
+    if (isdigit((unsigned char)p[0]) && (p[1] == '<' || p[1] == '>')) {
+        t->io_number = p[0] - '0';
+        p++;
+    }
+
+    if ((*p == '<' || *p == '>') && p[1] == '(' && t->io_number < 0) {
+        lex_substitution(lx, p);
+        return;
+    }
+
+    switch (*p) {
+    case '|':
+        t->type = (p[1] == '|') ? TOK_OR : TOK_PIPE;
+        p += (t->type == TOK_OR) ? 2 : 1;
+        break;
+    case '&':
+        t->type = (p[1] == '&') ? TOK_AND : TOK_AMP;
+        p += (t->type == TOK_AND) ? 2 : 1;
+        break;
+    case ';':
+        t->type = TOK_SEMI;
+        p++;
+        break;
+    case '<':
+        if (p[1] == '<' && p[2] == '<') {
+            t->type = TOK_TLESS;
+            p += 3;
+        } else if (p[1] == '<') {
+            t->type = (p[2] == '-') ? TOK_DLESSDASH : TOK_DLESS;
+            p += (t->type == TOK_DLESSDASH) ? 3 : 2;
+        } else {
+            t->type = (p[1] == '&') ? TOK_LESSAND : TOK_LESS;
+            p += (t->type == TOK_LESSAND) ? 2 : 1;
+        }
+        break;
+    case '>':
+        if (p[1] == '>') {
+            t->type = TOK_DGREAT;
+            p += 2;
+        } else if (p[1] == '&') {
+            t->type = TOK_GREATAND;
+            p += 2;
+        } else {
+            t->type = TOK_GREAT;
+            p++;
+        }
+        break;
+    default:
+        lx->p = p;
+        lex_word(lx);
+        return;
+    }
+    lx->p = p;
+}
+
+void lexer_init(struct lexer* lx, const char* input, char* (*next_line)(void)) {
+    lx->p = input;
+    lx->next_line = next_line;
+    lx->error = 0;
+    lx->heredocs = NULL;
+    lx->heredoc_count = 0;
+    lx->heredoc_capacity = 0;
+    lx->function_depth = 0;
+    lx->functions = 0;
+    lex_next(lx);
+}
+
+// After |, && or ||, a command may continue on the next line
+static void skip_to_continuation(struct lexer* lx) {
+    while (lx->current.type == TOK_END) {
+        if (!lex_more(lx)) {
+            syntax_error(lx, "unexpected end of file");
+            return;
+        }
+        lex_next(lx);
+    }
+}
+
+static void* arena_grow(void* old, int count, int* capacity, size_t size) {
+    if (count < *capacity) {
+        return old;
+    }
+    *capacity = *capacity ? *capacity * 2 : 4;
+    void* fresh = arena_alloc(&line_arena, *capacity * size);
+    if (old != NULL) {
+        memcpy(fresh, old, count * size);
+    }
+    return fresh;
+}
+
+static struct node* new_node(enum node_type type, struct node* left, struct node* right) {
+    struct node* node = arena_alloc(&line_arena, sizeof(*node));
+    memset(node, 0, sizeof(*node));
+    node->type = type;
+    node->left = left;
+    node->right = right;
+    return node;
+}
+
+// A reserved word: unquoted, and only where a command could start
+static int is_keyword(const struct token* t, const char* word) {
+    return t->type == TOK_WORD && !t->quoted && t->word.vars == NULL && strcmp(t->word.text, word) == 0;
+}
+
+// The words that end a compound command's list
+static int at_list_end(struct lexer* lx) {
+    static const char* ends[] = { "then", "elif", "else", "fi", "do", "done", "}" };
+
+    for (size_t i = 0; i < sizeof(ends) / sizeof(ends[0]); i++) {
+        if (is_keyword(&lx->current, ends[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static struct node* parse_and_or(struct lexer* lx);
+
+/*
+ * The list inside a compound command: like parse_list(), but newlines
+ * separate commands too, more lines are read until one of the words in
+ * at_list_end() turns up, and the list must not be empty.
+ */
+static struct node* parse_compound_list(struct lexer* lx) {
+    struct node* list = NULL;
+
+    while (!lx->error) {
+        while (lx->current.type == TOK_END) {
+            if (!lex_more(lx)) {
+                syntax_error(lx, "unexpected end of file");
+                return NULL;
+            }
+            lex_next(lx);
+        }
+        if (lx->error || at_list_end(lx)) {
+            break;
+        }
+        struct node* item = parse_and_or(lx);
+        if (item == NULL) {
+            return NULL;
+        }
+        if (lx->current.type == TOK_AMP) {
+            item = new_node(NODE_BACKGROUND, item, NULL);
+            lex_next(lx);
+        } else if (lx->current.type == TOK_SEMI) {
+            lex_next(lx);
+        } else if (lx->current.type != TOK_END && !at_list_end(lx)) {
+            syntax_error(lx, NULL);
+            return NULL;
+        }
+        list = list ? new_node(NODE_SEQUENCE, list, item) : item;
+    }
+    if (list == NULL) {
+        syntax_error(lx, NULL);
+    }
+    return lx->error ? NULL : list;
+}
+
+// Consume the reserved word that has to come next
+static int expect_keyword(struct lexer* lx, const char* word) {
+    if (!is_keyword(&lx->current, word)) {
+        syntax_error(lx, NULL);
+        return -1;
+    }
+    lex_next(lx);
+    return 0;
+}
+
+// Blank lines are allowed before `do` and before a function's body
+static void skip_newlines(struct lexer* lx) {
+    while (lx->current.type == TOK_END && !lx->error) {
+        if (!lex_more(lx)) {
+            syntax_error(lx, "unexpected end of file");
+            return;
+        }
+        lex_next(lx);
+    }
+}
+
+static struct node* parse_compound(struct lexer* lx);
+
+// if/elif: the condition, the then part and whatever follows
+static struct node* parse_if(struct lexer* lx) {
+    struct node* node = new_node(NODE_IF, NULL, NULL);
+
+    lex_next(lx);
+    if ((node->left = parse_compound_list(lx)) == NULL || expect_keyword(lx, "then") == -1 ||
+        (node->right = parse_compound_list(lx)) == NULL) {
+        return NULL;
+    }
+    if (is_keyword(&lx->current, "elif")) {
+        node->other = parse_if(lx);
+        return node->other ? node : NULL;
+    }
+    if (is_keyword(&lx->current, "else")) {
+        lex_next(lx);
+        if ((node->other = parse_compound_list(lx)) == NULL) {
+            return NULL;
+        }
+    }
+    return expect_keyword(lx, "fi") == -1 ? NULL : node;
+}
+
+static struct node* parse_for(struct lexer* lx) {
+    struct node* node = new_node(NODE_FOR, NULL, NULL);
+    int capacity = 0;
+
+    lex_next(lx);
+    if (lx->current.type != TOK_WORD || lx->current.quoted || lx->current.word.vars != NULL ||
+        !valid_name(lx->current.word.text, strlen(lx->current.word.text))) {
+        syntax_error(lx, lx->current.type == TOK_WORD ? "bad for loop variable" : NULL);
+        return NULL;
+    }
+    node->name = lx->current.word.text;
+    node->word_count = -1;
+    lex_next(lx);
+    if (is_keyword(&lx->current, "in")) {
+        node->word_count = 0;
+        lex_next(lx);
+        while (lx->current.type == TOK_WORD) {
+            node->words = arena_grow(node->words, node->word_count, &capacity, sizeof(struct word));
+            node->words[node->word_count++] = lx->current.word;
+            lex_next(lx);
+        }
+    }
+    if (lx->current.type == TOK_SEMI) {
+        lex_next(lx);
+    } else if (lx->current.type != TOK_END && !is_keyword(&lx->current, "do")) {
+        syntax_error(lx, NULL);
+        return NULL;
+    }
+    skip_newlines(lx);
+    if (expect_keyword(lx, "do") == -1 || (node->right = parse_compound_list(lx)) == NULL ||
+        expect_keyword(lx, "done") == -1) {
+        return NULL;
+    }
+    return node;
+}
+
+/*
+ * name() compound-command, or `function name [()] compound-command`.
+ * The body is compiled as a function, so `return` leaves it. With
+ * in_group the { was already part of the name word, as in "f(){".
+ */
+static struct node* parse_function(struct lexer* lx, const char* name, int in_group) {
+    struct node* node = new_node(NODE_FUNCTION, NULL, NULL);
+
+    if (!valid_name(name, strlen(name)) || (find_builtin(name) != NULL && find_function(name) == NULL)) {
+        fprintf(stderr, "miell: `%s': not a valid function name\n", name);
+        lx->error = 1;
+        lx->current.type = TOK_ERROR;
+        return NULL;
+    }
+    node->name = name;
+    lx->function_depth++;
+    if (in_group) {
+        node->left = new_node(NODE_GROUP, parse_compound_list(lx), NULL);
+        if (node->left->left == NULL || expect_keyword(lx, "}") == -1) {
+            node->left = NULL;
+        } else {
+            node->left->code = compile(node->left, 1);
+        }
+    } else {
+        skip_newlines(lx);
+        node->left = lx->error ? NULL : parse_compound(lx);
+    }
+    lx->function_depth--;
+    if (node->left == NULL) {
+        return NULL;
+    }
+    node->code = compile(node->left, 1);
+    lx->functions++;
+    return node;
+}
+
+/*
+ * A compound command, starting at its reserved word, compiled once here.
+ * Returns NULL (with lx->error set) if there is none or it is malformed.
+ */
+static struct node* parse_compound(struct lexer* lx) {
+    struct token* t = &lx->current;
+    struct node* node = NULL;
+
+    if (is_keyword(t, "if")) {
+        node = parse_if(lx);
+    } else if (is_keyword(t, "for")) {
+        node = parse_for(lx);
+    } else if (is_keyword(t, "while") || is_keyword(t, "until")) {
+        node = new_node(t->word.text[0] == 'w' ? NODE_WHILE : NODE_UNTIL, NULL, NULL);
+        lex_next(lx);
+        if ((node->left = parse_compound_list(lx)) == NULL || expect_keyword(lx, "do") == -1 ||
+            (node->right = parse_compound_list(lx)) == NULL || expect_keyword(lx, "done") == -1) {
+            return NULL;
+        }
+    } else if (is_keyword(t, "{")) {
+        node = new_node(NODE_GROUP, NULL, NULL);
+        lex_next(lx);
+        if ((node->left = parse_compound_list(lx)) == NULL || expect_keyword(lx, "}") == -1) {
+            return NULL;
+        }
+    } else {
+        syntax_error(lx, NULL);
+        return NULL;
+    }
+    if (node != NULL) {
+        node->code = compile(node, lx->function_depth > 0);
+    }
+    return node;
+}
+
+static int is_compound_start(const struct token* t) {
+    return is_keyword(t, "if") || is_keyword(t, "for") || is_keyword(t, "while") ||
+           is_keyword(t, "until") || is_keyword(t, "{");
+}
+
+// Every reserved word starts with one of these, so most commands are ruled
+// out without a string compare
+static int might_be_keyword(const struct token* t) {
+    return t->type == TOK_WORD && !t->quoted && t->word.text[0] != '\0' &&
+           strchr("iftewdu{}", t->word.text[0]) != NULL;
+}
+
+static int parse_command(struct lexer* lx, struct command* cmd) {
+    int word_capacity = 0;
+    int assign_capacity = 0;
+    struct redirect** tail = &cmd->redirects;
+
+    memset(cmd, 0, sizeof(*cmd));
+    tail = &cmd->redirects;
+    if (!might_be_keyword(&lx->current)) {
+        // Plain simple command: skip the reserved-word checks
+    } else if (at_list_end(lx)) {
+        syntax_error(lx, NULL);
+        return -1;
+    } else if (is_compound_start(&lx->current)) {
+        if ((cmd->body = parse_compound(lx)) == NULL) {
+            return -1;
+        }
+    } else if (is_keyword(&lx->current, "function")) {
+        lex_next(lx);
+        if (lx->current.type != TOK_WORD) {
+            syntax_error(lx, NULL);
+            return -1;
+        }
+        const char* name = lx->current.word.text;
+        lex_next(lx);
+        if (is_keyword(&lx->current, "()")) {
+            lex_next(lx);
+        }
+        if ((cmd->body = parse_function(lx, name, 0)) == NULL) {
+            return -1;
+        }
+    }
+    while (1) {
+        struct token* t = &lx->current;
+        if (t->type == TOK_WORD && cmd->body != NULL) {
+            // Only redirections may follow a compound command
+            syntax_error(lx, NULL);
+            return -1;
+        }
+        if (t->type == TOK_WORD && cmd->assign_count == 0 && cmd->redirects == NULL && !t->quoted &&
+            t->word.vars == NULL && cmd->word_count < 2 && strstr(t->word.text, "()") != NULL) {
+            // name(), name () or name(){: a function definition
+            char* paren = strstr(t->word.text, "()");
+            int in_group = strcmp(paren, "(){") == 0;
+            if (cmd->word_count == 0 ? paren > t->word.text && (strcmp(paren, "()") == 0 || in_group)
+                                     : paren == t->word.text && strcmp(paren, "()") == 0) {
+                char* name = cmd->word_count ? cmd->words[0].text : t->word.text;
+                *paren = '\0';
+                cmd->word_count = 0;
+                lex_next(lx);
+                if ((cmd->body = parse_function(lx, name, in_group)) == NULL) {
+                    return -1;
+                }
+                continue;
+            }
+        }
+        if (t->type == TOK_WORD && t->word.assign && cmd->word_count == 0) {
+            cmd->assigns = arena_grow(cmd->assigns, cmd->assign_count, &assign_capacity, sizeof(struct word));
+            cmd->assigns[cmd->assign_count++] = t->word;
+            lex_next(lx);
+        } else if (t->type == TOK_WORD) {
+            cmd->words = arena_grow(cmd->words, cmd->word_count, &word_capacity, sizeof(struct word));
+            cmd->words[cmd->word_count++] = t->word;
+            lex_next(lx);
+        } else if (is_redirect_token(t->type)) {
+            struct redirect* r = arena_alloc(&line_arena, sizeof(*r));
+            enum token_type type = t->type;
+            memset(r, 0, sizeof(*r));
+            r->fd = t->io_number;
+            if (type == TOK_DLESS || type == TOK_DLESSDASH || type == TOK_TLESS) {
+                r->type = (type == TOK_TLESS) ? REDIR_HERESTRING : REDIR_HEREDOC;
+                r->strip_tabs = (type == TOK_DLESSDASH);
+                if (r->fd < 0) r->fd = STDIN_FILENO;
+            } else if (type == TOK_LESS || type == TOK_LESSAND) {
+                r->type = (type == TOK_LESS) ? REDIR_IN : REDIR_DUP;
+                if (r->fd < 0) r->fd = STDIN_FILENO;
+            } else {
+                r->type = (type == TOK_GREAT) ? REDIR_OUT : (type == TOK_DGREAT) ? REDIR_APPEND : REDIR_DUP;
+                if (r->fd < 0) r->fd = STDOUT_FILENO;
+            }
+            lex_next(lx);
+            if (lx->current.type != TOK_WORD) {
+                syntax_error(lx, NULL);
+                return -1;
+            }
+            r->target = lx->current.word;
+            r->next = NULL;
+            *tail = r;
+            tail = &r->next;
+            if (r->type == REDIR_HEREDOC) {
+                if (r->target.vars != NULL) {
+                    syntax_error(lx, "here-document delimiter must not contain $");
+                    return -1;
+                }
+                r->expand = !lx->current.quoted;
+                lx->heredocs = arena_grow(lx->heredocs, lx->heredoc_count, &lx->heredoc_capacity,
+                                          sizeof(struct redirect*));
+                lx->heredocs[lx->heredoc_count++] = r;
+            }
+            lex_next(lx);
+        } else {
+            break;
+        }
+    }
+    if (cmd->word_count == 0 && cmd->redirects == NULL && cmd->assign_count == 0 && cmd->body == NULL) {
+        syntax_error(lx, NULL);
+        return -1;
+    }
+    return 0;
+}
+
+// The word after a prefix option: a value that is expanded when the pipeline runs
+static struct word* take_word(struct lexer* lx) {
+    if (lx->current.type != TOK_WORD) {
+        syntax_error(lx, NULL);
+        return NULL;
+    }
+    struct word* word = arena_alloc(&line_arena, sizeof(*word));
+    *word = lx->current.word;
+    lex_next(lx);
+    return word;
+}
+
+// timeout [-k DURATION] DURATION, or limit with one or more of --cpu,
+// --mem and --nofile, each followed by its value
+static int parse_guard(struct lexer* lx, struct pipeline* pipeline) {
+    struct guard* guard = pipeline->guard;
+    int is_timeout = lx->current.word.text[0] == 't';
+
+    if (guard == NULL) {
+        guard = pipeline->guard = arena_alloc(&line_arena, sizeof(*guard));
+        memset(guard, 0, sizeof(*guard));
+    }
+    lex_next(lx);
+    if (is_timeout) {
+        if (is_keyword(&lx->current, "-k")) {
+            lex_next(lx);
+            if ((guard->kill_after = take_word(lx)) == NULL) {
+                return -1;
+            }
+        }
+        return (guard->timeout = take_word(lx)) == NULL ? -1 : 0;
+    }
+    int given = 0;
+    while (lx->current.type == TOK_WORD && lx->current.word.text[0] == '-') {
+        int i = 0;
+        while (i < LIMIT_COUNT && !is_keyword(&lx->current, limit_options[i])) {
+            i++;
+        }
+        if (i == LIMIT_COUNT) {
+            break;
+        }
+        lex_next(lx);
+        if ((guard->limits[i] = take_word(lx)) == NULL) {
+            return -1;
+        }
+        given++;
+    }
+    if (!given) {
+        syntax_error(lx, "limit needs --cpu, --mem or --nofile");
+        return -1;
+    }
+    return 0;
+}
+
+static struct node* parse_pipeline(struct lexer* lx) {
+    struct node* node = arena_alloc(&line_arena, sizeof(*node));
+    int capacity = 0;
+
+    memset(node, 0, sizeof(*node));
+    node->type = NODE_PIPELINE;
+    if (lx->current.type == TOK_WORD && lx->current.word.text[0] == '!' && is_keyword(&lx->current, "!")) {
+        node->pipeline.negated = 1;
+        lex_next(lx);
+    }
+    if (lx->current.type == TOK_WORD && strcmp(lx->current.word.text, "time") == 0) {
+        node->pipeline.timed = TIME_HUMAN;
+        lex_next(lx);
+        while (lx->current.type == TOK_WORD && (strcmp(lx->current.word.text, "-p") == 0 ||
+                                                strcmp(lx->current.word.text, "-j") == 0)) {
+            node->pipeline.timed = lx->current.word.text[1] == 'p' ? TIME_POSIX : TIME_JSON;
+            lex_next(lx);
+        }
+        if (lx->current.type != TOK_WORD && !is_redirect_token(lx->current.type)) {
+            return node;    // a bare `time` times nothing
+        }
+    }
+    while (lx->current.type == TOK_WORD &&
+           (is_keyword(&lx->current, "timeout") || is_keyword(&lx->current, "limit"))) {
+        if (parse_guard(lx, &node->pipeline) == -1) {
+            return NULL;
+        }
+        if (lx->current.type != TOK_WORD && !is_redirect_token(lx->current.type)) {
+            syntax_error(lx, NULL);
+            return NULL;
+        }
+    }
+    if (lx->current.type == TOK_WORD && strcmp(lx->current.word.text, "cached") == 0) {
+        node->pipeline.cached = CACHE_RUN;
+        lex_next(lx);
+        if (lx->current.type == TOK_WORD && strcmp(lx->current.word.text, "-c") == 0) {
+            node->pipeline.cached = CACHE_CLEAR;
+            lex_next(lx);
+        }
+        if (node->pipeline.cached == CACHE_CLEAR ||
+            (lx->current.type != TOK_WORD && !is_redirect_token(lx->current.type))) {
+            return node;    // a bare `cached` reports on the cache
+        }
+    }
+    while (1) {
+        node->pipeline.commands = arena_grow(node->pipeline.commands, node->pipeline.count,
+                                             &capacity, sizeof(struct command));
+        if (parse_command(lx, &node->pipeline.commands[node->pipeline.count]) == -1) {
+            return NULL;
+        }
+        node->pipeline.count++;
+        if (lx->current.type != TOK_PIPE) {
+            return node;
+        }
+        lex_next(lx);
+        skip_to_continuation(lx);
+    }
+}
+
+static struct node* parse_and_or(struct lexer* lx) {
+    struct node* left = parse_pipeline(lx);
+
+    while (left != NULL && (lx->current.type == TOK_AND || lx->current.type == TOK_OR)) {
+        enum node_type type = (lx->current.type == TOK_AND) ? NODE_AND : NODE_OR;
+        lex_next(lx);
+        skip_to_continuation(lx);
+        struct node* right = parse_pipeline(lx);
+        if (right == NULL) {
+            return NULL;
+        }
+        left = new_node(type, left, right);
+    }
+    return left;
+}
+
+/*
+ * list := and_or ((';' | '&') and_or)* [';' | '&']
+ * Returns NULL for an empty line or on a syntax error (lx->error is set).
+ */
+struct node* parse_list(struct lexer* lx) {
+    struct node* list = NULL;
+
+    while (lx->current.type != TOK_END && !lx->error) {
+        struct node* item = parse_and_or(lx);
+        if (item == NULL) {
+            return NULL;
+        }
+        if (lx->current.type == TOK_AMP) {
+            item = new_node(NODE_BACKGROUND, item, NULL);
+            lex_next(lx);
+        } else if (lx->current.type == TOK_SEMI) {
+            lex_next(lx);
+        } else if (lx->current.type != TOK_END) {
+            syntax_error(lx, NULL);
+            return NULL;
+        }
+        list = list ? new_node(NODE_SEQUENCE, list, item) : item;
+    }
+    return lx->error ? NULL : list;
+}
+
+/*
+ * Start the list of a <(...) or >(...) in a forked copy of the shell,
+ * connected by a pipe whose other end the shell keeps open (and
+ * inheritable) until the command that names it has been run; see
+ * finish_substitutions(). Returns the /dev/fd path of that end.
+ */
+static const char* start_substitution(const struct word_var* var, char* buf, size_t size) {
+    int io[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+    int fds[2];
+
+    if (pipe2(fds, O_CLOEXEC) == -1) {
+        perror("pipe");
+        return "";
+    }
+    int mine = var->output ? fds[1] : fds[0];
+    int theirs = var->output ? fds[0] : fds[1];
+    io[var->output ? STDIN_FILENO : STDOUT_FILENO] = theirs;
+
+    fflush(stdout);
+    pid_t pid = fork_stage(io, -1, NULL, 0);
+    if (pid == 0) {
+        trace_child("substitution");
+        // Nor may it hold the ends of earlier substitutions open
+        for (int i = 0; i < substitution_count; i++) {
+            close(substitutions[i].fd);
+        }
+        substitution_count = 0;
+        exit(var->command ? execute_node(var->command) : 0);
+    }
+    close(theirs);
+    if (pid == -1) {
+        close(mine);
+        return "";
+    }
+    fcntl(mine, F_SETFD, 0);
+    trace(TRACE_SPAWN, pid, mine, "substitution");
+
+    if (substitution_count == substitution_capacity) {
+        substitution_capacity = substitution_capacity ? substitution_capacity * 2 : 4;
+        substitutions = realloc(substitutions, substitution_capacity * sizeof(*substitutions));
+    }
+    substitutions[substitution_count++] = (struct substitution){ pid, mine, var->output };
+    snprintf(buf, size, "/dev/fd/%d", mine);
+    return buf;
+}
+
+/*
+ * Once a command has been started (in the background) or has finished,
+ * drop the shell's ends of its substitutions. A foreground command then
+ * waits for its >(...) lists, which see end of input now, so their
+ * output is complete before the next command runs; <(...) lists are left
+ * to be reaped whenever they exit, as a consumer need not read them.
+ */
+static void finish_substitutions(int foreground) {
+    for (int i = 0; i < substitution_count; i++) {
+        close(substitutions[i].fd);
+    }
+    for (int i = 0; foreground && i < substitution_count; i++) {
+        if (substitutions[i].output) {
+            while (waitpid(substitutions[i].pid, NULL, 0) == -1 && errno == EINTR) {
+            }
+        }
+    }
+    substitution_count = 0;
+}
+
+// Current value of a variable a word refers to; "" when it is unset
+static const char* word_var_value(const struct word_var* var, char* buf, size_t size) {
+    if (var->command != NULL || var->name[0] == '\0') {
+        return start_substitution(var, buf, size);
+    }
+    if (strcmp(var->name, "?") == 0) {
+        snprintf(buf, size, "%d", last_status);
+        return buf;
+    }
+    if (strcmp(var->name, "$") == 0) {
+        snprintf(buf, size, "%ld", (long)shell_pid);
+        return buf;
+    }
+    if (strcmp(var->name, "#") == 0) {
+        snprintf(buf, size, "%d", positional_count);
+        return buf;
+    }
+    if (isdigit((unsigned char)var->name[0])) {
+        int n = atoi(var->name);
+        return n == 0 ? script_name : n <= positional_count ? positional[n - 1] : "";
+    }
+    if (strcmp(var->name, "@") == 0 || strcmp(var->name, "*") == 0) {
+        // The parameters joined by spaces; "$@" is split apart again by expand_fields()
+        size_t len = 1;
+        for (int i = 0; i < positional_count; i++) {
+            len += strlen(positional[i]) + 1;
+        }
+        char* joined = arena_alloc(&line_arena, len);
+        char* end = joined;
+        for (int i = 0; i < positional_count; i++) {
+            end = stpcpy(end, positional[i]);
+            *end++ = ' ';
+        }
+        *(end > joined ? end - 1 : end) = '\0';
+        return joined;
+    }
+    const char* value = var_get(var->name);
+    return value ? value : "";
+}
+
+// Append raw bytes to the scratch word, keeping pattern escapes as they are
+static void word_append(const char* text, size_t len, const char* pattern, size_t plen) {
+    word_reserve(len > plen ? len : plen);
+    memcpy(word_text + word_len, text, len);
+    memcpy(word_pattern + pattern_len, pattern, plen);
+    word_len += len;
+    pattern_len += plen;
+}
+
+// Append a quoted value: glob characters are escaped in the pattern,
+// which is only kept up to date when it will be used
+static void word_append_quoted(const char* value, int with_pattern) {
+    size_t len = strlen(value);
+
+    word_reserve(with_pattern ? 2 * len : len);
+    memcpy(word_text + word_len, value, len);
+    word_len += len;
+    while (with_pattern && *value) {
+        size_t span = strcspn(value, "*?[]\\");
+        memcpy(word_pattern + pattern_len, value, span);
+        pattern_len += span;
+        value += span;
+        if (*value) {
+            word_pattern[pattern_len++] = '\\';
+            word_pattern[pattern_len++] = *value++;
+        }
+    }
+}
+
+static void push_field(struct word** fields, int* count, int* capacity, int glob) {
+    struct word* field;
+
+    word_text[word_len] = '\0';
+    word_pattern[pattern_len] = '\0';
+    *fields = arena_grow(*fields, *count, capacity, sizeof(struct word));
+    field = &(*fields)[(*count)++];
+    memset(field, 0, sizeof(*field));
+    field->text = arena_strdup(&line_arena, word_text);
+    field->pattern = glob ? arena_strdup(&line_arena, word_pattern) : NULL;
+    word_len = 0;
+    pattern_len = 0;
+}
+
+/*
+ * Put variable values back into a word. With split set, unquoted values
+ * are split into fields at blanks and their glob characters stay active,
+ * so one word can become several, or none; otherwise the result is
+ * always exactly one field. Fields are appended to *fields.
+ */
+static void expand_fields(struct word* word, int split, struct word** fields, int* count, int* capacity) {
+    size_t text_len = strlen(word->text);
+    size_t pattern_total = strlen(word->pattern);
+    size_t t = 0, pt = 0;
+    int live = !split;      // the current field exists even if it is empty
+    int glob = 0;
+    char buf[24];
+
+    word_len = 0;
+    pattern_len = 0;
+    for (struct word_var* var = word->vars; ; var = var->next) {
+        size_t end = var ? var->offset : text_len;
+        size_t pattern_end = var ? var->pattern_offset : pattern_total;
+        for (size_t i = pt; i < pattern_end; i++) {
+            if (word->pattern[i] == '\\') {
+                i++;
+            } else if (strchr("*?[", word->pattern[i]) != NULL) {
+                glob = 1;
+            }
+        }
+        if (end > t || pattern_end > pt) {
+            live = 1;
+        }
+        word_append(word->text + t, end - t, word->pattern + pt, pattern_end - pt);
+        t = end;
+        pt = pattern_end;
+        if (var == NULL) {
+            break;
+        }
+
+        if (var->quoted && split && strcmp(var->name, "@") == 0) {
+            // "$@": one field per parameter, the first and last joined
+            // to whatever text surrounds them
+            for (int i = 0; i < positional_count; i++) {
+                if (i > 0) {
+                    push_field(fields, count, capacity, glob);
+                    glob = 0;
+                }
+                word_append_quoted(positional[i], split);
+                live = 1;
+            }
+            continue;
+        }
+        const char* value = word_var_value(var, buf, sizeof(buf));
+        if (var->quoted || !split) {
+            live |= var->quoted;
+            word_append_quoted(value, split);
+            continue;
+        }
+        for (const char* v = value; *v; v++) {
+            if (*v == ' ' || *v == '\t' || *v == '\n') {
+                if (live) {
+                    push_field(fields, count, capacity, glob);
+                    live = 0;
+                    glob = 0;
+                }
+                continue;
+            }
+            if (strchr("*?[", *v) != NULL) {
+                glob = 1;
+            }
+            word_add(*v, 0);
+            live = 1;
+        }
+    }
+    if (live) {
+        push_field(fields, count, capacity, split && glob);
+    }
+}
+
+// A word as one string, without field splitting or globbing (redirection
+// targets and assignments)
+char* expand_word(struct word* word) {
+    struct word* field = NULL;
+    int count = 0, capacity = 0;
+
+    if (word->vars == NULL) {
+        return word->text;
+    }
+    expand_fields(word, 0, &field, &count, &capacity);
+    return field->text;
+}
+
+/*
+ * Turn a stage's words into argv: variables are substituted, then
+ * fields are globbed. The array grows as needed, so a glob matching
+ * thousands of files yields thousands of arguments.
+ */
+char** expand_words(struct word* words, int word_count, int* arg_count) {
+    int capacity = word_count + 1;
+    char** new_args = arena_alloc(&line_arena, capacity * sizeof(char*));
+    int new_count = 0;
+    struct glob_result matches = { NULL, 0, 0 };
+
+    for (int i = 0; i < word_count; i++) {
+        struct word* fields = &words[i];
+        int field_count = 1, field_capacity = 0;
+
+        if (words[i].vars != NULL) {
+            fields = NULL;
+            field_count = 0;
+            expand_fields(&words[i], 1, &fields, &field_count, &field_capacity);
+        }
+        for (int f = 0; f < field_count; f++) {
+            if (fields[f].pattern != NULL && glob_expand(fields[f].pattern, &matches) > 0) {
+                // The pattern matched: the sorted paths replace the field
+                int needed = new_count + (int)matches.count + (word_count - i) + (field_count - f);
+                if (needed > capacity) {
+                    char** grown = arena_alloc(&line_arena, needed * sizeof(char*));
+                    memcpy(grown, new_args, new_count * sizeof(char*));
+                    new_args = grown;
+                    capacity = needed;
+                }
+                for (size_t j = 0; j < matches.count; j++) {
+                    new_args[new_count++] = arena_strdup(&line_arena, matches.paths[j]);
+                }
+                glob_result_free(&matches);
+            } else {
+                // No wildcard, or nothing matched: keep the word as it is
+                if (new_count + (word_count - i) + (field_count - f) > capacity) {
+                    capacity = 2 * (new_count + (word_count - i) + (field_count - f));
+                    char** grown = arena_alloc(&line_arena, capacity * sizeof(char*));
+                    memcpy(grown, new_args, new_count * sizeof(char*));
+                    new_args = grown;
+                }
+                new_args[new_count++] = fields[f].text;
+            }
+        }
+    }
+
+    new_args[new_count] = NULL;
+    *arg_count = new_count;
+
+    return new_args;
+}
+
+/*
+ * Glob engine. A pattern is split into '/'-separated components and the
+ * tree is walked one directory at a time: each directory is read once
+ * with readdir() and its entries are matched against every component
+ * that is active there (a `**` keeps itself and the next component
+ * active). Entry types come from d_type, so matching needs no stat()
+ * calls except to confirm literal components. Walks that recurse (`**`)
+ * fan out over a small thread pool sharing a queue of directories.
+ */
+static int glob_threads = 0;    // worker count for `**` walks; 0 = from CPU count
+
+struct glob_task {
+    char* dir;                  // "" for the current directory, else ends in '/'
+    int comp;
+    struct glob_task* next;
+};
+
+enum glob_comp_kind { GLOB_LITERAL, GLOB_MAGIC, GLOB_STAR_STAR };
+
+struct glob_walk {
+    char** comps;
+    unsigned char* kinds;       // enum glob_comp_kind per component
+    int comp_count;
+    int dirs_only;              // pattern ended in '/'
+    int threaded;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    struct glob_task* queue;
+    int pending;                // tasks queued or being processed
+};
+
+static int glob_has_magic(const char* s) {
+    for (; *s; s++) {
+        if (*s == '\\' && s[1]) {
+            s++;
+        } else if (*s == '*' || *s == '?' || *s == '[') {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Match one bracket expression at *pp against c; advances *pp past it
+static int glob_match_class(const char** pp, char c) {
+    const char* p = *pp + 1;
+    int negate = (*p == '!' || *p == '^');
+    int matched = 0;
+
+    if (negate) {
+        p++;
+    }
+    // A ']' right after '[' or '[!' is a literal member
+    do {
+        char lo = *p;
+        if (lo == '\\' && p[1]) {
+            lo = *++p;
+        }
+        if (lo == '\0') {
+            return -1;
+        }
+        char hi = lo;
+        if (p[1] == '-' && p[2] != ']' && p[2] != '\0') {
+            hi = p[2];
+            if (hi == '\\' && p[3]) {
+                hi = p[3];
+                p++;
+            }
+            p += 2;
+        }
+        if ((unsigned char)c >= (unsigned char)lo && (unsigned char)c <= (unsigned char)hi) {
+            matched = 1;
+        }
+        p++;
+    } while (*p != ']');
+    *pp = p + 1;
+    return matched != negate;
+}
+
+/*
+ * fnmatch()-style matching of a single path component. '*' backtracks to
+ * the most recent star only, which keeps matching linear in practice.
+ */
+static int glob_match(const char* pat, const char* name) {
+    const char* star_pat = NULL;
+    const char* star_name = NULL;
+
+    // Wildcards never match a leading dot
+    if (name[0] == '.' && pat[0] != '.') {
+        return 0;
+    }
+    while (*name) {
+        if (*pat == '*') {
+            star_pat = ++pat;
+            star_name = name;
+            continue;
+        }
+        if (*pat == '?') {
+            pat++;
+            name++;
+            continue;
+        }
+        if (*pat == '[') {
+            const char* p = pat;
+            int m = glob_match_class(&p, *name);
+            if (m == 1) {
+                pat = p;
+                name++;
+                continue;
+            }
+            if (m == -1 && *name == '[') {
+                // Unterminated bracket: a literal '['
+                pat++;
+                name++;
+                continue;
+            }
+        } else {
+            const char* p = pat;
+            if (*p == '\\' && p[1]) {
+                p++;
+            }
+            if (*p == *name) {
+                pat = p + 1;
+                name++;
+                continue;
+            }
+        }
+        if (star_pat == NULL) {
+            return 0;
+        }
+        pat = star_pat;
+        name = ++star_name;
+    }
+    while (*pat == '*') {
+        pat++;
+    }
+    return *pat == '\0';
+}
+
+static void glob_result_add(struct glob_result* result, char* path) {
+    if (result->count == result->capacity) {
+        result->capacity = result->capacity ? result->capacity * 2 : 64;
+        result->paths = realloc(result->paths, result->capacity * sizeof(char*));
+    }
+    result->paths[result->count++] = path;
+}
+
+void glob_result_free(struct glob_result* result) {
+    for (size_t i = 0; i < result->count; i++) {
+        free(result->paths[i]);
+    }
+    free(result->paths);
+    result->paths = NULL;
+    result->count = 0;
+    result->capacity = 0;
+}
+
+static char* glob_join(const char* dir, const char* name, int slash) {
+    size_t dir_len = strlen(dir);
+    size_t name_len = strlen(name);
+    char* path = malloc(dir_len + name_len + 2);
+    memcpy(path, dir, dir_len);
+    memcpy(path + dir_len, name, name_len);
+    if (slash) {
+        path[dir_len + name_len++] = '/';
+    }
+    path[dir_len + name_len] = '\0';
+    return path;
+}
+
+static void glob_push(struct glob_walk* walk, struct glob_task** local, char* dir, int comp) {
+    struct glob_task* task = malloc(sizeof(*task));
+    task->dir = dir;
+    task->comp = comp;
+    if (walk->threaded) {
+        pthread_mutex_lock(&walk->lock);
+        task->next = walk->queue;
+        walk->queue = task;
+        walk->pending++;
+        pthread_cond_signal(&walk->ready);
+        pthread_mutex_unlock(&walk->lock);
+    } else {
+        task->next = *local;
+        *local = task;
+    }
+}
+
+static int glob_entry_is_dir(const char* dir, struct dirent* entry, int follow) {
+    struct stat st;
+    char* path;
+    int is_dir;
+
+    if (entry->d_type == DT_DIR) {
+        return 1;
+    }
+    if (entry->d_type != DT_UNKNOWN && (entry->d_type != DT_LNK || !follow)) {
+        return 0;
+    }
+    path = glob_join(dir, entry->d_name, 0);
+    is_dir = (follow ? stat(path, &st) : lstat(path, &st)) == 0 && S_ISDIR(st.st_mode);
+    free(path);
+    return is_dir;
+}
+
+// Match a literal component (escapes removed) without reading the directory
+static void glob_literal(struct glob_walk* walk, struct glob_task** local, struct glob_result* result,
+                         const char* dir, const char* comp, int index) {
+    char name[NAME_MAX + 1];
+    size_t len = 0;
+    struct stat st;
+
+    for (const char* p = comp; *p && len < NAME_MAX; p++) {
+        if (*p == '\\' && p[1]) {
+            p++;
+        }
+        name[len++] = *p;
+    }
+    name[len] = '\0';
+
+    int last = (index == walk->comp_count - 1);
+    char* path = glob_join(dir, name, 0);
+    if (!last) {
+        free(path);
+        glob_push(walk, local, glob_join(dir, name, 1), index + 1);
+    } else if (lstat(path, &st) == 0 &&
+               (!walk->dirs_only || (stat(path, &st) == 0 && S_ISDIR(st.st_mode)))) {
+        if (walk->dirs_only) {
+            free(path);
+            path = glob_join(dir, name, 1);
+        }
+        glob_result_add(result, path);
+    } else {
+        free(path);
+    }
+}
+
+static void glob_process(struct glob_walk* walk, struct glob_task* task, struct glob_task** local,
+                         struct glob_result* result) {
+    int first = task->comp;
+    int last_active = first;
+    int needs_readdir = 0;
+
+    // A `**` keeps the component after it active in the same directory
+    while (walk->kinds[last_active] == GLOB_STAR_STAR && last_active + 1 < walk->comp_count) {
+        last_active++;
+    }
+    for (int j = first; j <= last_active; j++) {
+        if (walk->kinds[j] != GLOB_LITERAL) {
+            needs_readdir = 1;
+        }
+    }
+    if (!needs_readdir) {
+        glob_literal(walk, local, result, task->dir, walk->comps[first], first);
+        return;
+    }
+
+    DIR* d = opendir(task->dir[0] ? task->dir : ".");
+    if (d == NULL) {
+        return;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(d)) != NULL) {
+        const char* name = entry->d_name;
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+            continue;
+        }
+        for (int j = first; j <= last_active; j++) {
+            const char* comp = walk->comps[j];
+            int last = (j == walk->comp_count - 1);
+            if (walk->kinds[j] == GLOB_STAR_STAR) {
+                if (name[0] == '.' || !glob_entry_is_dir(task->dir, entry, 0)) {
+                    continue;
+                }
+                if (last) {
+                    // A trailing `**` matches everything below
+                    glob_result_add(result, glob_join(task->dir, name, walk->dirs_only));
+                }
+                glob_push(walk, local, glob_join(task->dir, name, 1), j);
+            } else if (glob_match(comp, name)) {
+                if (!last) {
+                    glob_push(walk, local, glob_join(task->dir, name, 1), j + 1);
+                } else if (!walk->dirs_only) {
+                    glob_result_add(result, glob_join(task->dir, name, 0));
+                } else if (glob_entry_is_dir(task->dir, entry, 1)) {
+                    glob_result_add(result, glob_join(task->dir, name, 1));
+                }
+            }
+        }
+        if (walk->kinds[last_active] == GLOB_STAR_STAR && last_active == walk->comp_count - 1 &&
+            name[0] != '.' && !glob_entry_is_dir(task->dir, entry, 0) && !walk->dirs_only) {
+            glob_result_add(result, glob_join(task->dir, name, 0));
+        }
+    }
+    closedir(d);
+}
+
+struct glob_worker {
+    struct glob_walk* walk;
+    struct glob_result result;
+    pthread_t thread;
+};
+
+static void* glob_worker_main(void* arg) {
+    struct glob_worker* worker = arg;
+    struct glob_walk* walk = worker->walk;
+
+    pthread_mutex_lock(&walk->lock);
+    while (1) {
+        while (walk->queue == NULL && walk->pending > 0) {
+            pthread_cond_wait(&walk->ready, &walk->lock);
+        }
+        if (walk->queue == NULL) {
+            break;
+        }
+        struct glob_task* task = walk->queue;
+        walk->queue = task->next;
+        pthread_mutex_unlock(&walk->lock);
+
+        glob_process(walk, task, NULL, &worker->result);
+        free(task->dir);
+        free(task);
+
+        pthread_mutex_lock(&walk->lock);
+        if (--walk->pending == 0) {
+            pthread_cond_broadcast(&walk->ready);
+        }
+    }
+    pthread_mutex_unlock(&walk->lock);
+    return NULL;
+}
+
+static int glob_compare(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/*
+ * Expand pattern into result (sorted), returning the number of matches.
+ * A leading ~ or ~user is replaced by the home directory.
+ */
+size_t glob_expand(const char* pattern, struct glob_result* result) {
+    struct glob_walk walk;
+    char* copy;
+    char* root = "";
+
+    memset(&walk, 0, sizeof(walk));
+    if (pattern[0] == '~') {
+        const char* slash = strchr(pattern, '/');
+        size_t user_len = slash ? (size_t)(slash - pattern - 1) : strlen(pattern) - 1;
+        const char* home = NULL;
+        if (user_len == 0) {
+            home = var_get("HOME");
+        } else {
+            char user[256];
+            snprintf(user, sizeof(user), "%.*s", (int)user_len, pattern + 1);
+            struct passwd* pw = getpwnam(user);
+            home = pw ? pw->pw_dir : NULL;
+        }
+        if (home == NULL) {
+            return 0;
+        }
+        copy = malloc(strlen(home) + strlen(pattern) + 1);
+        sprintf(copy, "%s%s", home, slash ? slash : "");
+    } else {
+        copy = strdup(pattern);
+    }
+
+    // Split into components, folding runs of '/' and of `**`
+    walk.comps = malloc((strlen(copy) / 2 + 2) * sizeof(char*));
+    char* p = copy;
+    if (*p == '/') {
+        root = "/";
+        while (*p == '/') p++;
+    }
+    while (*p) {
+        char* comp = p;
+        while (*p && *p != '/') p++;
+        int at_end = 1;
+        if (*p == '/') {
+            *p++ = '\0';
+            while (*p == '/') p++;
+            at_end = (*p == '\0');
+            if (at_end) {
+                walk.dirs_only = 1;
+            }
+        }
+        if (!(strcmp(comp, "**") == 0 && walk.comp_count > 0 &&
+              strcmp(walk.comps[walk.comp_count - 1], "**") == 0)) {
+            walk.comps[walk.comp_count++] = comp;
+        }
+        if (at_end) {
+            break;
+        }
+    }
+    if (walk.comp_count == 0) {
+        free(walk.comps);
+        free(copy);
+        return 0;
+    }
+
+    int recursive = 0;
+    walk.kinds = malloc(walk.comp_count);
+    for (int i = 0; i < walk.comp_count; i++) {
+        if (strcmp(walk.comps[i], "**") == 0) {
+            walk.kinds[i] = GLOB_STAR_STAR;
+            recursive = 1;
+        } else {
+            walk.kinds[i] = glob_has_magic(walk.comps[i]) ? GLOB_MAGIC : GLOB_LITERAL;
+        }
+    }
+    int threads = glob_threads ? glob_threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > GLOB_MAX_THREADS) {
+        threads = GLOB_MAX_THREADS;
+    }
+
+    size_t start = result->count;
+    struct glob_task* local = NULL;
+    if (recursive && threads > 1) {
+        struct glob_worker workers[GLOB_MAX_THREADS];
+        walk.threaded = 1;
+        pthread_mutex_init(&walk.lock, NULL);
+        pthread_cond_init(&walk.ready, NULL);
+        glob_push(&walk, NULL, strdup(root), 0);
+        for (int i = 0; i < threads; i++) {
+            workers[i].walk = &walk;
+            memset(&workers[i].result, 0, sizeof(workers[i].result));
+            pthread_create(&workers[i].thread, NULL, glob_worker_main, &workers[i]);
+        }
+        for (int i = 0; i < threads; i++) {
+            pthread_join(workers[i].thread, NULL);
+            for (size_t j = 0; j < workers[i].result.count; j++) {
+                glob_result_add(result, workers[i].result.paths[j]);
+            }
+            free(workers[i].result.paths);
+        }
+        pthread_mutex_destroy(&walk.lock);
+        pthread_cond_destroy(&walk.ready);
+    } else {
+        glob_push(&walk, &local, strdup(root), 0);
+        while (local != NULL) {
+            struct glob_task* task = local;
+            local = task->next;
+            glob_process(&walk, task, &local, result);
+            free(task->dir);
+            free(task);
+        }
+    }
+
+    // Nothing matched: paths may still be NULL
+    if (result->count > start) {
+        qsort(result->paths + start, result->count - start, sizeof(char*), glob_compare);
+    }
+    free(walk.kinds);
+    free(walk.comps);
+    free(copy);
+    return result->count - start;
+}
+
+// A word as typed, give or take quoting: variables are shown as $NAME
+static void write_word(FILE* out, const struct word* word) {
+    size_t t = 0;
+
+    for (struct word_var* var = word->vars; var != NULL; var = var->next) {
+        fwrite(word->text + t, 1, var->offset - t, out);
+        t = var->offset;
+        if (var->command != NULL || var->name[0] == '\0') {
+            fprintf(out, "%c(%s)", var->output ? '>' : '<', var->name);
+        } else if (is_name_char(word->text[t])) {
+            fprintf(out, "${%s}", var->name);
+        } else {
+            fprintf(out, "$%s", var->name);
+        }
+    }
+    fputs(word->text + t, out);
+}
+
+static void write_node(FILE* out, struct node* node);
+
+static void write_pipeline(FILE* out, struct pipeline* pipeline) {
+    static const char* redirect_ops[] = { "<", ">", ">>", ">&", "<<", "<<<" };
+
+    if (pipeline->negated) {
+        fputs("! ", out);
+    }
+    if (pipeline->timed) {
+        fputs("time ", out);
+    }
+    if (pipeline->guard != NULL && pipeline->guard->timeout != NULL) {
+        fputs("timeout ", out);
+        if (pipeline->guard->kill_after != NULL) {
+            fputs("-k ", out);
+            write_word(out, pipeline->guard->kill_after);
+            fputc(' ', out);
+        }
+        write_word(out, pipeline->guard->timeout);
+        fputc(' ', out);
+    }
+    for (int i = 0; pipeline->guard != NULL && i < LIMIT_COUNT; i++) {
+        if (pipeline->guard->limits[i] != NULL) {
+            fprintf(out, "limit %s ", limit_options[i]);
+            write_word(out, pipeline->guard->limits[i]);
+            fputc(' ', out);
+        }
+    }
+    if (pipeline->cached) {
+        fputs(pipeline->cached == CACHE_CLEAR ? "cached -c " : "cached ", out);
+    }
+    for (int i = 0; i < pipeline->count; i++) {
+        struct command* cmd = &pipeline->commands[i];
+        const char* sep = "";
+        if (i > 0) {
+            fputs(" | ", out);
+        }
+        if (cmd->body != NULL) {
+            write_node(out, cmd->body);
+            sep = " ";
+        }
+        for (int j = 0; j < cmd->assign_count; j++) {
+            fputs(sep, out);
+            write_word(out, &cmd->assigns[j]);
+            sep = " ";
+        }
+        for (int j = 0; j < cmd->word_count; j++) {
+            fputs(sep, out);
+            write_word(out, &cmd->words[j]);
+            sep = " ";
+        }
+        for (struct redirect* r = cmd->redirects; r != NULL; r = r->next) {
+            const char* op = redirect_ops[r->type];
+            if (r->type == REDIR_DUP && r->fd == STDIN_FILENO) {
+                op = "<&";
+            } else if (r->type == REDIR_HEREDOC && r->strip_tabs) {
+                op = "<<-";
+            }
+            if (r->fd != (r->type == REDIR_IN || op[0] == '<' ? STDIN_FILENO : STDOUT_FILENO)) {
+                fprintf(out, "%s%d%s ", sep, r->fd, op);
+            } else {
+                fprintf(out, "%s%s ", sep, op);
+            }
+            write_word(out, &r->target);
+            sep = " ";
+        }
+    }
+}
+
+static void write_node(FILE* out, struct node* node) {
+    static const char* separators[] = { "", " && ", " || ", "; ", " &" };
+
+    switch (node->type) {
+    case NODE_PIPELINE:
+        write_pipeline(out, &node->pipeline);
+        return;
+    case NODE_IF:
+        fputs("if ", out);
+        for (;;) {
+            write_node(out, node->left);
+            fputs("; then ", out);
+            write_node(out, node->right);
+            if (node->other == NULL || node->other->type != NODE_IF) {
+                break;
+            }
+            fputs("; elif ", out);
+            node = node->other;
+        }
+        if (node->other != NULL) {
+            fputs("; else ", out);
+            write_node(out, node->other);
+        }
+        fputs("; fi", out);
+        return;
+    case NODE_WHILE:
+    case NODE_UNTIL:
+        fputs(node->type == NODE_WHILE ? "while " : "until ", out);
+        write_node(out, node->left);
+        fputs("; do ", out);
+        write_node(out, node->right);
+        fputs("; done", out);
+        return;
+    case NODE_FOR:
+        fprintf(out, "for %s", node->name);
+        if (node->word_count >= 0) {
+            fputs(" in", out);
+        }
+        for (int i = 0; i < node->word_count; i++) {
+            fputc(' ', out);
+            write_word(out, &node->words[i]);
+        }
+        fputs("; do ", out);
+        write_node(out, node->right);
+        fputs("; done", out);
+        return;
+    case NODE_GROUP:
+        fputs("{ ", out);
+        write_node(out, node->left);
+        fputs("; }", out);
+        return;
+    case NODE_FUNCTION:
+        fprintf(out, "%s() ", node->name);
+        write_node(out, node->left);
+        return;
+    default:
+        break;
+    }
+    write_node(out, node->left);
+    fputs(separators[node->type], out);
+    if (node->right != NULL) {
+        write_node(out, node->right);
+    }
+}
+
+// Text of a pipeline as shown by `jobs`; the caller frees it
+char* describe_pipeline(struct pipeline* pipeline) {
+    char* text = NULL;
+    size_t len = 0;
+    FILE* out = open_memstream(&text, &len);
+
+    write_pipeline(out, pipeline);
+    fclose(out);
+    return text;
+}
+
+static void expand_pipeline(struct pipeline* pipeline) {
+    for (int i = 0; i < pipeline->count; i++) {
+        struct command* cmd = &pipeline->commands[i];
+        cmd->argv = expand_words(cmd->words, cmd->word_count, &cmd->argc);
+    }
+}
+
+// Set the variables of an assignment-only command, like "a=1 b=$a"
+static void assign_vars(struct command* cmd) {
+    for (int i = 0; i < cmd->assign_count; i++) {
+        struct word* word = &cmd->assigns[i];
+        char* text = expand_word(word);
+        text[word->assign] = '\0';
+        var_set(text, text + word->assign + 1, 0);
+        text[word->assign] = '=';
+    }
+}
+
+/*
+ * Environment for a command with NAME=value prefixes: a copy of environ
+ * with those entries replaced or added. Commands without prefixes are
+ * given environ itself.
+ */
+static char** command_env(struct command* cmd) {
+    char** envp;
+    int count = env_count;
+
+    if (cmd->assign_count == 0) {
+        return environ;
+    }
+    envp = arena_alloc(&line_arena, (env_count + cmd->assign_count + 1) * sizeof(char*));
+    memcpy(envp, env_vec, env_count * sizeof(char*));
+    for (int i = 0; i < cmd->assign_count; i++) {
+        struct word* word = &cmd->assigns[i];
+        char* entry = arena_strdup(&line_arena, expand_word(word));
+        int j;
+        for (j = 0; j < count; j++) {
+            if (strncmp(envp[j], entry, word->assign + 1) == 0) {
+                break;
+            }
+        }
+        envp[j] = entry;
+        if (j == count) {
+            count++;
+        }
+    }
+    envp[count] = NULL;
+    return envp;
+}
+
+/*
+ * Run an and-or list or sequence in a forked copy of the shell, as one
+ * background job. Plain pipelines do not need this; handle_pipes() puts
+ * their stages in the background directly.
+ */
+static int execute_subshell_job(struct node* node) {
+    fflush(stdout);
+    pid_t pid = fork();
+
+    if (pid == -1) {
+        perror("fork");
+        return 1;
+    }
+    if (pid == 0) {
+        trace_child("subshell");
+        setpgid(0, 0);
+        signal(SIGINT, SIG_DFL);
+        signal(SIGQUIT, SIG_DFL);
+        signal(SIGTSTP, SIG_DFL);
+        // The subshell owns no jobs and never touches the terminal
+        job_count = 0;
+        shell_interactive = 0;
+        serve_client = -1;
+        exit(execute_node(node));
+    }
+    setpgid(pid, pid);
+    trace(TRACE_SPAWN, pid, 0, "subshell");
+
+    char* text = NULL;
+    size_t len = 0;
+    FILE* out = open_memstream(&text, &len);
+    write_node(out, node);
+    fclose(out);
+
+    struct job* job = add_job(text, 1, &pid, pid, 1);
+    free(text);
+    if (shell_interactive) {
+        printf("[%d] %d\n", job->id, pid);
+    }
+    return 0;
+}
+
+static int execute_pipeline(struct pipeline* pipeline) {
+    const struct builtin* builtin;
+
+    if (pipeline->count == 0) {
+        if (pipeline->timed) {
+            report_timing(pipeline->timed, 0, NULL, 0, NULL);
+        }
+        return pipeline->cached ? cache_report(pipeline->cached == CACHE_CLEAR) : 0;
+    }
+    expand_pipeline(pipeline);
+    if (pipeline->cached) {
+        return run_cached(pipeline);
+    }
+    if (pipeline->guard != NULL) {
+        // Bounded in time or resources: every stage is a process of its own
+        return handle_pipes(pipeline, 0, NULL);
+    }
+    if (pipeline->count == 1 && pipeline->commands[0].body != NULL) {
+        if (pipeline->timed) {
+            return time_builtin(NULL, pipeline);
+        }
+        return execute_builtin(NULL, &pipeline->commands[0]);
+    }
+    if (pipeline->count == 1 && pipeline->commands[0].argc == 0 &&
+        pipeline->commands[0].assign_count > 0 && !pipeline->timed) {
+        assign_vars(&pipeline->commands[0]);
+        if (pipeline->commands[0].redirects == NULL) {
+            return 0;
+        }
+    }
+    if (pipeline->count == 1 && pipeline->commands[0].argc > 0 &&
+        (builtin = find_builtin(pipeline->commands[0].argv[0])) != NULL) {
+        trace(TRACE_BUILTIN, 0, 0, pipeline->commands[0].argv[0]);
+        if (pipeline->timed) {
+            return time_builtin(builtin, pipeline);
+        }
+        return execute_builtin(builtin, &pipeline->commands[0]);
+    }
+    return handle_pipes(pipeline, 0, NULL);
+}
+
+int execute_node(struct node* node) {
+    int status;
+
+    switch (node->type) {
+    case NODE_PIPELINE:
+        status = execute_pipeline(&node->pipeline);
+        finish_substitutions(1);
+        return node->pipeline.negated ? !status : status;
+    case NODE_AND:
+        status = last_status = execute_node(node->left);
+        return (status == 0) ? execute_node(node->right) : status;
+    case NODE_OR:
+        status = last_status = execute_node(node->left);
+        return (status != 0) ? execute_node(node->right) : status;
+    case NODE_SEQUENCE:
+        last_status = execute_node(node->left);
+        return execute_node(node->right);
+    case NODE_BACKGROUND:
+        if (node->left->type == NODE_PIPELINE && node->left->pipeline.count > 0) {
+            expand_pipeline(&node->left->pipeline);
+            status = handle_pipes(&node->left->pipeline, 1, NULL);
+            finish_substitutions(0);
+            return status;
+        }
+        return execute_subshell_job(node->left);
+    default:
+        // A compound command is only ever a command's body
+        return 0;
+    }
+}
+
+/*
+ * Compiler for compound commands. Control flow becomes jumps; every
+ * pipeline stays the parsed struct it was and runs through
+ * execute_node(). A compound command that is a plain stage of its own
+ * (no pipe, no redirection, no !) is compiled inline into the enclosing
+ * program, so nested loops are one program and `break 2` is a jump.
+ */
+struct loop_label {
+    int top;                // where continue goes
+    int* breaks;            // OP_UNWINDs to point past the loop
+    int break_count;
+    int break_capacity;
+};
+
+struct compiler {
+    struct program* program;
+    int in_function;
+    struct loop_label* loops;
+    int depth;
+    int capacity;
+};
+
+static int emit(struct compiler* c, enum opcode op, int arg, void* ref) {
+    struct program* p = c->program;
+
+    p->code = arena_grow(p->code, p->count, &p->capacity, sizeof(struct instr));
+    p->code[p->count] = (struct instr){ op, arg, -1, ref };
+    return p->count++;
+}
+
+// A literal break/continue/return with nothing else on it, or NULL
+static const char* control_word(struct node* node) {
+    struct pipeline* p = &node->pipeline;
+    struct command* cmd = &p->commands[0];
+
+    if (p->count != 1 || p->timed || p->cached || p->negated || p->guard != NULL || cmd->body != NULL ||
+        cmd->assign_count > 0 || cmd->redirects != NULL || cmd->word_count == 0 || cmd->word_count > 2 ||
+        cmd->words[0].vars != NULL) {
+        return NULL;
+    }
+    const char* word = cmd->words[0].text;
+    if (strcmp(word, "break") == 0 || strcmp(word, "continue") == 0 || strcmp(word, "return") == 0) {
+        return word;
+    }
+    return NULL;
+}
+
+/*
+ * break [n] / continue [n] inside the loops being compiled: leave the
+ * inner loops and jump. Returns -1 (the builtin reports it at run time)
+ * outside a loop or with a count that is not a plain number.
+ */
+static int compile_unwind(struct compiler* c, struct node* node, int is_break) {
+    struct command* cmd = &node->pipeline.commands[0];
+    int n = 1;
+
+    if (c->depth == 0) {
+        return -1;
+    }
+    if (cmd->word_count == 2) {
+        char* end;
+        if (cmd->words[1].vars != NULL || (n = strtol(cmd->words[1].text, &end, 10)) < 1 || *end != '\0') {
+            return -1;
+        }
+    }
+    if (n > c->depth) {
+        n = c->depth;
+    }
+    struct loop_label* loop = &c->loops[c->depth - n];
+    int at = emit(c, OP_UNWIND, is_break ? n : n - 1, NULL);
+    if (is_break) {
+        loop->breaks = arena_grow(loop->breaks, loop->break_count, &loop->break_capacity, sizeof(int));
+        loop->breaks[loop->break_count++] = at;
+    } else {
+        c->program->code[at].target = loop->top;
+    }
+    return 0;
+}
+
+static void compile_node(struct compiler* c, struct node* node);
+
+// The body of a loop whose next pass starts at top; then leave it
+static void compile_loop_body(struct compiler* c, struct node* body, int top, int exit_jump) {
+    if (c->depth == c->capacity) {
+        c->loops = arena_grow(c->loops, c->depth, &c->capacity, sizeof(struct loop_label));
+    }
+    struct loop_label* loop = &c->loops[c->depth++];
+    memset(loop, 0, sizeof(*loop));
+    loop->top = top;
+    if (c->depth > c->program->loop_depth) {
+        c->program->loop_depth = c->depth;
+    }
+    compile_node(c, body);
+    loop = &c->loops[--c->depth];
+    emit(c, OP_SAVE, 0, NULL);
+    int back = emit(c, OP_JUMP, 0, NULL);
+    c->program->code[back].target = top;
+    c->program->code[exit_jump].target = c->program->count;
+    emit(c, OP_EXIT, 0, NULL);
+    // OP_LOOP or OP_FOR, just before top: where a break at run time goes
+    c->program->code[top - 1].target = c->program->count;
+    for (int i = 0; i < loop->break_count; i++) {
+        c->program->code[loop->breaks[i]].target = c->program->count;
+    }
+}
+
+static void compile_node(struct compiler* c, struct node* node) {
+    int at, top;
+    const char* control;
+
+    switch (node->type) {
+    case NODE_PIPELINE:
+        if (node->pipeline.count == 1 && node->pipeline.commands[0].body != NULL &&
+            node->pipeline.commands[0].redirects == NULL && !node->pipeline.timed &&
+            !node->pipeline.cached && !node->pipeline.negated && node->pipeline.guard == NULL) {
+            struct node* body = node->pipeline.commands[0].body;
+            if (body->type == NODE_FUNCTION) {
+                emit(c, OP_DEFINE, 0, body);
+            } else {
+                compile_node(c, body);
+            }
+            return;
+        }
+        if (node->pipeline.count == 1 && (control = control_word(node)) != NULL) {
+            if (control[0] == 'r' && c->in_function) {
+                struct command* cmd = &node->pipeline.commands[0];
+                emit(c, OP_RETURN, 0, cmd->word_count == 2 ? &cmd->words[1] : NULL);
+                return;
+            }
+            if (control[0] != 'r' && compile_unwind(c, node, control[0] == 'b') == 0) {
+                return;
+            }
+        }
+        emit(c, OP_EXEC, 0, node);
+        return;
+    case NODE_AND:
+    case NODE_OR:
+        compile_node(c, node->left);
+        at = emit(c, node->type == NODE_AND ? OP_JUMP_FAIL : OP_JUMP_OK, 0, NULL);
+        compile_node(c, node->right);
+        c->program->code[at].target = c->program->count;
+        return;
+    case NODE_SEQUENCE:
+        compile_node(c, node->left);
+        compile_node(c, node->right);
+        return;
+    case NODE_BACKGROUND:
+        emit(c, OP_EXEC, 0, node);
+        return;
+    case NODE_IF:
+        compile_node(c, node->left);
+        at = emit(c, OP_JUMP_FAIL, 0, NULL);
+        compile_node(c, node->right);
+        top = emit(c, OP_JUMP, 0, NULL);
+        c->program->code[at].target = c->program->count;
+        if (node->other != NULL) {
+            compile_node(c, node->other);
+        } else {
+            emit(c, OP_STATUS, 0, NULL);    // no branch taken: status 0
+        }
+        c->program->code[top].target = c->program->count;
+        return;
+    case NODE_WHILE:
+    case NODE_UNTIL:
+        emit(c, OP_LOOP, 0, NULL);
+        top = emit(c, OP_TOP, 0, NULL);
+        compile_node(c, node->left);
+        at = emit(c, node->type == NODE_WHILE ? OP_JUMP_FAIL : OP_JUMP_OK, 0, NULL);
+        compile_loop_body(c, node->right, top, at);
+        return;
+    case NODE_FOR:
+        emit(c, OP_FOR, 0, node);
+        top = emit(c, OP_NEXT, 0, node);
+        compile_loop_body(c, node->right, top, top);
+        return;
+    case NODE_GROUP:
+        compile_node(c, node->left);
+        return;
+    case NODE_FUNCTION:
+        emit(c, OP_DEFINE, 0, node);
+        return;
+    }
+}
+
+// Compile a compound command; in_function lets `return` leave the program
+struct program* compile(struct node* node, int in_function) {
+    struct compiler c = { NULL, in_function, NULL, 0, 0 };
+
+    c.program = arena_alloc(&line_arena, sizeof(*c.program));
+    memset(c.program, 0, sizeof(*c.program));
+    compile_node(&c, node);
+    return c.program;
+}
+
+/*
+ * Run a compiled compound command and return its status. Loops take an
+ * arena mark on entry and roll back to it at the start of every pass,
+ * so a million passes use the memory of one.
+ */
+int run_program(const struct program* program) {
+    struct loop_frame frames[program->loop_depth + 1];
+    struct loop_frame* loop = frames;   // frames[0] is never used
+    int base = loops_running;
+    int status = 0;
+
+    for (int pc = 0; pc < program->count; pc++) {
+        const struct instr* in = &program->code[pc];
+        struct node* node = in->ref;
+
+        switch (in->op) {
+        case OP_EXEC:
+            loops_running = base + (loop - frames);
+            status = execute_node(node);
+            loops_running = base;
+            // Ctrl-C at the terminal stops the loop, not just one command
+            if (function_return || (shell_interactive && status == 128 + SIGINT)) {
+                return status;
+            }
+            if (loop_unwind > 0) {
+                // A break or continue the compiler could not turn into a jump
+                int local = loop - frames;
+                if (loop_unwind > local) {
+                    loop_unwind -= local;
+                    return 0;
+                }
+                struct loop_frame* target = loop - (loop_unwind - 1);
+                loop_unwind = 0;
+                status = 0;
+                if (loop_continue) {
+                    loop = target;
+                    pc = target->top - 1;
+                } else {
+                    loop = target - 1;
+                    pc = target->end - 1;
+                }
+            }
+            break;
+        case OP_JUMP:
+            pc = in->target - 1;
+            break;
+        case OP_JUMP_FAIL:
+            if (status != 0) {
+                pc = in->target - 1;
+            }
+            break;
+        case OP_JUMP_OK:
+            if (status == 0) {
+                pc = in->target - 1;
+            }
+            break;
+        case OP_STATUS:
+            status = in->arg;
+            break;
+        case OP_LOOP:
+            *++loop = (struct loop_frame){ arena_mark(&line_arena), NULL, 0, 0, 0, pc + 1, in->target };
+            break;
+        case OP_FOR:
+            ++loop;
+            if (node->word_count < 0) {
+                // No `in`: the positional parameters, as they are now
+                loop->items = arena_alloc(&line_arena, (positional_count + 1) * sizeof(char*));
+                memcpy(loop->items, positional, positional_count * sizeof(char*));
+                loop->count = positional_count;
+            } else {
+                loop->items = expand_words(node->words, node->word_count, &loop->count);
+            }
+            loop->mark = arena_mark(&line_arena);
+            loop->index = 0;
+            loop->status = 0;
+            loop->top = pc + 1;
+            loop->end = in->target;
+            break;
+        case OP_NEXT:
+            arena_release(&line_arena, loop->mark);
+            if (loop->index < loop->count) {
+                var_set(node->name, loop->items[loop->index++], 0);
+            } else {
+                pc = in->target - 1;
+            }
+            break;
+        case OP_TOP:
+            arena_release(&line_arena, loop->mark);
+            break;
+        case OP_SAVE:
+            loop->status = status;
+            break;
+        case OP_EXIT:
+            status = (loop--)->status;
+            break;
+        case OP_UNWIND:
+            loop -= in->arg;
+            status = 0;
+            pc = in->target - 1;
+            break;
+        case OP_RETURN:
+            if (in->ref != NULL) {
+                status = atoi(expand_word(in->ref)) & 0xff;
+            }
+            function_return = 1;
+            return status;
+        case OP_DEFINE:
+            define_function(node);
+            status = 0;
+            break;
+        }
+        last_status = status;
+    }
+    return status;
+}
+
+// A compound command run as a command: a function definition defines it
+int run_compound(struct node* node) {
+    if (node->type == NODE_FUNCTION) {
+        define_function(node);
+        return 0;
+    }
+    return run_program(node->code);
+}
+
+// Run a compound command as one stage of a pipeline
+pid_t spawn_compound(struct node* node, const int* io, pid_t pgid) {
+    pid_t pid = fork_stage(io, pgid, NULL, 0);
+
+    if (pid == 0) {
+        trace_child("compound");
+        int status = run_compound(node);
+        fflush(stdout);
+        _exit(status);
+    }
+    trace(TRACE_SPAWN, pid, 0, "compound");
+    return pid;
+}
+
+const struct function* find_function(const char* name) {
+    if (function_count == 0) {
+        return NULL;
+    }
+    for (struct function* f = functions[hash_string(name) % FUNCTION_BUCKETS]; f != NULL; f = f->next) {
+        if (strcmp(f->name, name) == 0) {
+            return f;
+        }
+    }
+    return NULL;
+}
+
+// (Re)define a function; its body stays in the source it was parsed into
+void define_function(struct node* def) {
+    unsigned int bucket = hash_string(def->name) % FUNCTION_BUCKETS;
+    struct function* f = (struct function*)find_function(def->name);
+
+    if (f == NULL) {
+        f = calloc(1, sizeof(*f));
+        f->name = strdup(def->name);
+        f->next = functions[bucket];
+        functions[bucket] = f;
+        function_count++;
+    } else {
+        source_release(f->source);
+    }
+    f->def = def;
+    f->source = current_source;
+    if (current_source != NULL) {
+        current_source->refs++;
+    }
+}
+
+/*
+ * Call a function (it runs like a builtin, see find_builtin()). Its
+ * arguments are $1... for the duration; its status is that of the last
+ * command it ran, or the one given to `return`.
+ */
+int call_function(char** args) {
+    const struct function* f = find_function(args[0]);
+    char** saved_positional = positional;
+    int saved_count = positional_count;
+    struct source* saved_source = current_source;
+
+    if (f == NULL) {
+        return 127;
+    }
+    if (call_depth >= FUNCTION_NESTING) {
+        fprintf(stderr, "miell: %s: maximum function nesting level exceeded (%d)\n", args[0], FUNCTION_NESTING);
+        return 1;
+    }
+    // Hold the body even if the function redefines itself
+    struct node* def = f->def;
+    current_source = f->source;
+    if (current_source != NULL) {
+        current_source->refs++;
+    }
+    positional = args + 1;
+    for (positional_count = 0; positional[positional_count] != NULL; positional_count++) {
+    }
+    // break and continue only reach the loops written in the body
+    int saved_loops = loops_running;
+    loops_running = 0;
+    call_depth++;
+    int status = run_program(def->code);
+    call_depth--;
+    function_return = 0;
+    loops_running = saved_loops;
+    source_release(current_source);
+    current_source = saved_source;
+    positional = saved_positional;
+    positional_count = saved_count;
+    return status;
+}
+
+/*
+ * Commands the shell runs itself. A builtin that stands alone runs in
+ * the shell process with its redirections applied around it; inside a
+ * pipeline it gets a forked copy of the shell instead (spawn_builtin),
+ * since the other stages need something to wait for.
+ */
+struct builtin {
+    const char* name;
+    int (*fn)(char** args);
+};
+
+static const struct builtin builtins[] = {
+    { "cd", builtin_cd },
+    { "exit", builtin_exit },
+    { "hash", builtin_hash },
+    { "jobs", builtin_jobs },
+    { "fg", builtin_fg },
+    { "bg", builtin_bg },
+    { "wait", builtin_wait },
+    { "echo", builtin_echo },
+    { "printf", builtin_printf },
+    { "test", builtin_test },
+    { "[", builtin_test },
+    { "true", builtin_true },
+    { ":", builtin_true },
+    { "false", builtin_false },
+    { "pwd", builtin_pwd },
+    { "export", builtin_export },
+    { "unset", builtin_unset },
+    { "parallel", builtin_parallel },
+    { "trace", builtin_trace },
+    { "break", builtin_break },
+    { "continue", builtin_break },
+    { "return", builtin_return },
+    { "shift", builtin_shift },
+    { NULL, NULL }
+};
+
+// Shell functions are called through the same entry as builtins
+static const struct builtin function_call = { "function", call_function };
+
+const struct builtin* find_builtin(const char* name) {
+    for (const struct builtin* b = builtins; b->name != NULL; b++) {
+        if (strcmp(name, b->name) == 0) {
+            return b;
+        }
+    }
+    return find_function(name) ? &function_call : NULL;
+}
+
+// Close the descriptors in io[] above stderr, once each
+static void close_io(const int* io) {
+    for (int fd = 0; fd < 3; fd++) {
+        if (io[fd] > STDERR_FILENO && (fd < 1 || io[fd] != io[0]) && (fd < 2 || io[fd] != io[1])) {
+            close(io[fd]);
+        }
+    }
+}
+
+/*
+ * Run a standalone builtin in the shell, or with builtin NULL the
+ * command's compound body. stdin/stdout/stderr are saved above the range
+ * the redirections use, pointed at io[] for the duration of the call,
+ * then put back.
+ */
+int execute_builtin(const struct builtin* builtin, struct command* cmd) {
+    int io[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+    int saved[3] = { -1, -1, -1 };
+    int fd, status;
+
+    if (cmd->redirects == NULL) {
+        return builtin ? builtin->fn(cmd->argv) : run_compound(cmd->body);
+    }
+    if (handle_redirection(cmd->redirects, io) == -1) {
+        status = 1;
+        goto out;
+    }
+    fflush(stdout);
+    // Save all three first: io[] may name a standard fd that is about
+    // to be replaced, as in "2>&1 > file"
+    for (fd = 0; fd < 3; fd++) {
+        if (io[fd] != fd) {
+            saved[fd] = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+        }
+    }
+    for (fd = 0; fd < 3; fd++) {
+        if (io[fd] != fd) {
+            int src = (io[fd] <= STDERR_FILENO && saved[io[fd]] != -1) ? saved[io[fd]] : io[fd];
+            dup2(src, fd);
+        }
+    }
+    status = builtin ? builtin->fn(cmd->argv) : run_compound(cmd->body);
+    fflush(stdout);
+    for (fd = 0; fd < 3; fd++) {
+        if (saved[fd] != -1) {
+            dup2(saved[fd], fd);
+            close(saved[fd]);
+        } else if (io[fd] != fd) {
+            close(fd);
+        }
+    }
+out:
+    close_io(io);
+    return status;
+}
+
+static void close_fd_range(unsigned int first, unsigned int last) {
+    if (syscall(SYS_close_range, first, last, 0) == -1 && errno == ENOSYS) {
+        // Before Linux 5.9: close whatever could be open one by one
+        long max = sysconf(_SC_OPEN_MAX);
+        for (long fd = first; fd <= (long)last && fd < max; fd++) {
+            close(fd);
+        }
+    }
+}
+
+/*
+ * In a forked copy of the shell, close every descriptor above stderr
+ * with close_range(), except the ends of process substitutions, which a
+ * stage may be handed by name, and the keep_count fds in keep. A forked
+ * child never execs, so close-on-exec does not help it, and a pipe end
+ * it kept would hold off EOF for the stage reading the pipe.
+ */
+static void close_shell_fds(const int* keep, int keep_count) {
+    int count = substitution_count + keep_count;
+    int* kept = malloc((count ? count : 1) * sizeof(int));
+    unsigned int first = STDERR_FILENO + 1;
+
+    for (int i = 0; i < count; i++) {
+        kept[i] = i < substitution_count ? substitutions[i].fd : keep[i - substitution_count];
+    }
+    // Substitutions are opened in order, so these mostly ascend already
+    for (int i = 1; i < count; i++) {
+        for (int j = i; j > 0 && kept[j] < kept[j - 1]; j--) {
+            int swap = kept[j];
+            kept[j] = kept[j - 1];
+            kept[j - 1] = swap;
+        }
+    }
+    for (int i = 0; i <= count; i++) {
+        unsigned int last = (i < count) ? (unsigned int)kept[i] - 1 : ~0U;
+        if (i < count && kept[i] < (int)first) {
+            continue;
+        }
+        if (last >= first) {
+            close_fd_range(first, last);
+        }
+        if (i < count) {
+            first = kept[i] + 1;
+        }
+    }
+    free(kept);
+}
+
+/*
+ * Fork a copy of the shell to run one pipeline stage in-process, set up
+ * the way spawn_stage() sets up an external command, but also holding
+ * the fds in keep. Returns 0 in the child, the child's pid in the shell,
+ * or -1.
+ */
+static pid_t fork_stage(const int* io, pid_t pgid, const int* keep, int keep_count) {
+    pid_t pid = fork();
+
+    if (pid == -1) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        sigset_t mask;
+        if (pgid >= 0) {
+            setpgid(0, pgid);
+        }
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+        signal(SIGINT, SIG_DFL);
+        signal(SIGQUIT, SIG_DFL);
+        signal(SIGTSTP, SIG_DFL);
+        signal(SIGTTIN, SIG_DFL);
+        signal(SIGTTOU, SIG_DFL);
+        for (int fd = 0; fd < 3; fd++) {
+            if (io[fd] != fd) {
+                dup2(io[fd], fd);
+            }
+        }
+        close_shell_fds(keep, keep_count);
+        if (stage_limits != NULL && apply_limits(stage_limits) == -1) {
+            _exit(126);
+        }
+        stage_limits = NULL;
+        signal_fd = -1;
+        event_fd = -1;
+        deadline_fd = -1;
+        deadline_count = 0;
+        job_count = 0;
+        shell_interactive = 0;
+        serve_client = -1;
+        return 0;
+    }
+    if (pgid >= 0) {
+        setpgid(pid, pgid == 0 ? pid : pgid);
+    }
+    return pid;
+}
+
+// Run a builtin as one stage of a pipeline
+pid_t spawn_builtin(const struct builtin* builtin, char** args, const int* io,
+                    pid_t pgid) {
+    pid_t pid = fork_stage(io, pgid, NULL, 0);
+
+    if (pid == 0) {
+        trace_child(args[0]);
+        int status = builtin->fn(args);
+        fflush(stdout);
+        _exit(status);
+    }
+    trace(TRACE_SPAWN, pid, 0, args[0]);
+    return pid;
+}
+
+int builtin_cd(char** args) {
+    if (args[1] == NULL) {
+        fprintf(stderr, "cd: missing argument\n");
+        return 1;
+    }
+    if (chdir(args[1]) != 0) {
+        perror("cd");
+        return 1;
+    }
+    return 0;
+}
+
+int builtin_exit(char** args) {
+    if (args[1] != NULL) {
+        last_status = atoi(args[1]) & 0xff;
+    }
+    fflush(stdout);
+    exit(last_status);
+}
+
+int builtin_fg(char** args) {
+    return builtin_fg_bg(args, 1);
+}
+
+int builtin_bg(char** args) {
+    return builtin_fg_bg(args, 0);
+}
+
+int builtin_true(char** args) {
+    (void)args;
+    return 0;
+}
+
+/*
+ * break [n] and continue [n] that were not compiled into jumps (the count
+ * is a variable, or there is a redirection): have run_program() leave
+ * the loops once this command returns.
+ */
+int builtin_break(char** args) {
+    char* end = NULL;
+    long n = args[1] ? strtol(args[1], &end, 10) : 1;
+
+    if (loops_running == 0) {
+        fprintf(stderr, "miell: %s: only meaningful in a `for', `while', or `until' loop\n", args[0]);
+        return 0;
+    }
+    if (n < 1 || (end != NULL && (*end != '\0' || end == args[1]))) {
+        fprintf(stderr, "miell: %s: %s: loop count out of range\n", args[0], args[1]);
+        return 1;
+    }
+    loop_unwind = n < loops_running ? n : loops_running;
+    loop_continue = args[0][0] == 'c';
+    return 0;
+}
+
+// return [n] not compiled into the function: unwinds like OP_RETURN
+int builtin_return(char** args) {
+    if (call_depth == 0) {
+        fprintf(stderr, "miell: return: can only `return' from a function\n");
+        return 1;
+    }
+    function_return = 1;
+    return args[1] ? atoi(args[1]) & 0xff : last_status;
+}
+
+int builtin_shift(char** args) {
+    int n = args[1] ? atoi(args[1]) : 1;
+
+    if (n < 0 || n > positional_count) {
+        fprintf(stderr, "miell: shift: %s: shift count out of range\n", args[1]);
+        return 1;
+    }
+    positional += n;
+    positional_count -= n;
+    return 0;
+}
+
+int builtin_false(char** args) {
+    (void)args;
+    return 1;
+}
+
+int builtin_pwd(char** args) {
+    char cwd[4096];
+
+    (void)args;
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        perror("pwd");
+        return 1;
+    }
+    puts(cwd);
+    return 0;
+}
+
+static int valid_name(const char* name, size_t len) {
+    if (len == 0 || isdigit((unsigned char)name[0])) {
+        return 0;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (!is_name_char(name[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Slot for name: its entry, or where it would go (the first removed
+// slot passed on the way, else the empty slot that ended the probe)
+static struct var* var_slot(const char* name) {
+    size_t mask = var_capacity - 1;
+    struct var* reuse = NULL;
+
+    for (size_t i = hash_string(name) & mask; ; i = (i + 1) & mask) {
+        struct var* v = &var_table[i];
+        if (v->name == NULL) {
+            return reuse ? reuse : v;
+        }
+        if (v->name == VAR_DELETED) {
+            if (reuse == NULL) {
+                reuse = v;
+            }
+        } else if (strcmp(v->name, name) == 0) {
+            return v;
+        }
+    }
+}
+
+// Double the table (or just drop removed slots) once it is 3/4 used
+static void var_grow(void) {
+    struct var* old = var_table;
+    size_t old_capacity = var_capacity;
+    size_t live = 0;
+
+    for (size_t i = 0; i < old_capacity; i++) {
+        live += old[i].name != NULL && old[i].name != VAR_DELETED;
+    }
+    var_capacity = old_capacity == 0 ? 64 : (live + 1) * 2 > old_capacity ? old_capacity * 2 : old_capacity;
+    var_table = calloc(var_capacity, sizeof(struct var));
+    var_used = live;
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old[i].name != NULL && old[i].name != VAR_DELETED) {
+            *var_slot(old[i].name) = old[i];
+        }
+    }
+    free(old);
+}
+
+static struct var* var_find(const char* name) {
+    if (var_capacity == 0) {
+        return NULL;
+    }
+    struct var* v = var_slot(name);
+    return (v->name == NULL || v->name == VAR_DELETED) ? NULL : v;
+}
+
+const char* var_get(const char* name) {
+    struct var* v = var_find(name);
+    return v ? v->value : NULL;
+}
+
+// Point v's env_vec entry at its current value, adding or dropping it
+static void var_sync_env(struct var* v) {
+    if (!v->exported || v->value == NULL) {
+        if (v->env_index >= 0) {
+            // Move the last entry into the hole so the array stays dense
+            int last = --env_count;
+            free(env_vec[v->env_index]);
+            env_vec[v->env_index] = env_vec[last];
+            env_vec[last] = NULL;
+            if (last != v->env_index) {
+                const char* moved = env_vec[v->env_index];
+                char* name = strndup(moved, strchr(moved, '=') - moved);
+                var_find(name)->env_index = v->env_index;
+                free(name);
+            }
+            v->env_index = -1;
+        }
+        return;
+    }
+
+    char* entry;
+    if (asprintf(&entry, "%s=%s", v->name, v->value) == -1) {
+        perror("asprintf");
+        return;
+    }
+    if (v->env_index >= 0) {
+        free(env_vec[v->env_index]);
+        env_vec[v->env_index] = entry;
+        return;
+    }
+    if (env_count + 1 >= env_capacity) {
+        env_capacity = env_capacity ? env_capacity * 2 : 64;
+        env_vec = realloc(env_vec, env_capacity * sizeof(char*));
+        environ = env_vec;
+    }
+    v->env_index = env_count;
+    env_vec[env_count++] = entry;
+    env_vec[env_count] = NULL;
+}
+
+/*
+ * Set a variable; value NULL leaves it unset but still creates it. With
+ * export set it is marked for export, otherwise it keeps its mark. Only
+ * an exported variable touches environ, and then only its own entry.
+ */
+void var_set(const char* name, const char* value, int export) {
+    if ((var_used + 1) * 4 > var_capacity * 3) {
+        var_grow();
+    }
+    struct var* v = var_slot(name);
+    if (v->name == NULL || v->name == VAR_DELETED) {
+        if (v->name == NULL) {
+            var_used++;
+        }
+        v->name = strdup(name);
+        v->value = NULL;
+        v->exported = 0;
+        v->env_index = -1;
+    }
+    if (value != NULL) {
+        free(v->value);
+        v->value = strdup(value);
+    }
+    v->exported |= export;
+    if (v->exported) {
+        var_sync_env(v);
+    }
+}
+
+void var_unset(const char* name) {
+    struct var* v = var_find(name);
+
+    if (v == NULL) {
+        return;
+    }
+    v->exported = 0;
+    var_sync_env(v);
+    free(v->name);
+    free(v->value);
+    v->name = VAR_DELETED;
+    v->value = NULL;
+}
+
+// Take over the inherited environment; environ points at env_vec after
+void init_vars(void) {
+    char** inherited = environ;
+
+    shell_pid = getpid();
+    env_capacity = 64;
+    env_vec = calloc(env_capacity, sizeof(char*));
+    for (char** env = inherited; env != NULL && *env != NULL; env++) {
+        char* eq = strchr(*env, '=');
+        if (eq == NULL || !valid_name(*env, eq - *env)) {
+            continue;
+        }
+        char* name = strndup(*env, eq - *env);
+        var_set(name, eq + 1, 1);
+        free(name);
+    }
+    environ = env_vec;
+}
+
+int builtin_export(char** args) {
+    int status = 0;
+
+    if (args[1] == NULL) {
+        for (char** env = environ; *env != NULL; env++) {
+            printf("export %s\n", *env);
+        }
+        return 0;
+    }
+    for (int i = 1; args[i] != NULL; i++) {
+        char* eq = strchr(args[i], '=');
+        size_t len = eq ? (size_t)(eq - args[i]) : strlen(args[i]);
+        if (!valid_name(args[i], len)) {
+            fprintf(stderr, "export: %s: not a valid identifier\n", args[i]);
+            status = 1;
+        } else if (eq != NULL) {
+            *eq = '\0';
+            var_set(args[i], eq + 1, 1);
+            *eq = '=';
+        } else {
+            var_set(args[i], NULL, 1);
+        }
+    }
+    return status;
+}
+
+int builtin_unset(char** args) {
+    int status = 0;
+
+    for (int i = 1; args[i] != NULL; i++) {
+        if (i == 1 && strcmp(args[i], "-v") == 0) {
+            continue;
+        }
+        if (!valid_name(args[i], strlen(args[i]))) {
+            fprintf(stderr, "unset: %s: not a valid identifier\n", args[i]);
+            status = 1;
+        } else {
+            var_unset(args[i]);
+        }
+    }
+    return status;
+}
+
+/*
+ * Write the backslash escape at s to stdout and return a pointer to its
+ * last character. octal_zero selects echo -e and %b octal ("\\0nnn")
+ * over printf format octal ("\\nnn"). *stop is set by "\\c", which drops
+ * all further output.
+ */
+static const char* print_escape(const char* s, int octal_zero, int* stop) {
+    int c = *++s;
+    int value = 0, digits, max = 3;
+
+    switch (c) {
+    case 'a': putchar('\a'); return s;
+    case 'b': putchar('\b'); return s;
+    case 'c': *stop = 1; return s;
+    case 'e': putchar('\033'); return s;
+    case 'f': putchar('\f'); return s;
+    case 'n': putchar('\n'); return s;
+    case 'r': putchar('\r'); return s;
+    case 't': putchar('\t'); return s;
+    case 'v': putchar('\v'); return s;
+    case '\\': putchar('\\'); return s;
+    case 'x':
+        for (digits = 0; digits < 2 && isxdigit((unsigned char)s[1]); digits++) {
+            c = *++s;
+            value = value * 16 + (isdigit(c) ? c - '0' : tolower(c) - 'a' + 10);
+        }
+        if (digits == 0) {
+            fputs("\\x", stdout);
+        } else {
+            putchar(value);
+        }
+        return s;
+    }
+    if (c >= '0' && c <= '7' && (c == '0' || !octal_zero)) {
+        if (!octal_zero) {
+            value = c - '0';
+            max = 2;
+        }
+        for (digits = 0; digits < max && s[1] >= '0' && s[1] <= '7'; digits++) {
+            value = value * 8 + (*++s - '0');
+        }
+        putchar(value & 0xff);
+        return s;
+    }
+    putchar('\\');
+    if (c == '\0') {
+        return s - 1;
+    }
+    putchar(c);
+    return s;
+}
+
+// Write s with escapes expanded; returns 1 if output stopped at "\\c"
+static int print_escapes(const char* s, int octal_zero) {
+    int stop = 0;
+
+    for (; *s && !stop; s++) {
+        if (*s == '\\') {
+            s = print_escape(s, octal_zero, &stop);
+        } else {
+            putchar(*s);
+        }
+    }
+    return stop;
+}
+
+int builtin_echo(char** args) {
+    int newline = 1, escapes = 0;
+    int i = 1;
+
+    // Leading -n, -e and -E (or combinations like -ne) are options
+    for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+        const char* p = args[i] + 1;
+        while (*p == 'n' || *p == 'e' || *p == 'E') {
+            p++;
+        }
+        if (*p != '\0') {
+            break;
+        }
+        for (p = args[i] + 1; *p; p++) {
+            if (*p == 'n') {
+                newline = 0;
+            } else {
+                escapes = (*p == 'e');
+            }
+        }
+    }
+    for (int first = i; args[i] != NULL; i++) {
+        if (i > first) {
+            putchar(' ');
+        }
+        if (!escapes) {
+            fputs(args[i], stdout);
+        } else if (print_escapes(args[i], 1)) {
+            return 0;
+        }
+    }
+    if (newline) {
+        putchar('\n');
+    }
+    return 0;
+}
+
+// Numeric printf argument: decimal, octal, hex, or 'c for a character code
+static long long printf_number(const char* arg, int* status) {
+    char* end;
+
+    if (arg[0] == '\'' || arg[0] == '"') {
+        return (unsigned char)arg[1];
+    }
+    errno = 0;
+    long long value = strtoll(arg, &end, 0);
+    if (end == arg || *end != '\0' || errno != 0) {
+        fprintf(stderr, "printf: %s: invalid number\n", arg);
+        *status = 1;
+    }
+    return value;
+}
+
+int builtin_printf(char** args) {
+    const char* format = args[1];
+    char** arg;
+    int status = 0;
+
+    if (format == NULL) {
+        fprintf(stderr, "printf: usage: printf format [arguments]\n");
+        return 2;
+    }
+    arg = args + 2;
+    // The format is reused until the arguments run out
+    do {
+        char** start = arg;
+        for (const char* p = format; *p; p++) {
+            if (*p == '\\') {
+                int stop = 0;
+                p = print_escape(p, 0, &stop);
+                if (stop) {
+                    return status;
+                }
+                continue;
+            }
+            if (*p != '%') {
+                putchar(*p);
+                continue;
+            }
+            if (p[1] == '%') {
+                putchar('%');
+                p++;
+                continue;
+            }
+
+            // Rebuild the conversion spec for the C library, with any *
+            // width or precision filled in from the arguments
+            char spec[64];
+            size_t len = 0;
+            spec[len++] = '%';
+            for (p++; *p && strchr("-+ #0", *p) && len < 32; p++) {
+                spec[len++] = *p;
+            }
+            for (int part = 0; part < 2; part++) {
+                if (part == 1) {
+                    if (*p != '.') {
+                        break;
+                    }
+                    spec[len++] = *p++;
+                }
+                if (*p == '*') {
+                    len += snprintf(spec + len, sizeof(spec) - len, "%d",
+                                    *arg ? (int)printf_number(*arg++, &status) : 0);
+                    p++;
+                } else {
+                    while (isdigit((unsigned char)*p) && len < 56) {
+                        spec[len++] = *p++;
+                    }
+                }
+            }
+            const char* value = *arg ? *arg++ : NULL;
+            switch (*p) {
+            case 'd':
+            case 'i':
+                spec[len++] = 'l';
+                spec[len++] = 'l';
+                spec[len++] = *p;
+                spec[len] = '\0';
+                printf(spec, value ? printf_number(value, &status) : 0LL);
+                break;
+            case 'o':
+            case 'u':
+            case 'x':
+            case 'X':
+                spec[len++] = 'l';
+                spec[len++] = 'l';
+                spec[len++] = *p;
+                spec[len] = '\0';
+                printf(spec, (unsigned long long)(value ? printf_number(value, &status) : 0));
+                break;
+            case 'e':
+            case 'E':
+            case 'f':
+            case 'F':
+            case 'g':
+            case 'G':
+                spec[len++] = *p;
+                spec[len] = '\0';
+                printf(spec, value ? strtod(value, NULL) : 0.0);
+                break;
+            case 'c':
+                spec[len++] = 'c';
+                spec[len] = '\0';
+                printf(spec, value ? value[0] : '\0');
+                break;
+            case 's':
+                spec[len++] = 's';
+                spec[len] = '\0';
+                printf(spec, value ? value : "");
+                break;
+            case 'b':
+                if (value && print_escapes(value, 1)) {
+                    return status;
+                }
+                break;
+            default:
+                fprintf(stderr, "printf: %%%c: invalid directive\n", *p ? *p : ' ');
+                return 1;
+            }
+            if (*p == '\0') {
+                break;
+            }
+        }
+        if (arg == start) {
+            break;  // the format consumed nothing, so reusing it would loop
+        }
+    } while (*arg != NULL);
+    return status;
+}
+
+// Argument cursor for test/[ while it is parsed by recursive descent
+struct test_state {
+    char** args;
+    int pos;
+    int end;
+    int error;
+};
+
+static int test_expr(struct test_state* t);
+
+static int test_is_binary(const char* op) {
+    static const char* ops[] = {
+        "=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt", "-ge",
+        "-nt", "-ot", "-ef", NULL
+    };
+    for (int i = 0; ops[i] != NULL; i++) {
+        if (strcmp(op, ops[i]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int test_is_unary(const char* op) {
+    return op[0] == '-' && op[1] != '\0' && op[2] == '\0' && strchr("bcdefghLknprsStuwxz", op[1]);
+}
+
+static long long test_integer(struct test_state* t, const char* arg) {
+    char* end;
+    long long value = strtoll(arg, &end, 10);
+
+    while (isspace((unsigned char)*end)) {
+        end++;
+    }
+    if (end == arg || *end != '\0') {
+        fprintf(stderr, "test: %s: integer expression expected\n", arg);
+        t->error = 1;
+    }
+    return value;
+}
+
+static int test_unary(struct test_state* t, char op, const char* arg) {
+    struct stat st;
+
+    switch (op) {
+    case 'n': return arg[0] != '\0';
+    case 'z': return arg[0] == '\0';
+    case 't': return isatty((int)test_integer(t, arg));
+    case 'h':
+    case 'L': return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+    case 'r': return access(arg, R_OK) == 0;
+    case 'w': return access(arg, W_OK) == 0;
+    case 'x': return access(arg, X_OK) == 0;
+    }
+    if (stat(arg, &st) != 0) {
+        return 0;
+    }
+    switch (op) {
+    case 'b': return S_ISBLK(st.st_mode);
+    case 'c': return S_ISCHR(st.st_mode);
+    case 'd': return S_ISDIR(st.st_mode);
+    case 'e': return 1;
+    case 'f': return S_ISREG(st.st_mode);
+    case 'g': return (st.st_mode & S_ISGID) != 0;
+    case 'k': return (st.st_mode & S_ISVTX) != 0;
+    case 'p': return S_ISFIFO(st.st_mode);
+    case 's': return st.st_size > 0;
+    case 'S': return S_ISSOCK(st.st_mode);
+    case 'u': return (st.st_mode & S_ISUID) != 0;
+    }
+    return 0;
+}
+
+static int test_binary(struct test_state* t, const char* a, const char* op, const char* b) {
+    if (op[0] != '-') {
+        int cmp = strcmp(a, b);
+        switch (op[0]) {
+        case '=': return cmp == 0;
+        case '!': return cmp != 0;
+        case '<': return cmp < 0;
+        case '>': return cmp > 0;
+        }
+    }
+    if (strcmp(op, "-nt") == 0 || strcmp(op, "-ot") == 0 || strcmp(op, "-ef") == 0) {
+        struct stat sa, sb;
+        int ha = stat(a, &sa) == 0, hb = stat(b, &sb) == 0;
+        if (op[1] == 'e') {
+            return ha && hb && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+        }
+        if (op[1] == 'o') {
+            const char* tmp = a;
+            a = b;
+            b = tmp;
+            struct stat st = sa;
+            sa = sb;
+            sb = st;
+            int h = ha;
+            ha = hb;
+            hb = h;
+        }
+        if (!ha) {
+            return 0;
+        }
+        if (!hb) {
+            return 1;
+        }
+        return sa.st_mtim.tv_sec > sb.st_mtim.tv_sec ||
+               (sa.st_mtim.tv_sec == sb.st_mtim.tv_sec && sa.st_mtim.tv_nsec > sb.st_mtim.tv_nsec);
+    }
+
+    long long x = test_integer(t, a), y = test_integer(t, b);
+    if (strcmp(op, "-eq") == 0) return x == y;
+    if (strcmp(op, "-ne") == 0) return x != y;
+    if (strcmp(op, "-lt") == 0) return x < y;
+    if (strcmp(op, "-le") == 0) return x <= y;
+    if (strcmp(op, "-gt") == 0) return x > y;
+    return x >= y;
+}
+
+static int test_primary(struct test_state* t) {
+    char** args = t->args;
+
+    if (t->pos >= t->end) {
+        fprintf(stderr, "test: argument expected\n");
+        t->error = 1;
+        return 0;
+    }
+    if (t->pos + 2 < t->end && test_is_binary(args[t->pos + 1])) {
+        int result = test_binary(t, args[t->pos], args[t->pos + 1], args[t->pos + 2]);
+        t->pos += 3;
+        return result;
+    }
+    if (strcmp(args[t->pos], "(") == 0 && t->pos + 1 < t->end) {
+        t->pos++;
+        int result = test_expr(t);
+        if (t->pos >= t->end || strcmp(args[t->pos], ")") != 0) {
+            fprintf(stderr, "test: missing `)'\n");
+            t->error = 1;
+            return 0;
+        }
+        t->pos++;
+        return result;
+    }
+    if (test_is_unary(args[t->pos]) && t->pos + 1 < t->end) {
+        int result = test_unary(t, args[t->pos][1], args[t->pos + 1]);
+        t->pos += 2;
+        return result;
+    }
+    return args[t->pos++][0] != '\0';
+}
+
+static int test_not(struct test_state* t) {
+    // "! x" negates, but a lone "!" is just a non-empty string
+    if (t->pos + 1 < t->end && strcmp(t->args[t->pos], "!") == 0) {
+        t->pos++;
+        return !test_not(t);
+    }
+    return test_primary(t);
+}
+
+static int test_and(struct test_state* t) {
+    int result = test_not(t);
+    while (t->pos < t->end && strcmp(t->args[t->pos], "-a") == 0) {
+        t->pos++;
+        result = test_not(t) && result;
+    }
+    return result;
+}
+
+static int test_expr(struct test_state* t) {
+    int result = test_and(t);
+    while (t->pos < t->end && strcmp(t->args[t->pos], "-o") == 0) {
+        t->pos++;
+        result = test_and(t) || result;
+    }
+    return result;
+}
+
+/*
+ * test and [: exit 0 if the expression is true, 1 if it is false and 2
+ * on a usage error.
+ */
+int builtin_test(char** args) {
+    struct test_state t = { args, 1, 0, 0 };
+
+    while (args[t.end] != NULL) {
+        t.end++;
+    }
+    if (strcmp(args[0], "[") == 0) {
+        if (t.end < 2 || strcmp(args[t.end - 1], "]") != 0) {
+            fprintf(stderr, "[: missing `]'\n");
+            return 2;
+        }
+        t.end--;
+    }
+    if (t.pos >= t.end) {
+        return 1;
+    }
+    int result = test_expr(&t);
+    if (!t.error && t.pos < t.end) {
+        fprintf(stderr, "test: %s: unexpected argument\n", args[t.pos]);
+        t.error = 1;
+    }
+    return t.error ? 2 : !result;
+}
+
+// Output a `parallel` job has produced on one of its streams so far
+struct parallel_buffer {
+    char* data;
+    size_t len;
+    size_t cap;
+};
+
+// One command started by `parallel`, kept until its output is emitted
+struct parallel_job {
+    char* input;
+    pid_t pid;
+    int pidfd;                  // -1 once reaped
+    int fds[2];                 // stdout and stderr read ends, -1 at EOF
+    int status;
+    int reaped;
+    int finished;               // streams closed and process reaped
+    struct parallel_buffer out[2];
+};
+
+// Where `parallel` gets its inputs: the words after :::, or stdin lines
+struct parallel_queue {
+    char** args;
+    struct line_reader* reader;
+};
+
+static char* parallel_next_input(struct parallel_queue* queue) {
+    if (queue->args != NULL) {
+        return *queue->args ? strdup(*queue->args++) : NULL;
+    }
+    char* line = reader_read_line(queue->reader);
+    return line ? strdup(line) : NULL;
+}
+
+// The command for one input: every {} replaced, or the input appended
+static char** parallel_argv(char** command, const char* input) {
+    int count = 0, replaced = 0;
+
+    while (command[count] != NULL) {
+        count++;
+    }
+    char** argv = malloc((count + 2) * sizeof(char*));
+    size_t input_len = strlen(input);
+    for (int i = 0; i < count; i++) {
+        const char* word = command[i];
+        const char* hit = strstr(word, "{}");
+        if (hit == NULL) {
+            argv[i] = strdup(word);
+            continue;
+        }
+        replaced = 1;
+        size_t len = 0, cap = strlen(word) + input_len + 1;
+        char* out = malloc(cap);
+        for (; hit != NULL; hit = strstr(word, "{}")) {
+            size_t prefix = hit - word;
+            if (len + prefix + input_len + 1 > cap) {
+                cap = 2 * (len + prefix + input_len + 1);
+                out = realloc(out, cap);
+            }
+            memcpy(out + len, word, prefix);
+            memcpy(out + len + prefix, input, input_len);
+            len += prefix + input_len;
+            word = hit + 2;
+        }
+        out = realloc(out, len + strlen(word) + 1);
+        strcpy(out + len, word);
+        argv[i] = out;
+    }
+    if (!replaced) {
+        argv[count++] = strdup(input);
+    }
+    argv[count] = NULL;
+    return argv;
+}
+
+static struct parallel_job* parallel_start(char** command, char* input) {
+    struct parallel_job* job = calloc(1, sizeof(*job));
+    int out[2], err[2];
+    int null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    job->input = input;
+    job->pidfd = -1;
+    if (null_fd == -1 || pipe2(out, O_CLOEXEC) == -1) {
+        perror("parallel");
+        if (null_fd != -1) {
+            close(null_fd);
+        }
+        job->fds[0] = job->fds[1] = -1;
+        job->status = 1 << 8;
+        return job;
+    }
+    if (pipe2(err, O_CLOEXEC) == -1) {
+        perror("parallel");
+        close(null_fd);
+        close(out[0]);
+        close(out[1]);
+        job->fds[0] = job->fds[1] = -1;
+        job->status = 1 << 8;
+        return job;
+    }
+
+    char** argv = parallel_argv(command, input);
+    int io[3] = { null_fd, out[1], err[1] };
+    const struct builtin* builtin = find_builtin(argv[0]);
+    job->pid = builtin ? spawn_builtin(builtin, argv, io, -1)
+                       : spawn_stage(argv, environ, io, -1);
+    for (int i = 0; argv[i] != NULL; i++) {
+        free(argv[i]);
+    }
+    free(argv);
+    close(null_fd);
+    close(out[1]);
+    close(err[1]);
+
+    job->fds[0] = out[0];
+    job->fds[1] = err[0];
+    job->status = 127 << 8;
+    if (job->pid > 0) {
+        job->pidfd = syscall(SYS_pidfd_open, job->pid, 0);
+        if (job->pidfd == -1) {
+            // The job is reaped once its streams close instead
+            trace(TRACE_ERROR, errno, 0, "pidfd_open");
+        }
+    }
+    return job;
+}
+
+static void parallel_watch(int epoll, struct parallel_job* job, unsigned long seq) {
+    struct epoll_event ev = { .events = EPOLLIN };
+    int fds[3] = { job->fds[0], job->fds[1], job->pidfd };
+
+    for (int kind = 0; kind < 3; kind++) {
+        if (fds[kind] != -1) {
+            ev.data.u64 = (uint64_t)seq << 2 | kind;
+            epoll_ctl(epoll, EPOLL_CTL_ADD, fds[kind], &ev);
+        }
+    }
+}
+
+// Mark a job finished once its streams are at EOF and it has been reaped
+static int parallel_settle(struct parallel_job* job) {
+    if (job->finished || job->fds[0] != -1 || job->fds[1] != -1) {
+        return 0;
+    }
+    if (job->pid > 0 && !job->reaped) {
+        if (job->pidfd != -1) {
+            return 0;
+        }
+        waitpid(job->pid, &job->status, 0);
+        job->reaped = 1;
+    }
+    job->finished = 1;
+    return 1;
+}
+
+/*
+ * Drop a descriptor from the epoll set explicitly: closing it is not
+ * enough while a forked builtin job still holds a copy.
+ */
+static void parallel_close(int epoll, int* fd) {
+    epoll_ctl(epoll, EPOLL_CTL_DEL, *fd, NULL);
+    close(*fd);
+    *fd = -1;
+}
+
+static void parallel_read(int epoll, struct parallel_job* job, int stream) {
+    struct parallel_buffer* buf = &job->out[stream];
+    ssize_t n;
+
+    if (buf->cap - buf->len < 4096) {
+        buf->cap = buf->cap ? 2 * buf->cap : 16384;
+        buf->data = realloc(buf->data, buf->cap);
+    }
+    n = read(job->fds[stream], buf->data + buf->len, buf->cap - buf->len);
+    if (n > 0) {
+        buf->len += n;
+    } else if (n == 0 || errno != EINTR) {
+        parallel_close(epoll, &job->fds[stream]);
+    }
+}
+
+static void parallel_write(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+/*
+ * parallel [-j N] command [args...] [::: input...]
+ *
+ * Run command once per input, the inputs being the words after ::: or
+ * else the lines of stdin, with at most N (default: one per online CPU,
+ * 0: no limit) running at a time. Each {} in the command is replaced by
+ * the input; without one the input is appended. A job's stdout and
+ * stderr are collected and written out in input order once it and all
+ * the jobs before it have finished. Failed jobs are reported on stderr
+ * and counted in the exit status, which is capped at 101.
+ */
+int builtin_parallel(char** args) {
+    long slots = sysconf(_SC_NPROCESSORS_ONLN);
+    struct parallel_queue queue = { NULL, NULL };
+    struct line_reader reader;
+    int i = 1, failed = 0, interrupted = 0;
+
+    for (; args[i] != NULL && args[i][0] == '-' && args[i][1] == 'j'; i++) {
+        const char* value = args[i][2] ? args[i] + 2 : args[++i];
+        char* end;
+        if (value == NULL || (slots = strtol(value, &end, 10), *end != '\0') || slots < 0) {
+            fprintf(stderr, "parallel: -j: expected a number of jobs\n");
+            return 2;
+        }
+    }
+    char** command = args + i;
+    for (; args[i] != NULL; i++) {
+        if (strcmp(args[i], ":::") == 0) {
+            args[i] = NULL;
+            queue.args = args + i + 1;
+            break;
+        }
+    }
+    if (command[0] == NULL) {
+        fprintf(stderr, "parallel: usage: parallel [-j N] command [args...] [::: input...]\n");
+        return 2;
+    }
+    if (queue.args == NULL) {
+        reader_init_fd(&reader, STDIN_FILENO);
+        queue.reader = &reader;
+    }
+    if (slots == 0) {
+        slots = LONG_MAX;
+    } else if (slots < 1) {
+        slots = 1;
+    }
+
+    int epoll = epoll_create1(EPOLL_CLOEXEC);
+    struct parallel_job** all = NULL;   // by input position, NULL once emitted
+    unsigned long started = 0, emitted = 0, capacity = 0;
+    long running = 0;
+    char* input;
+    fflush(stdout);
+
+    for (;;) {
+        while (running < slots && !interrupted && (input = parallel_next_input(&queue)) != NULL) {
+            if (started == capacity) {
+                capacity = capacity ? 2 * capacity : 64;
+                all = realloc(all, capacity * sizeof(*all));
+            }
+            struct parallel_job* job = parallel_start(command, input);
+            all[started] = job;
+            parallel_watch(epoll, job, started);
+            started++;
+            running += !parallel_settle(job);
+        }
+        // Emit finished jobs in order
+        while (emitted < started && all[emitted]->finished) {
+            struct parallel_job* job = all[emitted];
+            parallel_write(STDOUT_FILENO, job->out[0].data, job->out[0].len);
+            parallel_write(STDERR_FILENO, job->out[1].data, job->out[1].len);
+            if (job->status != 0) {
+                failed++;
+                if (WIFSIGNALED(job->status)) {
+                    fprintf(stderr, "parallel: %s: killed by signal %d\n", job->input, WTERMSIG(job->status));
+                } else {
+                    fprintf(stderr, "parallel: %s: exit %d\n", job->input, WEXITSTATUS(job->status));
+                }
+            }
+            free(job->out[0].data);
+            free(job->out[1].data);
+            free(job->input);
+            free(job);
+            all[emitted++] = NULL;
+        }
+        if (running == 0) {
+            break;
+        }
+
+        struct epoll_event events[64];
+        int n = epoll_wait(epoll, events, 64, -1);
+        if (n == -1 && errno != EINTR) {
+            perror("parallel: epoll_wait");
+            break;
+        }
+        for (int e = 0; e < n; e++) {
+            struct parallel_job* job = all[events[e].data.u64 >> 2];
+            int kind = events[e].data.u64 & 3;
+            if (kind < 2) {
+                parallel_read(epoll, job, kind);
+            } else {
+                waitpid(job->pid, &job->status, 0);
+                job->reaped = 1;
+                parallel_close(epoll, &job->pidfd);
+            }
+            if (parallel_settle(job)) {
+                running--;
+                if (WIFSIGNALED(job->status) && WTERMSIG(job->status) == SIGINT) {
+                    interrupted = 1;  // Ctrl-C: finish what is running, start nothing new
+                }
+            }
+        }
+    }
+
+    close(epoll);
+    free(all);
+    if (queue.reader != NULL) {
+        free(reader.buf);
+    }
+    return failed > 101 ? 101 : failed;
+}
+
+static unsigned int hash_string(const char* str) {
+    unsigned int h = 2166136261u;
+    while (*str) {
+        h = (h ^ (unsigned char)*str++) * 16777619u;
+    }
+    return h;
+}
+
+static char* find_in_path(const char* name) {
+    const char* path = var_get("PATH");
+    size_t name_len = strlen(name);
+    struct stat st;
+
+    if (path == NULL) {
+        path = "/usr/local/bin:/usr/bin:/bin";
+    }
+    while (*path) {
+        const char* end = strchr(path, ':');
+        size_t dir_len = end ? (size_t)(end - path) : strlen(path);
+        char* candidate = malloc(dir_len + name_len + 3);
+
+        // An empty PATH element means the current directory
+        if (dir_len == 0) {
+            candidate[0] = '.';
+            dir_len = 1;
+        } else {
+            memcpy(candidate, path, dir_len);
+        }
+        candidate[dir_len] = '/';
+        memcpy(candidate + dir_len + 1, name, name_len + 1);
+
+        if (stat(candidate, &st) == 0 && S_ISREG(st.st_mode) && access(candidate, X_OK) == 0) {
+            return candidate;
+        }
+        free(candidate);
+        if (end == NULL) {
+            break;
+        }
+        path = end + 1;
+    }
+    return NULL;
+}
+
+/*
+ * Resolve a command name to the file to exec. Names containing a slash
+ * are used as-is; everything else is looked up in $PATH once and then
+ * served from the table until PATH changes or the entry goes stale.
+ */
+const char* hash_lookup(const char* name) {
+    const char* path = var_get("PATH");
+
+    if (strchr(name, '/') != NULL) {
+        return name;
+    }
+
+    if (path == NULL) {
+        path = "";
+    }
+    if (cmd_hash_path == NULL || strcmp(cmd_hash_path, path) != 0) {
+        trace(TRACE_HASH, HASH_CLEARED, 0, path);
+        hash_clear();
+        cmd_hash_path = strdup(path);
+    }
+
+    unsigned int bucket = hash_string(name) % CMD_HASH_SIZE;
+    for (struct cmd_hash_entry* e = cmd_hash[bucket]; e != NULL; e = e->next) {
+        if (strcmp(e->name, name) == 0) {
+            e->hits++;
+            return e->path;
+        }
+    }
+
+    char* found = find_in_path(name);
+    if (found == NULL) {
+        return NULL;
+    }
+    struct cmd_hash_entry* e = malloc(sizeof(*e));
+    e->name = strdup(name);
+    e->path = found;
+    e->hits = 1;
+    e->next = cmd_hash[bucket];
+    cmd_hash[bucket] = e;
+    trace(TRACE_HASH, HASH_ADDED, 0, found);
+    return e->path;
+}
+
+void hash_forget(const char* name) {
+    unsigned int bucket = hash_string(name) % CMD_HASH_SIZE;
+    for (struct cmd_hash_entry** link = &cmd_hash[bucket]; *link != NULL; link = &(*link)->next) {
+        struct cmd_hash_entry* e = *link;
+        if (strcmp(e->name, name) == 0) {
+            *link = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+            return;
+        }
+    }
+}
+
+void hash_clear(void) {
+    for (int i = 0; i < CMD_HASH_SIZE; i++) {
+        while (cmd_hash[i] != NULL) {
+            struct cmd_hash_entry* e = cmd_hash[i];
+            cmd_hash[i] = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+        }
+    }
+    free(cmd_hash_path);
+    cmd_hash_path = NULL;
+}
+
+int builtin_hash(char** args) {
+    if (args[1] == NULL) {
+        int empty = 1;
+        for (int i = 0; i < CMD_HASH_SIZE; i++) {
+            for (struct cmd_hash_entry* e = cmd_hash[i]; e != NULL; e = e->next) {
+                if (empty) {
+                    printf("hits\tcommand\n");
+                    empty = 0;
+                }
+                printf("%4u\t%s\n", e->hits, e->path);
+            }
+        }
+        if (empty) {
+            printf("hash: hash table empty\n");
+        }
+        return 0;
+    }
+
+    int status = 0;
+    for (int i = 1; args[i] != NULL; i++) {
+        if (strcmp(args[i], "-r") == 0) {
+            hash_clear();
+        } else {
+            hash_forget(args[i]);
+            const char* path = hash_lookup(args[i]);
+            if (path == NULL) {
+                fprintf(stderr, "hash: %s: not found\n", args[i]);
+                status = 1;
+            } else if (path != args[i]) {
+                // Adding an entry by hand should not count as a use
+                unsigned int bucket = hash_string(args[i]) % CMD_HASH_SIZE;
+                for (struct cmd_hash_entry* e = cmd_hash[bucket]; e != NULL; e = e->next) {
+                    if (strcmp(e->name, args[i]) == 0) {
+                        e->hits = 0;
+                    }
+                }
+            }
+        }
+    }
+    return status;
+}
+
+/*
+ * Listing of a directory for completion: its names sorted, so a prefix
+ * is a binary search away, and kept until the directory's mtime moves.
+ */
+static struct dir_listing* dir_listing_get(const char* path) {
+    unsigned int bucket = hash_string(path) % DIR_CACHE_SIZE;
+    struct dir_listing* listing;
+    struct stat st;
+
+    if (stat(path, &st) == -1 || !S_ISDIR(st.st_mode)) {
+        return NULL;
+    }
+    for (listing = dir_cache[bucket]; listing != NULL; listing = listing->next) {
+        if (strcmp(listing->path, path) == 0) {
+            break;
+        }
+    }
+    if (listing != NULL && listing->mtime.tv_sec == st.st_mtim.tv_sec &&
+        listing->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+        return listing;
+    }
+
+    DIR* dir = opendir(path);
+    if (dir == NULL) {
+        return listing;
+    }
+    if (listing == NULL) {
+        listing = calloc(1, sizeof(*listing));
+        listing->path = strdup(path);
+        listing->next = dir_cache[bucket];
+        dir_cache[bucket] = listing;
+    }
+    free(listing->pool);
+    free(listing->names);
+    listing->mtime = st.st_mtim;
+    listing->generation = ++listing_generation;
+    listing->exec_checked = 0;
+
+    // Each name is stored after a byte holding its ENTRY_* kind; names
+    // become pointers once the pool stops moving
+    size_t pool_len = 0, pool_cap = 4096, count = 0, cap = 64;
+    char* pool = malloc(pool_cap);
+    size_t* offsets = malloc(cap * sizeof(size_t));
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        const char* name = entry->d_name;
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+            continue;
+        }
+        size_t len = strlen(name) + 1;
+        while (pool_len + len + 1 > pool_cap) {
+            pool_cap *= 2;
+            pool = realloc(pool, pool_cap);
+        }
+        if (count == cap) {
+            cap *= 2;
+            offsets = realloc(offsets, cap * sizeof(size_t));
+        }
+        int is_dir = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN) {
+            struct stat target;
+            is_dir = fstatat(dirfd(dir), name, &target, 0) == 0 && S_ISDIR(target.st_mode);
+        }
+        pool[pool_len] = is_dir ? ENTRY_DIR : 0;
+        memcpy(pool + pool_len + 1, name, len);
+        offsets[count++] = pool_len + 1;
+        pool_len += len + 1;
+    }
+    closedir(dir);
+
+    listing->pool = pool;
+    listing->count = count;
+    listing->names = malloc((count ? count : 1) * sizeof(char*));
+    for (size_t i = 0; i < count; i++) {
+        listing->names[i] = pool + offsets[i];
+    }
+    free(offsets);
+    qsort(listing->names, count, sizeof(char*), glob_compare);
+    return listing;
+}
+
+// Mark the executables in a $PATH directory, on its first use for commands
+static void dir_listing_check_exec(struct dir_listing* listing) {
+    int fd;
+
+    if (listing->exec_checked) {
+        return;
+    }
+    listing->exec_checked = 1;
+    fd = open(listing->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        return;
+    }
+    for (size_t i = 0; i < listing->count; i++) {
+        struct stat st;
+        if (fstatat(fd, listing->names[i], &st, 0) == 0 && S_ISREG(st.st_mode) && (st.st_mode & 0111)) {
+            listing->names[i][-1] |= ENTRY_EXEC;
+        }
+    }
+    close(fd);
+}
+
+static void trie_free(struct trie_node* node) {
+    for (int i = 0; i < node->count; i++) {
+        trie_free(node->children[i]);
+    }
+    free(node->labels);
+    free(node->children);
+    free(node);
+}
+
+static void trie_insert(struct trie_node* node, const char* name) {
+    for (const unsigned char* p = (const unsigned char*)name; *p; p++) {
+        int lo = 0, hi = node->count;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (node->labels[mid] < *p) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if (lo == node->count || node->labels[lo] != *p) {
+            node->labels = realloc(node->labels, node->count + 1);
+            node->children = realloc(node->children, (node->count + 1) * sizeof(struct trie_node*));
+            memmove(node->labels + lo + 1, node->labels + lo, node->count - lo);
+            memmove(node->children + lo + 1, node->children + lo, (node->count - lo) * sizeof(struct trie_node*));
+            node->labels[lo] = *p;
+            node->children[lo] = calloc(1, sizeof(struct trie_node));
+            node->count++;
+        }
+        node = node->children[lo];
+    }
+    node->name = name;
+}
+
+/*
+ * The command trie covers builtins and the executables in every $PATH
+ * directory. Each Tab only stats the directories; the trie is rebuilt
+ * (from cached listings, re-reading just the ones that changed) when
+ * PATH is set to something else or one of its directories has changed.
+ */
+static struct trie_node* command_trie_get(void) {
+    const char* path = var_get("PATH");
+    unsigned long newest = 0;
+    struct dir_listing* listings[256];
+    int listing_count = 0;
+
+    if (path == NULL) {
+        path = "/usr/local/bin:/usr/bin:/bin";
+    }
+    for (const char* p = path; listing_count < 256;) {
+        const char* end = strchr(p, ':');
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+        char dir[PATH_MAX];
+        snprintf(dir, sizeof(dir), "%.*s", len > 0 ? (int)len : 1, len > 0 ? p : ".");
+        struct dir_listing* listing = dir_listing_get(dir);
+        if (listing != NULL) {
+            dir_listing_check_exec(listing);
+            listings[listing_count++] = listing;
+            if (listing->generation > newest) {
+                newest = listing->generation;
+            }
+        }
+        if (end == NULL) {
+            break;
+        }
+        p = end + 1;
+    }
+
+    if (command_trie != NULL && newest <= command_trie_generation &&
+        command_trie_path != NULL && strcmp(command_trie_path, path) == 0) {
+        return command_trie;
+    }
+    if (command_trie != NULL) {
+        trie_free(command_trie);
+    }
+    free(command_trie_path);
+    command_trie = calloc(1, sizeof(struct trie_node));
+    command_trie_path = strdup(path);
+    command_trie_generation = newest;
+    for (const struct builtin* b = builtins; b->name != NULL; b++) {
+        trie_insert(command_trie, b->name);
+    }
+    for (int i = 0; i < listing_count; i++) {
+        for (size_t j = 0; j < listings[i]->count; j++) {
+            if (entry_kind(listings[i]->names[j]) & ENTRY_EXEC) {
+                trie_insert(command_trie, listings[i]->names[j]);
+            }
+        }
+    }
+    return command_trie;
+}
+
+static void completion_add(struct completion* c, const char* name, int kind) {
+    if (c->count == c->capacity) {
+        c->capacity = c->capacity ? c->capacity * 2 : 64;
+        c->names = realloc(c->names, c->capacity * sizeof(char*));
+        c->kinds = realloc(c->kinds, c->capacity);
+    }
+    c->names[c->count] = name;
+    c->kinds[c->count] = kind;
+    c->count++;
+}
+
+static void trie_collect(const struct trie_node* node, struct completion* c) {
+    if (node->name != NULL) {
+        completion_add(c, node->name, 0);
+    }
+    for (int i = 0; i < node->count; i++) {
+        trie_collect(node->children[i], c);
+    }
+}
+
+// Characters that end a word when completing (unless backslash-escaped)
+static int is_completion_break(char ch) {
+    return ch == ' ' || ch == '\t' || ch == '|' || ch == '&' || ch == ';' || ch == '<' || ch == '>' || ch == '(';
+}
+
+/*
+ * Find what the word ending at `cursor` could be completed to. The
+ * candidates replace line[c->start..cursor]; their names point into the
+ * caches and stay valid until the next call. A word in command position
+ * without a slash completes from the command trie, anything else from
+ * the listing of the directory it names.
+ */
+void complete_word(const char* line, size_t cursor, struct completion* c) {
+    size_t start = cursor;
+    char prefix[PATH_MAX];
+    size_t prefix_len = 0;
+
+    c->count = 0;
+    while (start > 0 && !(is_completion_break(line[start - 1]) && (start < 2 || line[start - 2] != '\\'))) {
+        start--;
+    }
+    // The typed word, unescaped
+    for (size_t i = start; i < cursor && prefix_len + 1 < sizeof(prefix); i++) {
+        if (line[i] == '\\' && i + 1 < cursor) {
+            i++;
+        }
+        prefix[prefix_len++] = line[i];
+    }
+    prefix[prefix_len] = '\0';
+
+    size_t before = start;
+    while (before > 0 && (line[before - 1] == ' ' || line[before - 1] == '\t')) {
+        before--;
+    }
+    int command = before == 0 || strchr("|&;(", line[before - 1]) != NULL;
+
+    char* slash = strrchr(prefix, '/');
+    if (command && slash == NULL) {
+        const struct trie_node* node = command_trie_get();
+        for (size_t i = 0; i < prefix_len && node != NULL; i++) {
+            const struct trie_node* next = NULL;
+            for (int j = 0; j < node->count; j++) {
+                if (node->labels[j] == (unsigned char)prefix[i]) {
+                    next = node->children[j];
+                    break;
+                }
+            }
+            node = next;
+        }
+        c->start = start;
+        if (node != NULL) {
+            trie_collect(node, c);
+        }
+        return;
+    }
+
+    // Complete the last path component; a leading ~/ means $HOME
+    char dir[PATH_MAX];
+    const char* base = prefix;
+    strcpy(dir, ".");
+    if (slash != NULL) {
+        const char* home = var_get("HOME");
+        if (prefix[0] == '~' && prefix[1] == '/' && home != NULL) {
+            snprintf(dir, sizeof(dir), "%s%.*s", home, (int)(slash - prefix - 1), prefix + 1);
+        } else {
+            snprintf(dir, sizeof(dir), "%.*s", slash == prefix ? 1 : (int)(slash - prefix), prefix);
+        }
+        base = slash + 1;
+    }
+    c->start = cursor;
+    for (size_t i = cursor; i > start; i--) {
+        if (line[i - 1] == '/') {
+            break;
+        }
+        c->start = i - 1;
+    }
+
+    struct dir_listing* listing = dir_listing_get(dir);
+    if (listing == NULL) {
+        return;
+    }
+    size_t base_len = strlen(base);
+    size_t lo = 0, hi = listing->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strncmp(listing->names[mid], base, base_len) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    for (size_t i = lo; i < listing->count && strncmp(listing->names[i], base, base_len) == 0; i++) {
+        // Dot files only when asked for
+        if (listing->names[i][0] != '.' || base[0] == '.') {
+            completion_add(c, listing->names[i], entry_kind(listing->names[i]));
+        }
+    }
+}
+
+/*
+ * spawn_stage() for a pipeline under `limit`. posix_spawn cannot set
+ * resource limits, so this forks, and fork_stage() sets them in the
+ * child before the exec.
+ */
+static pid_t spawn_limited(char** args, char** envp, const int* io, pid_t pgid) {
+    const char* path = hash_lookup(args[0]);
+
+    if (path == NULL) {
+        fprintf(stderr, "Error: command not found: %s\n", args[0]);
+        trace(TRACE_ERROR, ENOENT, 0, args[0]);
+        return -1;
+    }
+    pid_t pid = fork_stage(io, pgid, NULL, 0);
+    if (pid == 0) {
+        execve(path, args, envp);
+        fprintf(stderr, "%s: %s\n", args[0], strerror(errno));
+        _exit(errno == ENOENT ? 127 : 126);
+    }
+    if (pid > 0) {
+        trace(TRACE_SPAWN, pid, 0, args[0]);
+    }
+    return pid;
+}
+
+/*
+ * Launch one pipeline stage without copying the shell's address space.
+ * posix_spawn is implemented with clone(CLONE_VM|CLONE_VFORK) on Linux,
+ * so the cost does not grow with the shell's RSS the way fork() does.
+ * The fd plumbing that used to happen in the forked child is expressed
+ * as file actions: io[0..2] are dup2'd onto stdin/stdout/stderr. Every
+ * descriptor the shell opens itself is close-on-exec, so nothing else
+ * needs closing for readers to see EOF.
+ */
+pid_t spawn_stage(char** args, char** envp, const int* io, pid_t pgid) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t mask;
+    pid_t pid;
+    int err;
+
+    if (stage_limits != NULL) {
+        return spawn_limited(args, envp, io, pgid);
+    }
+    // The shell blocks SIGCHLD and, when interactive, ignores the job
+    // control signals; children start with a clean slate. pgid 0 starts
+    // a new process group, a positive pgid joins one, -1 leaves it alone.
+    posix_spawnattr_init(&attr);
+    sigemptyset(&mask);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGQUIT);
+    sigaddset(&mask, SIGTSTP);
+    sigaddset(&mask, SIGTTIN);
+    sigaddset(&mask, SIGTTOU);
+    posix_spawnattr_setsigdefault(&attr, &mask);
+    short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+    if (pgid >= 0) {
+        flags |= POSIX_SPAWN_SETPGROUP;
+        posix_spawnattr_setpgroup(&attr, pgid);
+    }
+    posix_spawnattr_setflags(&attr, flags);
+
+    posix_spawn_file_actions_init(&actions);
+    for (int fd = 0; fd < 3; fd++) {
+        if (io[fd] != fd) {
+            posix_spawn_file_actions_adddup2(&actions, io[fd], fd);
+        }
+    }
+
+    const char* path = hash_lookup(args[0]);
+    err = (path != NULL) ? posix_spawn(&pid, path, &actions, &attr, args, envp) : ENOENT;
+    if ((err == ENOENT || err == EACCES) && path != NULL && path != args[0]) {
+        // The remembered location went away; drop it and search again
+        trace(TRACE_HASH, HASH_STALE, 0, path);
+        hash_forget(args[0]);
+        path = hash_lookup(args[0]);
+        err = (path != NULL) ? posix_spawn(&pid, path, &actions, &attr, args, envp) : ENOENT;
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+
+    if (err != 0) {
+        if (err == ENOENT && path == NULL) {
+            fprintf(stderr, "Error: command not found: %s\n", args[0]);
+        } else {
+            fprintf(stderr, "%s: %s\n", args[0], strerror(err));
+        }
+        trace(TRACE_ERROR, err, 0, args[0]);
+        return -1;
+    }
+    trace(TRACE_SPAWN, pid, 0, args[0]);
+    return pid;
+}
+
+// "64k", "1m", "2g" or plain bytes; -1 if it is not a size
+static long long parse_size(const char* value) {
+    char* end;
+    long long size = strtoll(value, &end, 10);
+
+    if (end == value) {
+        return -1;
+    }
+    switch (*end) {
+    case 'k': case 'K': size <<= 10; end++; break;
+    case 'm': case 'M': size <<= 20; end++; break;
+    case 'g': case 'G': size <<= 30; end++; break;
+    }
+    return *end == '\0' && size >= 0 ? size : -1;
+}
+
+// "1.5", "30s", "2m", "1h" or "1d" in nanoseconds; -1 if it is not a duration
+static long long parse_duration(const char* value) {
+    char* end;
+    double seconds = strtod(value, &end);
+
+    if (end == value || (!isdigit((unsigned char)*value) && *value != '.')) {
+        return -1;
+    }
+    switch (*end) {
+    case 's': end++; break;
+    case 'm': seconds *= 60; end++; break;
+    case 'h': seconds *= 60 * 60; end++; break;
+    case 'd': seconds *= 24 * 60 * 60; end++; break;
+    }
+    // Also rules out NaN; a billion seconds is over 30 years
+    if (*end != '\0' || !(seconds >= 0 && seconds <= 1e9)) {
+        return -1;
+    }
+    return (long long)(seconds * 1e9);
+}
+
+/*
+ * Expand the words of `timeout` and `limit` for one run. The timeout is 0
+ * when there is none; --cpu is rounded up to whole seconds. Returns -1
+ * after reporting a value that does not parse.
+ */
+static int resolve_guard(struct guard* guard, long long* timeout_ns, long long* kill_after_ns,
+                         struct limits* limits) {
+    const char* text;
+
+    *kill_after_ns = TIMEOUT_KILL_AFTER * 1000000000LL;
+    if (guard->timeout != NULL && (*timeout_ns = parse_duration(text = expand_word(guard->timeout))) == -1) {
+        fprintf(stderr, "miell: timeout: invalid duration `%s'\n", text);
+        return -1;
+    }
+    if (guard->kill_after != NULL &&
+        (*kill_after_ns = parse_duration(text = expand_word(guard->kill_after))) == -1) {
+        fprintf(stderr, "miell: timeout: invalid duration `%s'\n", text);
+        return -1;
+    }
+    limits->set = 0;
+    for (int i = 0; i < LIMIT_COUNT; i++) {
+        if (guard->limits[i] == NULL) {
+            continue;
+        }
+        text = expand_word(guard->limits[i]);
+        long long value = i == LIMIT_CPU ? parse_duration(text) : parse_size(text);
+        if (value == -1) {
+            fprintf(stderr, "miell: limit: invalid %s value `%s'\n", limit_options[i], text);
+            return -1;
+        }
+        if (i == LIMIT_CPU) {
+            value = (value + 999999999) / 1000000000;
+        }
+        limits->values[i] = value;
+        limits->set |= 1 << i;
+    }
+    return 0;
+}
+
+// setrlimit() for `limit`, in the stage's own process. Neither value is
+// raised past the hard limit the shell was given.
+static int apply_limits(const struct limits* limits) {
+    for (int i = 0; i < LIMIT_COUNT; i++) {
+        struct rlimit rl;
+        if (!(limits->set & (1 << i))) {
+            continue;
+        }
+        rlim_t soft = limits->values[i];
+        // Over the CPU limit a stage gets SIGXCPU, then SIGKILL a second later
+        rlim_t hard = i == LIMIT_CPU ? soft + 1 : soft;
+        if (getrlimit(limit_resources[i], &rl) == 0 && rl.rlim_max != RLIM_INFINITY && hard > rl.rlim_max) {
+            hard = rl.rlim_max;
+        }
+        rl.rlim_cur = soft < hard ? soft : hard;
+        rl.rlim_max = hard;
+        if (setrlimit(limit_resources[i], &rl) == -1) {
+            fprintf(stderr, "miell: limit %s: %s\n", limit_options[i], strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Pipe capacity requested with MIELL_PIPE_SIZE (bytes, or with a k/m
+ * suffix), read afresh for every pipeline. 0 keeps the kernel default;
+ * unprivileged users are capped at /proc/sys/fs/pipe-max-size.
+ */
+static int pipe_size(void) {
+    const char* value = var_get("MIELL_PIPE_SIZE");
+
+    if (value == NULL || *value == '\0') {
+        return 0;
+    }
+    long long size = parse_size(value);
+    if (size <= 0 || size > (1LL << 30)) {
+        return 0;
+    }
+    return (int)size;
+}
+
+// A descriptor the pump can treat as a file: not a pipe, socket or terminal
+static int pump_is_file(int fd, const struct stat* st) {
+    return !S_ISFIFO(st->st_mode) && !S_ISSOCK(st->st_mode) && !isatty(fd);
+}
+
+/*
+ * Move everything from in to out without bringing it into user space:
+ * splice(2) when either side is a pipe, copy_file_range(2) between two
+ * files. If the kernel refuses the first transfer (an O_APPEND target,
+ * a filesystem without support) this falls back to read/write.
+ */
+static int pump(int in, int out, int in_pipe, int out_pipe) {
+    static char buf[64 * 1024];
+    int moved = 0;
+    ssize_t n;
+
+    for (;;) {
+        if (in_pipe || out_pipe) {
+            n = splice(in, NULL, out, NULL, PUMP_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+        } else {
+            n = copy_file_range(in, NULL, out, NULL, PUMP_CHUNK, 0);
+        }
+        if (n > 0) {
+            moved = 1;
+            continue;
+        }
+        if (n == 0) {
+            return 0;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (moved) {
+            return -1;
+        }
+        break;
+    }
+    while ((n = read(in, buf, sizeof(buf))) != 0) {
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        for (ssize_t done = 0; done < n; ) {
+            ssize_t w = write(out, buf + done, n - done);
+            if (w == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return -1;
+            }
+            done += w;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Stages that only feed a file into a pipeline or drain one into a file
+ * ("cat < big |", "cat big |", "| cat > out") are run by a forked copy
+ * of the shell that pumps the bytes with splice/copy_file_range instead
+ * of by cat(1). Returns 0, without starting anything, when the stage is
+ * not such a stage; the caller then spawns it normally.
+ */
+pid_t spawn_pump(struct command* cmd, const int* io, pid_t pgid) {
+    struct stat in_st, out_st;
+    int in = io[0];
+    pid_t pid;
+
+    if (strcmp(cmd->argv[0], "cat") != 0 || cmd->argc > 2 ||
+        (cmd->argc == 2 && cmd->argv[1][0] == '-')) {
+        return 0;
+    }
+    if (cmd->argc == 2 && (in = open(cmd->argv[1], O_RDONLY | O_CLOEXEC)) == -1) {
+        return 0;  // let cat report it
+    }
+    if (fstat(in, &in_st) == -1 || fstat(io[1], &out_st) == -1 ||
+        (!pump_is_file(in, &in_st) && !pump_is_file(io[1], &out_st)) ||
+        S_ISDIR(in_st.st_mode)) {
+        if (in != io[0]) {
+            close(in);
+        }
+        return 0;
+    }
+
+    int stage_io[3] = { in, io[1], io[2] };
+    pid = fork_stage(stage_io, pgid, NULL, 0);
+    if (pid == 0) {
+        trace_child("cat (pump)");
+        if (pump(STDIN_FILENO, STDOUT_FILENO, S_ISFIFO(in_st.st_mode), S_ISFIFO(out_st.st_mode)) == -1) {
+            fprintf(stderr, "cat: %s\n", strerror(errno));
+            _exit(1);
+        }
+        _exit(0);
+    }
+    if (in != io[0]) {
+        close(in);
+    }
+    trace(TRACE_SPAWN, pid, 0, "cat (pump)");
+    return pid;
+}
+
+/*
+ * Move exactly len bytes out of pipe `in` into fd. A target splice()
+ * does not support (a terminal on older kernels) gets read/write.
+ */
+static int fan_out_drain(int in, int out, size_t len) {
+    static char buf[64 * 1024];
+
+    while (len > 0) {
+        ssize_t n = splice(in, NULL, out, NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n == -1 && errno == EINVAL) {
+            n = read(in, buf, len < sizeof(buf) ? len : sizeof(buf));
+            for (ssize_t done = 0; n > 0 && done < n; ) {
+                ssize_t w = write(out, buf + done, n - done);
+                if (w == -1 && errno != EINTR) {
+                    return -1;
+                }
+                done += w > 0 ? w : 0;
+            }
+        }
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Copy everything arriving on pipe `in` to each of the count (two or
+ * more) fds in out. Every target but the last gets the bytes through a
+ * pipe of its own that tee(2) fills without consuming them; the last one
+ * then takes them from `in` with splice(2). Nothing passes through user
+ * space.
+ */
+static int fan_out(int in, const int* out, int count) {
+    int (*copies)[2] = malloc(count * sizeof(*copies));
+    int size = fcntl(in, F_GETPIPE_SZ);
+    int status = 0;
+
+    for (int i = 0; i < count; i++) {
+        // splice() refuses O_APPEND files: start at the end and write on.
+        // Not for the shell's own 0-2, whose flags their other users share;
+        // fan_out_drain() copies to those by hand.
+        int flags = out[i] > STDERR_FILENO ? fcntl(out[i], F_GETFL) : -1;
+        if (flags != -1 && (flags & O_APPEND)) {
+            lseek(out[i], 0, SEEK_END);
+            fcntl(out[i], F_SETFL, flags & ~O_APPEND);
+        }
+        if (i < count - 1) {
+            if (pipe(copies[i]) == -1) {
+                return -1;
+            }
+            // As big as `in`, so each tee() takes the whole chunk
+            if (size > 0 && fcntl(copies[i][1], F_SETPIPE_SZ, size) < size) {
+                size = fcntl(copies[i][1], F_GETPIPE_SZ);
+            }
+        }
+    }
+
+    for (;;) {
+        ssize_t n = tee(in, copies[0][1], size, 0);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            status = n;
+            break;
+        }
+        for (int i = 0; i < count - 1 && status == 0; i++) {
+            ssize_t copied = i == 0 ? n : tee(in, copies[i][1], n, 0);
+            if (copied != n || fan_out_drain(copies[i][0], out[i], n) == -1) {
+                status = -1;
+            }
+        }
+        if (status == -1 || fan_out_drain(in, out[count - 1], n) == -1) {
+            status = -1;
+            break;
+        }
+    }
+    free(copies);
+    return status;
+}
+
+/*
+ * Several > or >> targets for one descriptor ("cmd > a > b >> c"): the
+ * stage writes into a pipe and a forked copy of the shell fans what it
+ * writes out to every target. The copy is tracked like a >(...) list,
+ * so a foreground command waits for its files to be complete. Returns
+ * the pipe's write end, or -1.
+ */
+static int start_fan_out(const int* targets, int count) {
+    int io[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+    int fds[2];
+
+    if (pipe2(fds, O_CLOEXEC) == -1) {
+        return -1;
+    }
+    // Every chunk costs a tee and a splice per target, so default to
+    // chunks bigger than a plain pipe's
+    int size = pipe_size() ? pipe_size() : FAN_OUT_PIPE_SIZE;
+    if (fcntl(fds[1], F_SETPIPE_SZ, size) == -1) {
+        trace(TRACE_ERROR, errno, size, "F_SETPIPE_SZ");
+    }
+    io[0] = fds[0];
+    fflush(stdout);
+    pid_t pid = fork_stage(io, -1, targets, count);
+    if (pid == 0) {
+        trace_child("fan-out");
+        if (fan_out(STDIN_FILENO, targets, count) == -1) {
+            fprintf(stderr, "miell: write error: %s\n", strerror(errno));
+            _exit(1);
+        }
+        _exit(0);
+    }
+    close(fds[0]);
+    if (pid == -1) {
+        close(fds[1]);
+        return -1;
+    }
+    trace(TRACE_SPAWN, pid, count, "fan-out");
+
+    if (substitution_count == substitution_capacity) {
+        substitution_capacity = substitution_capacity ? substitution_capacity * 2 : 4;
+        substitutions = realloc(substitutions, substitution_capacity * sizeof(*substitutions));
+    }
+    // No descriptor of the shell's to keep: the stage owns the write end
+    substitutions[substitution_count++] = (struct substitution){ pid, -1, 1 };
+    return fds[1];
+}
+
+/*
+ * Result cache for `cached` pipelines. A pipeline's key is a digest of
+ * its words, the working directory, a few environment variables, the
+ * commands it runs (path, size, mtime) and the contents of every file
+ * it names as an argument or with <. Entries live in a directory as
+ * one file per key: a header, then the stdout and stderr bytes. An
+ * entry's mtime is its last use, which is what the size cap evicts by.
+ * The digest is a fast 128-bit mix, not a cryptographic hash: the cache
+ * trusts what is in it.
+ */
+static void digest_init(struct digest* d) {
+    d->a = 0x9E3779B97F4A7C15ULL;
+    d->b = 0xC2B2AE3D27D4EB4FULL;
+    d->len = 0;
+}
+
+static uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static void digest_word(struct digest* d, uint64_t w) {
+    d->a = rotl64(d->a ^ w, 29) * 0xFF51AFD7ED558CCDULL;
+    d->b = rotl64(d->b + w, 31) * 0xC4CEB9FE1A85EC53ULL ^ d->a;
+}
+
+static void digest_update(struct digest* d, const void* data, size_t len) {
+    const unsigned char* p = data;
+    uint64_t w;
+
+    d->len += len;
+    for (; len >= 8; p += 8, len -= 8) {
+        memcpy(&w, p, 8);
+        digest_word(d, w);
+    }
+    if (len > 0) {
+        w = 0;
+        memcpy(&w, p, len);
+        digest_word(d, w ^ ((uint64_t)len << 56));
+    }
+}
+
+static void digest_string(struct digest* d, const char* s) {
+    digest_update(d, s, strlen(s) + 1);
+}
+
+static void digest_final(struct digest* d) {
+    digest_word(d, d->len);
+    d->a ^= d->a >> 33;
+    d->a *= 0xFF51AFD7ED558CCDULL;
+    d->a ^= d->a >> 33;
+    d->b ^= d->b >> 29;
+    d->b *= 0xC4CEB9FE1A85EC53ULL;
+    d->b ^= d->b >> 32;
+}
+
+/*
+ * Digest of a regular file's contents, or -1 if it cannot be read. Files
+ * are only read again when their size, mtime or ctime changed since they
+ * were last digested.
+ */
+static int file_digest(const char* path, const struct stat* st, struct digest* out) {
+    unsigned int bucket = (unsigned int)(st->st_ino ^ st->st_dev) % CACHE_FILES_SIZE;
+    struct file_digest* f;
+    static char buf[256 * 1024];
+
+    for (f = file_digests[bucket]; f != NULL; f = f->next) {
+        if (f->dev == st->st_dev && f->ino == st->st_ino) {
+            break;
+        }
+    }
+    if (f != NULL && f->size == st->st_size &&
+        f->mtime.tv_sec == st->st_mtim.tv_sec && f->mtime.tv_nsec == st->st_mtim.tv_nsec &&
+        f->ctime.tv_sec == st->st_ctim.tv_sec && f->ctime.tv_nsec == st->st_ctim.tv_nsec) {
+        *out = f->digest;
+        return 0;
+    }
+    if (f == NULL) {
+        f = calloc(1, sizeof(*f));
+        f->dev = st->st_dev;
+        f->ino = st->st_ino;
+        f->next = file_digests[bucket];
+        file_digests[bucket] = f;
+    }
+
+    struct digest d;
+    digest_init(&d);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    ssize_t n = 0;
+    while (fd != -1 && (n = read(fd, buf, sizeof(buf))) != 0) {
+        if (n == -1 && errno != EINTR) {
+            break;
+        }
+        if (n > 0) {
+            digest_update(&d, buf, n);
+        }
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    if (fd == -1 || n == -1) {
+        f->size = -1;
+        return -1;
+    }
+    digest_final(&d);
+    f->size = st->st_size;
+    f->mtime = st->st_mtim;
+    f->ctime = st->st_ctim;
+    f->digest = d;
+    *out = d;
+    return 0;
+}
+
+/*
+ * Fold in a file's contents if path names a regular file. -1 if it does
+ * but cannot be read: nothing would notice when it could be again.
+ */
+static int digest_file(struct digest* d, const char* path) {
+    struct stat st;
+    struct digest contents;
+
+    if (stat(path, &st) == -1 || !S_ISREG(st.st_mode)) {
+        return 0;
+    }
+    if (file_digest(path, &st, &contents) == -1) {
+        return -1;
+    }
+    digest_update(d, &contents.a, sizeof(contents.a));
+    digest_update(d, &contents.b, sizeof(contents.b));
+    return 0;
+}
+
+static int has_substitution(const struct word* word) {
+    for (const struct word_var* var = word->vars; var != NULL; var = var->next) {
+        if (var->command != NULL) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Key for an expanded pipeline, or -1 if it cannot be cached: it writes
+ * files of its own (> or >>) or uses a process substitution, neither of
+ * which a replay could reproduce, names a file it cannot read, has a
+ * compound command as a stage, or runs under `limit`, whose result is
+ * as much the limits' as the command's.
+ */
+static int cache_key(struct pipeline* pipeline, struct digest* key) {
+    char cwd[PATH_MAX];
+    const char* names = var_get("MIELL_CACHE_ENV");
+    char list[1024];
+
+    digest_init(key);
+    for (int i = 0; pipeline->guard != NULL && i < LIMIT_COUNT; i++) {
+        if (pipeline->guard->limits[i] != NULL) {
+            return -1;
+        }
+    }
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        return -1;
+    }
+    digest_string(key, cwd);
+    snprintf(list, sizeof(list), "PATH HOME LANG LC_ALL %s", names ? names : "");
+    for (char* name = strtok(list, " :"); name != NULL; name = strtok(NULL, " :")) {
+        const char* value = var_get(name);
+        digest_string(key, name);
+        digest_string(key, value ? value : "\1");
+    }
+
+    for (int i = 0; i < pipeline->count; i++) {
+        struct command* cmd = &pipeline->commands[i];
+        if (cmd->body != NULL) {
+            return -1;
+        }
+        digest_string(key, "|");
+        for (int j = 0; j < cmd->assign_count; j++) {
+            digest_string(key, expand_word(&cmd->assigns[j]));
+        }
+        for (int j = 0; j < cmd->word_count; j++) {
+            if (has_substitution(&cmd->words[j])) {
+                return -1;
+            }
+        }
+        for (int j = 0; j < cmd->argc; j++) {
+            digest_string(key, cmd->argv[j]);
+            if (j > 0 && digest_file(key, cmd->argv[j]) == -1) {
+                return -1;
+            }
+        }
+        // The program itself: an upgrade is a different command
+        const char* program = cmd->argc == 0 || find_builtin(cmd->argv[0]) ? NULL : hash_lookup(cmd->argv[0]);
+        struct stat st;
+        if (program != NULL && stat(program, &st) == 0) {
+            digest_string(key, program);
+            digest_update(key, &st.st_size, sizeof(st.st_size));
+            digest_update(key, &st.st_mtim, sizeof(st.st_mtim));
+        }
+        for (struct redirect* r = cmd->redirects; r != NULL; r = r->next) {
+            if (r->type == REDIR_OUT || r->type == REDIR_APPEND || has_substitution(&r->target) ||
+                (r->type == REDIR_HEREDOC && has_substitution(&r->body))) {
+                return -1;
+            }
+            int op[2] = { r->type, r->fd };
+            digest_update(key, op, sizeof(op));
+            const char* target = expand_word(&r->target);
+            digest_string(key, target);
+            if (r->type == REDIR_HEREDOC) {
+                digest_string(key, expand_word(&r->body));
+            }
+            if (r->type == REDIR_IN && digest_file(key, target) == -1) {
+                return -1;
+            }
+        }
+    }
+    digest_final(key);
+    return 0;
+}
+
+// $MIELL_CACHE_DIR, else $XDG_CACHE_HOME/miell or ~/.cache/miell, created
+static int cache_dir(char* dir, size_t size) {
+    const char* explicit = var_get("MIELL_CACHE_DIR");
+    const char* xdg = var_get("XDG_CACHE_HOME");
+    const char* home = var_get("HOME");
+
+    if (explicit != NULL && *explicit != '\0') {
+        snprintf(dir, size, "%s", explicit);
+    } else if (xdg != NULL && *xdg != '\0') {
+        snprintf(dir, size, "%s/miell", xdg);
+    } else if (home != NULL) {
+        snprintf(dir, size, "%s/.cache/miell", home);
+    } else {
+        return -1;
+    }
+    for (char* slash = strchr(dir + 1, '/'); ; slash = strchr(slash + 1, '/')) {
+        if (slash != NULL) {
+            *slash = '\0';
+        }
+        if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+            fprintf(stderr, "miell: cached: %s: %s\n", dir, strerror(errno));
+            return -1;
+        }
+        if (slash == NULL) {
+            return 0;
+        }
+        *slash = '/';
+    }
+}
+
+// Size cap from MIELL_CACHE_SIZE (bytes, or with a k/m/g suffix)
+static long long cache_limit(void) {
+    const char* value = var_get("MIELL_CACHE_SIZE");
+    long long size = value ? parse_size(value) : 0;
+    return size > 0 ? size : CACHE_DEFAULT_LIMIT;
+}
+
+// Add to the counters in <dir>/stats; several shells may share the cache
+static void cache_count(const char* dir, int field, uint64_t add, struct cache_stats* out) {
+    char path[PATH_MAX];
+    struct cache_stats stats = { { 0 } };
+
+    snprintf(path, sizeof(path), "%s/stats", dir);
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        return;
+    }
+    flock(fd, LOCK_EX);
+    if (pread(fd, &stats, sizeof(stats), 0) != sizeof(stats)) {
+        memset(&stats, 0, sizeof(stats));
+    }
+    if (field >= 0) {
+        stats.counts[field] += add;
+    } else if (field == CACHE_RESET) {
+        memset(&stats, 0, sizeof(stats));
+    }
+    if (field != CACHE_PEEK && pwrite(fd, &stats, sizeof(stats), 0) != sizeof(stats)) {
+        trace(TRACE_ERROR, errno, 0, path);
+    }
+    close(fd);
+    if (out != NULL) {
+        *out = stats;
+    }
+}
+
+// Copy len bytes from offset in `in` to `out`: sendfile, else read/write
+static int cache_copy(int in, off_t offset, uint64_t len, int out) {
+    static char buf[64 * 1024];
+
+    while (len > 0) {
+        ssize_t n = sendfile(out, in, &offset, len < PUMP_CHUNK ? len : PUMP_CHUNK);
+        if (n == -1 && (errno == EINVAL || errno == ENOSYS)) {
+            n = pread(in, buf, len < sizeof(buf) ? len : sizeof(buf), offset);
+            for (ssize_t done = 0; n > 0 && done < n; ) {
+                ssize_t w = write(out, buf + done, n - done);
+                if (w == -1 && errno != EINTR) {
+                    return -1;
+                }
+                done += w > 0 ? w : 0;
+            }
+            offset += n > 0 ? n : 0;
+        }
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+struct cache_entry {
+    char name[40];
+    off_t size;
+    struct timespec used;
+};
+
+static int compare_cache_entries(const void* a, const void* b) {
+    const struct cache_entry* x = a;
+    const struct cache_entry* y = b;
+    if (x->used.tv_sec != y->used.tv_sec) {
+        return x->used.tv_sec < y->used.tv_sec ? -1 : 1;
+    }
+    return (x->used.tv_nsec > y->used.tv_nsec) - (x->used.tv_nsec < y->used.tv_nsec);
+}
+
+/*
+ * List the entries (32 hex digit names) with their sizes. With a limit,
+ * delete the least recently used until the rest fit under it; a limit
+ * of 0 deletes everything. Returns the bytes left.
+ */
+static long long cache_scan(const char* dir, long long limit, size_t* count, size_t* evicted) {
+    struct cache_entry* entries = NULL;
+    size_t n = 0, capacity = 0;
+    long long total = 0;
+    DIR* d = opendir(dir);
+    struct dirent* entry;
+
+    *evicted = *count = 0;
+    if (d == NULL) {
+        return 0;
+    }
+    int fd = dirfd(d);
+    while ((entry = readdir(d)) != NULL) {
+        struct stat st;
+        if (strlen(entry->d_name) != 32 || strspn(entry->d_name, "0123456789abcdef") != 32 ||
+            fstatat(fd, entry->d_name, &st, 0) == -1) {
+            continue;
+        }
+        if (n == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            entries = realloc(entries, capacity * sizeof(*entries));
+        }
+        strcpy(entries[n].name, entry->d_name);
+        entries[n].size = st.st_size;
+        entries[n].used = st.st_mtim;
+        total += st.st_size;
+        n++;
+    }
+    if (limit >= 0 && total > limit) {
+        qsort(entries, n, sizeof(*entries), compare_cache_entries);
+        for (size_t i = 0; i < n && total > limit; i++) {
+            if (unlinkat(fd, entries[i].name, 0) == 0) {
+                total -= entries[i].size;
+                (*evicted)++;
+            }
+        }
+    }
+    closedir(d);
+    free(entries);
+    *count = n - *evicted;
+    return total;
+}
+
+// Write the captured output as the entry at path, then keep under the cap
+static void cache_store(const char* dir, const char* path, int status, int out, int err) {
+    struct cache_header header = { CACHE_MAGIC, status, 0, 0, 0 };
+    char tmp[PATH_MAX];
+    size_t count, evicted;
+
+    header.out_len = lseek(out, 0, SEEK_END);
+    header.err_len = lseek(err, 0, SEEK_END);
+    // Cut short, the template would not end in XXXXXX
+    if ((size_t)snprintf(tmp, sizeof(tmp), "%s/.new-XXXXXX", dir) >= sizeof(tmp)) {
+        trace(TRACE_ERROR, ENAMETOOLONG, 0, "cached");
+        return;
+    }
+    int fd = mkostemp(tmp, O_CLOEXEC);
+    if (fd == -1) {
+        return;
+    }
+    if (write(fd, &header, sizeof(header)) != sizeof(header) ||
+        cache_copy(out, 0, header.out_len, fd) == -1 || cache_copy(err, 0, header.err_len, fd) == -1) {
+        close(fd);
+        unlink(tmp);
+        return;
+    }
+    close(fd);
+    // rename() is atomic: another shell sees the whole entry or none
+    if (rename(tmp, path) == -1) {
+        unlink(tmp);
+        return;
+    }
+    cache_count(dir, CACHE_STORES, 1, NULL);
+    cache_scan(dir, cache_limit(), &count, &evicted);
+    if (evicted > 0) {
+        cache_count(dir, CACHE_EVICTIONS, evicted, NULL);
+    }
+}
+
+// Write a stored result to stdout and stderr; -1 if the entry is unusable
+static int cache_replay(int fd) {
+    struct cache_header header;
+    struct stat st;
+
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic)) != 0 || fstat(fd, &st) == -1 ||
+        (uint64_t)st.st_size != sizeof(header) + header.out_len + header.err_len) {
+        return -1;
+    }
+    fflush(stdout);
+    cache_copy(fd, sizeof(header), header.out_len, STDOUT_FILENO);
+    cache_copy(fd, sizeof(header) + header.out_len, header.err_len, STDERR_FILENO);
+    // The entry's mtime says when it was last used
+    futimens(fd, NULL);
+    return header.status;
+}
+
+/*
+ * Run a `cached` pipeline. A hit replays the stored stdout, then stderr,
+ * and returns the stored status without starting anything. A miss runs
+ * the pipeline with stdin from /dev/null, its stdout and stderr fanned
+ * out (start_fan_out) to the shell's and to memfds, and stores what
+ * they caught unless the pipeline was killed or stopped. Pipelines that
+ * cannot be cached just run.
+ */
+int run_cached(struct pipeline* pipeline) {
+    char dir[PATH_MAX], path[PATH_MAX + 40];
+    struct digest key;
+    long long started_ns = monotonic_ns();
+    int status;
+
+    if (cache_dir(dir, sizeof(dir)) == -1 || cache_key(pipeline, &key) == -1) {
+        return handle_pipes(pipeline, 0, NULL);
+    }
+    snprintf(path, sizeof(path), "%s/%016llx%016llx", dir, (unsigned long long)key.a, (unsigned long long)key.b);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd != -1) {
+        status = cache_replay(fd);
+        close(fd);
+        if (status != -1) {
+            trace(TRACE_CACHE, 1, status, path);
+            cache_count(dir, CACHE_HITS, 1, NULL);
+            if (pipeline->timed) {
+                report_timing(pipeline->timed, monotonic_ns() - started_ns, NULL, 0, NULL);
+            }
+            return status;
+        }
+    }
+    trace(TRACE_CACHE, 0, 0, path);
+    cache_count(dir, CACHE_MISSES, 1, NULL);
+
+    int out = memfd_create("miell-cache-out", MFD_CLOEXEC);
+    int err = memfd_create("miell-cache-err", MFD_CLOEXEC);
+    int null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    int out_targets[2] = { out, STDOUT_FILENO };
+    int err_targets[2] = { err, STDERR_FILENO };
+    int std_io[3] = { null_fd, -1, -1 };
+    if (out == -1 || err == -1 || null_fd == -1 ||
+        (std_io[1] = start_fan_out(out_targets, 2)) == -1 ||
+        (std_io[2] = start_fan_out(err_targets, 2)) == -1) {
+        perror("miell: cached");
+        status = handle_pipes(pipeline, 0, NULL);
+    } else {
+        fflush(stdout);
+        job_timed_out = 0;
+        status = handle_pipes(pipeline, 0, std_io);
+    }
+    for (int i = 0; i < 3; i++) {
+        if (std_io[i] != -1) {
+            close(std_io[i]);
+        }
+    }
+    if (status < 128) {
+        // The fan-outs see end of input now; wait for all of it to land
+        finish_substitutions(1);
+        if (std_io[2] != -1 && !job_timed_out) {
+            cache_store(dir, path, status, out, err);
+        }
+    }
+    if (out != -1) {
+        close(out);
+    }
+    if (err != -1) {
+        close(err);
+    }
+    return status;
+}
+
+// A bare `cached`: where the cache is and how it has done; -c empties it
+int cache_report(int clear) {
+    char dir[PATH_MAX];
+    struct cache_stats stats;
+    size_t count, evicted;
+
+    if (cache_dir(dir, sizeof(dir)) == -1) {
+        return 1;
+    }
+    long long bytes = cache_scan(dir, clear ? 0 : -1, &count, &evicted);
+    cache_count(dir, clear ? CACHE_RESET : CACHE_PEEK, 0, &stats);
+    if (clear) {
+        return 0;
+    }
+    uint64_t lookups = stats.counts[CACHE_HITS] + stats.counts[CACHE_MISSES];
+    printf("cache: %s\n", dir);
+    printf("entries: %zu, %lld of %lld bytes\n", count, bytes, cache_limit());
+    printf("hits: %llu, misses: %llu (%.1f%% hits), stored: %llu, evicted: %llu\n",
+           (unsigned long long)stats.counts[CACHE_HITS], (unsigned long long)stats.counts[CACHE_MISSES],
+           lookups ? 100.0 * stats.counts[CACHE_HITS] / lookups : 0.0,
+           (unsigned long long)stats.counts[CACHE_STORES], (unsigned long long)stats.counts[CACHE_EVICTIONS]);
+    return 0;
+}
+
+static long long monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static double timeval_seconds(const struct timeval* tv) {
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+// "0m1.234s", as bash prints real/user/sys
+static void print_minutes(const char* label, double seconds) {
+    int minutes = (int)(seconds / 60);
+    fprintf(stderr, "%s\t%dm%.3fs\n", label, minutes, seconds - minutes * 60);
+}
+
+static void print_json_string(const char* s) {
+    fputc('"', stderr);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            fprintf(stderr, "\\%c", *s);
+        } else if ((unsigned char)*s < 0x20) {
+            fprintf(stderr, "\\u%04x", *s);
+        } else {
+            fputc(*s, stderr);
+        }
+    }
+    fputc('"', stderr);
+}
+
+/*
+ * Print what `time` measured to stderr: totals for the pipeline, and for
+ * the plain and -j formats a breakdown per stage. A stage's wall time
+ * runs from its launch to its reaping; launch is the time the shell
+ * spent in posix_spawn (which returns once the child has exec'd) or, for
+ * a stage the shell forks itself, in fork.
+ */
+void report_timing(enum time_format format, long long real_ns, const struct stage_timing* stages,
+                   int count, const int* statuses) {
+    double user = 0, sys = 0;
+
+    fflush(stdout);
+    for (int i = 0; i < count; i++) {
+        user += timeval_seconds(&stages[i].usage.ru_utime);
+        sys += timeval_seconds(&stages[i].usage.ru_stime);
+    }
+    if (format == TIME_POSIX) {
+        fprintf(stderr, "real %.2f\nuser %.2f\nsys %.2f\n", real_ns / 1e9, user, sys);
+        return;
+    }
+    if (format == TIME_JSON) {
+        fprintf(stderr, "{\"real\":%.6f,\"user\":%.6f,\"sys\":%.6f,\"stages\":[", real_ns / 1e9, user, sys);
+        for (int i = 0; i < count; i++) {
+            const struct stage_timing* st = &stages[i];
+            const struct rusage* ru = &st->usage;
+            fprintf(stderr, "%s{\"pid\":%d,\"command\":", i ? "," : "", st->pid > 0 ? st->pid : -1);
+            print_json_string(st->name);
+            fprintf(stderr, ",\"status\":%d,\"wall\":%.6f,\"user\":%.6f,\"sys\":%.6f,"
+                    "\"maxrss_kb\":%ld,\"voluntary_csw\":%ld,\"involuntary_csw\":%ld,\"launch_us\":%.1f}",
+                    status_code(statuses[i]),
+                    st->reaped_ns ? (st->reaped_ns - st->launched_ns) / 1e9 : 0.0,
+                    timeval_seconds(&ru->ru_utime), timeval_seconds(&ru->ru_stime),
+                    ru->ru_maxrss, ru->ru_nvcsw, ru->ru_nivcsw, st->launch_ns / 1e3);
+        }
+        fputs("]}\n", stderr);
+        return;
+    }
+
+    fputc('\n', stderr);
+    print_minutes("real", real_ns / 1e9);
+    print_minutes("user", user);
+    print_minutes("sys", sys);
+    if (count == 0) {
+        return;
+    }
+    fprintf(stderr, "%-5s %7s %10s %9s %9s %10s %7s %7s %9s  %s\n", "stage", "pid", "wall", "user", "sys",
+            "maxrss", "vcsw", "ivcsw", "launch", "command");
+    for (int i = 0; i < count; i++) {
+        const struct stage_timing* st = &stages[i];
+        const struct rusage* ru = &st->usage;
+        fprintf(stderr, "%-5d %7d %9.3fs %8.3fs %8.3fs %8ldKB %7ld %7ld %7.0fus  %s\n", i,
+                st->pid > 0 ? st->pid : -1,
+                st->reaped_ns ? (st->reaped_ns - st->launched_ns) / 1e9 : 0.0,
+                timeval_seconds(&ru->ru_utime), timeval_seconds(&ru->ru_stime),
+                ru->ru_maxrss, ru->ru_nvcsw, ru->ru_nivcsw, st->launch_ns / 1e3, st->name);
+    }
+}
+
+/*
+ * `time` on a builtin that runs in the shell: the one stage is the shell
+ * itself, so its usage is the difference in the shell's own counters.
+ */
+int time_builtin(const struct builtin* builtin, struct pipeline* pipeline) {
+    struct stage_timing stage = { 0 };
+    struct rusage before, after;
+    int status;
+
+    stage.pid = getpid();
+    stage.name = builtin ? pipeline->commands[0].argv[0] : "compound";
+    getrusage(RUSAGE_SELF, &before);
+    stage.launched_ns = monotonic_ns();
+    status = execute_builtin(builtin, &pipeline->commands[0]);
+    stage.reaped_ns = monotonic_ns();
+    getrusage(RUSAGE_SELF, &after);
+
+    stage.usage = after;
+    timersub(&after.ru_utime, &before.ru_utime, &stage.usage.ru_utime);
+    timersub(&after.ru_stime, &before.ru_stime, &stage.usage.ru_stime);
+    stage.usage.ru_nvcsw -= before.ru_nvcsw;
+    stage.usage.ru_nivcsw -= before.ru_nivcsw;
+    status <<= 8;
+    report_timing(pipeline->timed, stage.reaped_ns - stage.launched_ns, &stage, 1, &status);
+    return status >> 8;
+}
+
+/*
+ * Run a pipeline as a job and, unless it is in the background, wait for
+ * exactly the stages it started. Returns the exit status of the last
+ * stage. Background jobs and foreground jobs of an interactive shell get
+ * a process group of their own so fg/bg can signal them as a unit, and
+ * so does any job with a `timeout`, which is signalled the same way.
+ * std_io, if not NULL, stands in for the shell's stdin, stdout and
+ * stderr; the caller keeps ownership of those descriptors.
+ */
+int handle_pipes(struct pipeline* pipeline, int is_background, const int* std_io) {
+    static const int shell_io[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+    int command_count = pipeline->count;
+    trace(TRACE_PIPELINE, command_count, is_background, NULL);
+    pid_t* pids = arena_alloc(&line_arena, command_count * sizeof(pid_t));
+    int* statuses = arena_alloc(&line_arena, command_count * sizeof(int));
+    pid_t pgid = (is_background || shell_interactive) ? 0 : -1;
+    long long started_ns = pipeline->timed ? monotonic_ns() : 0;
+    struct stage_timing* timing = NULL;
+    const struct builtin* builtin;
+    long long timeout_ns = 0, kill_after_ns = 0;
+    struct limits limits = { 0 };
+    int size = pipe_size();
+    int prev_read = -1;
+    int i;
+
+    if (pipeline->guard != NULL &&
+        resolve_guard(pipeline->guard, &timeout_ns, &kill_after_ns, &limits) == -1) {
+        return 125;
+    }
+    if (timeout_ns > 0) {
+        // A group of its own, so the deadline can signal every process in it
+        pgid = 0;
+    }
+    stage_limits = limits.set ? &limits : NULL;
+    if (pipeline->timed) {
+        timing = calloc(command_count, sizeof(*timing));
+    }
+    if (std_io == NULL) {
+        std_io = shell_io;
+    }
+
+    // Builtin output so far must reach the terminal before the stages'
+    fflush(stdout);
+
+    /*
+     * Each pipe is made just before the stage that writes to it, and the
+     * shell closes a stage's descriptors as soon as it is started, so it
+     * never holds more than three at a time. All of them are
+     * close-on-exec: the stages only get what io[] hands them.
+     */
+    for (i = 0; i < command_count; i++) {
+        struct command* cmd = &pipeline->commands[i];
+        int io[3] = { std_io[0], std_io[1], std_io[2] };
+        int next[2] = { -1, -1 };
+        if (i < command_count - 1) {
+            if (pipe2(next, O_CLOEXEC) == -1) {
+                perror("pipe");
+                exit(1);
+            }
+            if (size > 0 && fcntl(next[1], F_SETPIPE_SZ, size) == -1) {
+                trace(TRACE_ERROR, errno, size, "F_SETPIPE_SZ");
+            }
+            trace(TRACE_PIPE, next[0], next[1], NULL);
+            io[1] = next[1];
+        }
+        if (i > 0) {
+            io[0] = prev_read;
+        }
+        pids[i] = -1;
+        if (timing != NULL) {
+            timing[i].launched_ns = monotonic_ns();
+        }
+        if (handle_redirection(cmd->redirects, io) == -1) {
+            statuses[i] = 1;
+        } else if (cmd->body != NULL) {
+            pids[i] = spawn_compound(cmd->body, io, pgid);
+            statuses[i] = 1;
+        } else if (cmd->argc == 0) {
+            // Redirections only, e.g. "> file"
+            statuses[i] = 0;
+        } else if ((builtin = find_builtin(cmd->argv[0])) != NULL) {
+            pids[i] = spawn_builtin(builtin, cmd->argv, io, pgid);
+            statuses[i] = 1;
+        } else if ((pids[i] = spawn_pump(cmd, io, pgid)) != 0) {
+            statuses[i] = 1;
+        } else {
+            pids[i] = spawn_stage(cmd->argv, command_env(cmd), io, pgid);
+            statuses[i] = 127;
+        }
+        if (timing != NULL) {
+            timing[i].launch_ns = monotonic_ns() - timing[i].launched_ns;
+            timing[i].pid = pids[i];
+            timing[i].name = strdup(cmd->body ? "compound" : cmd->argc > 0 ? cmd->argv[0] : "");
+        }
+        if (pids[i] > 0 && pgid == 0) {
+            pgid = pids[i];
+        }
+
+        // The stage has its copies; redirections may have replaced the
+        // pipe ends in io[], so those are closed by name as well
+        for (int fd = 0; fd < 3; fd++) {
+            if (io[fd] == std_io[0] || io[fd] == std_io[1] || io[fd] == std_io[2]) {
+                io[fd] = fd;
+            }
+        }
+        close_io(io);
+        if (prev_read != -1 && prev_read != io[0] && prev_read != io[1] && prev_read != io[2]) {
+            close(prev_read);
+        }
+        if (next[1] != -1 && next[1] != io[0] && next[1] != io[1] && next[1] != io[2]) {
+            close(next[1]);
+        }
+        prev_read = next[0];
+    }
+    stage_limits = NULL;
+
+    char* text = describe_pipeline(pipeline);
+    struct job* job = add_job(text, command_count, pids, pgid, is_background);
+    free(text);
+    for (i = 0; i < command_count; i++) {
+        if (pids[i] <= 0) {
+            job->statuses[i] = statuses[i] << 8;
+        }
+    }
+    job->timed = pipeline->timed;
+    job->started_ns = started_ns;
+    job->timing = timing;
+    if (timeout_ns > 0 && job->live > 0) {
+        watch_deadline(job, timeout_ns, kill_after_ns);
+    }
+    if (is_background) {
+        if (shell_interactive) {
+            printf("[%d] %d\n", job->id, pids[command_count - 1]);
+        }
+        trace(TRACE_JOB, job->id, job->pgid, job->command);
+        return 0;
+    }
+    return wait_for_job(job, 1);
+}
 
-    debug_log("Shell started\n");
+/*
+ * A descriptor to read text (plus suffix) from, for << and <<<. Text
+ * that fits in a pipe is written straight into one, so no process has
+ * to feed it; anything bigger goes into an anonymous memfd. Neither
+ * touches the filesystem.
+ */
+static int heredoc_fd(const char* text, size_t len, const char* suffix) {
+    size_t suffix_len = strlen(suffix);
+    size_t total = len + suffix_len;
+    int fds[2];
 
-    while (1) {
-        display_prompt();
+    if (pipe2(fds, O_CLOEXEC) == -1) {
+        return -1;
+    }
+    // A pipe holds at least one page, and usually 64 KiB
+    if (total <= 4096 || (long)total <= fcntl(fds[1], F_GETPIPE_SZ)) {
+        if (write(fds[1], text, len) != (ssize_t)len || write(fds[1], suffix, suffix_len) != (ssize_t)suffix_len) {
+            close(fds[0]);
+            fds[0] = -1;
+        }
+        close(fds[1]);
+        return fds[0];
+    }
+    close(fds[0]);
+    close(fds[1]);
 
-        if (fgets(input, sizeof(input), stdin) == NULL) {
-            break;
+    int fd = memfd_create("miell-heredoc", MFD_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    for (size_t done = 0; done < total; ) {
+        const char* from = done < len ? text + done : suffix + (done - len);
+        size_t chunk = done < len ? len - done : total - done;
+        ssize_t n = write(fd, from, chunk);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            close(fd);
+            return -1;
         }
+        done += n;
+    }
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+// Close fd unless io[] or initial[] (the caller's) still refers to it
+static void close_unless_used(int fd, const int* io, const int* initial) {
+    if (fd > STDERR_FILENO && fd != initial[0] && fd != initial[1] && fd != initial[2] &&
+        fd != io[0] && fd != io[1] && fd != io[2]) {
+        close(fd);
+    }
+}
 
-        input[strcspn(input, "\n")] = 0;  // Remove trailing newline
-        debug_log("Received input: %s\n", input);
+/*
+ * Apply a stage's redirections, left to right, to its descriptor table
+ * io[0..2]. Returns -1 (after reporting why) if one cannot be set up.
+ * Whatever is in io[] afterwards, success or not, is the caller's to
+ * close; a file opened here and then replaced by a dup or an input is
+ * closed here. Several > or >> files in a row for one descriptor all
+ * get the output, through start_fan_out().
+ */
+int handle_redirection(struct redirect* redirects, int* io) {
+    int initial[3] = { io[0], io[1], io[2] };
+    int file_out[3] = { -1, -1, -1 };   // io[fd] is a > or >> file opened here
+    int* fan[3] = { NULL, NULL, NULL };     // earlier files for the same fd
+    int fan_count[3] = { 0, 0, 0 };
+    int status = 0;
 
-        if (strcmp(input, "exit") == 0) {
-            debug_log("Exit command received\n");
+    for (struct redirect* r = redirects; r != NULL && status == 0; r = r->next) {
+        const char* target = expand_word(&r->target);
+        int fd;
+
+        if (r->fd > STDERR_FILENO) {
+            fprintf(stderr, "miell: %d: redirection of this descriptor is not supported\n", r->fd);
+            status = -1;
+            break;
+        }
+        switch (r->type) {
+        case REDIR_IN:
+            fd = open(target, O_RDONLY | O_CLOEXEC);
+            break;
+        case REDIR_OUT:
+            fd = open(target, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            break;
+        case REDIR_APPEND:
+            fd = open(target, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            break;
+        case REDIR_DUP:
+            if (target[0] < '0' || target[0] > '2' || target[1] != '\0') {
+                fprintf(stderr, "miell: %s: bad file descriptor\n", target);
+                status = -1;
+                continue;
+            }
+            fd = io[target[0] - '0'];
+            break;
+        case REDIR_HEREDOC:
+            target = expand_word(&r->body);
+            fd = heredoc_fd(target, strlen(target), "");
+            target = "<<";
+            break;
+        case REDIR_HERESTRING:
+            fd = heredoc_fd(target, strlen(target), "\n");
+            target = "<<<";
+            break;
+        default:
+            errno = EINVAL;
+            fd = -1;
             break;
         }
+        if (fd == -1) {
+            fprintf(stderr, "miell: %s: %s\n", target, strerror(errno));
+            status = -1;
+            continue;
+        }
+        if (r->type != REDIR_DUP) {
+            trace(TRACE_REDIRECT, r->fd, fd, target);
+        }
+        int old = io[r->fd];
+        int to_file = r->type == REDIR_OUT || r->type == REDIR_APPEND;
+        io[r->fd] = fd;
+        if (to_file && old == file_out[r->fd]) {
+            fan[r->fd] = realloc(fan[r->fd], (fan_count[r->fd] + 1) * sizeof(int));
+            fan[r->fd][fan_count[r->fd]++] = old;
+        } else {
+            close_unless_used(old, io, initial);
+            for (int i = 0; i < fan_count[r->fd]; i++) {
+                close_unless_used(fan[r->fd][i], io, initial);
+            }
+            fan_count[r->fd] = 0;
+        }
+        file_out[r->fd] = to_file ? fd : -1;
+    }
 
-        // Handle background commands
-        if (strchr(input, '&') != NULL) {
-            execute_background_commands(input);
+    for (int slot = 0; slot < 3; slot++) {
+        if (fan_count[slot] == 0) {
             continue;
         }
+        int last = io[slot];
+        int* targets = fan[slot];
+        int count = fan_count[slot];
+        targets = realloc(targets, (count + 1) * sizeof(int));
+        targets[count++] = last;
+        fan[slot] = targets;
+        fan_count[slot] = 0;
 
-        // Split input into commands (for pipes)
-        commands = malloc(MAX_PIPE_COUNT * sizeof(char**));
-        command_count = 0;
-        char* saveptr;
-        char* command = strtok_r(input, "|", &saveptr);
-        while (command != NULL && command_count < MAX_PIPE_COUNT) {
-            commands[command_count] = parse_input(command, NULL);
-            debug_log("Parsed command %d: %s\n", command_count, command);
-            command_count++;
-            command = strtok_r(NULL, "|", &saveptr);
+        int fd = status == 0 ? start_fan_out(targets, count) : -1;
+        if (status == 0 && fd == -1) {
+            fprintf(stderr, "miell: %s\n", strerror(errno));
+            status = -1;
+        }
+        // "2>&1" after the files copied the last one: it fans out too
+        for (int i = 0; i < 3; i++) {
+            if (io[i] == last && fd != -1) {
+                io[i] = fd;
+            }
+        }
+        // The fan-out has its own copies; io[] may still hold the earlier ones
+        for (int i = 0; i < count; i++) {
+            close_unless_used(targets[i], io, initial);
+        }
+    }
+    for (int slot = 0; slot < 3; slot++) {
+        for (int i = 0; i < fan_count[slot]; i++) {
+            close_unless_used(fan[slot][i], io, initial);
         }
-        debug_log("Total commands: %d\n", command_count);
+        free(fan[slot]);
+    }
+    return status;
+}
+
+void* arena_alloc(struct arena* arena, size_t size) {
+    struct arena_chunk* chunk = arena->current;
+
+    size = (size + 15) & ~(size_t)15;
+    arena->allocs++;
+    arena->bytes += size;
 
-        // Handle built-in commands
-        if (command_count == 1 && execute_builtin(commands[0])) {
-            debug_log("Executed built-in command\n");
-            free_commands(commands, command_count);
+    // Move on to the next retained chunk, or add one, until it fits
+    while (chunk == NULL || chunk->used + size > chunk->size) {
+        if (chunk != NULL && chunk->next != NULL) {
+            chunk = chunk->next;
+            chunk->used = 0;
             continue;
         }
+        size_t chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        struct arena_chunk* fresh = malloc(sizeof(*fresh) + chunk_size);
+        if (fresh == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        fresh->next = NULL;
+        fresh->size = chunk_size;
+        fresh->used = 0;
+        if (chunk == NULL) {
+            arena->first = fresh;
+        } else {
+            chunk->next = fresh;
+        }
+        arena->chunk_mallocs++;
+        chunk = fresh;
+    }
+    arena->current = chunk;
+
+    void* ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    return ptr;
+}
+
+char* arena_strdup(struct arena* arena, const char* str) {
+    size_t len = strlen(str) + 1;
+    return memcpy(arena_alloc(arena, len), str, len);
+}
+
+void arena_reset(struct arena* arena) {
+    arena->current = arena->first;
+    if (arena->first != NULL) {
+        arena->first->used = 0;
+    }
+    arena->allocs = 0;
+    arena->bytes = 0;
+    arena->chunk_mallocs = 0;
+}
+
+struct arena_mark arena_mark(struct arena* arena) {
+    struct arena_mark mark = { arena->current, arena->current ? arena->current->used : 0 };
+    return mark;
+}
+
+// Free everything allocated since mark; the chunks are kept for reuse
+void arena_release(struct arena* arena, struct arena_mark mark) {
+    if (mark.chunk == NULL) {
+        arena_reset(arena);
+        return;
+    }
+    arena->current = mark.chunk;
+    mark.chunk->used = mark.used;
+}
+
+static void source_release(struct source* source) {
+    if (source != NULL && --source->refs == 0) {
+        for (struct arena_chunk* chunk = source->chunks, *next; chunk != NULL; chunk = next) {
+            next = chunk->next;
+            free(chunk);
+        }
+        free(source);
+    }
+}
+
+// Take the chunks of a line that defines functions away from the arena
+static struct source* arena_detach(struct arena* arena) {
+    struct source* source = malloc(sizeof(*source));
+
+    source->chunks = arena->first;
+    source->refs = 1;
+    arena->first = NULL;
+    arena->current = NULL;
+    return source;
+}
 
-        // Handle pipes and execution
-        handle_pipes(commands, command_count, 0);
+/*
+ * Children are reaped from an event loop instead of by blocking calls:
+ * SIGCHLD stays blocked and is read from a signalfd that sits in an
+ * epoll set next to stdin, so finished background jobs are collected
+ * (and announced) while the shell waits at the prompt.
+ */
+void init_job_control(void) {
+    shell_interactive = serve_path == NULL && isatty(STDIN_FILENO);
+    if (shell_interactive) {
+        // Wait until we are in the foreground, then take the terminal
+        while (tcgetpgrp(STDIN_FILENO) != (shell_pgid = getpgrp())) {
+            kill(-shell_pgid, SIGTTIN);
+        }
+        signal(SIGINT, SIG_IGN);
+        signal(SIGQUIT, SIG_IGN);
+        signal(SIGTSTP, SIG_IGN);
+        signal(SIGTTIN, SIG_IGN);
+        signal(SIGTTOU, SIG_IGN);
+        shell_pgid = getpid();
+        setpgid(shell_pgid, shell_pgid);
+        tcsetpgrp(STDIN_FILENO, shell_pgid);
+    }
+    if (init_events() == -1) {
+        perror("signalfd");
+        exit(1);
+    }
+}
 
-        // Free allocated memory
-        free_commands(commands, command_count);
+/*
+ * Block SIGCHLD and make signal_fd and event_fd. Copies of the shell
+ * made by fork_stage() start without them, and call this if they come
+ * to need the event loop (for a `timeout`).
+ */
+static int init_events(void) {
+    struct epoll_event ev = { .events = EPOLLIN };
+    sigset_t mask;
 
-        // Wait for a short time to allow output to be displayed
-        usleep(10000);  // Wait for 10ms
+    if (signal_fd == -1) {
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGCHLD);
+        sigprocmask(SIG_BLOCK, &mask, NULL);
+        signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    }
+    event_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (signal_fd == -1 || event_fd == -1) {
+        return -1;
     }
+    ev.data.fd = signal_fd;
+    epoll_ctl(event_fd, EPOLL_CTL_ADD, signal_fd, &ev);
+    if (shell_interactive) {
+        ev.data.fd = STDIN_FILENO;
+        epoll_ctl(event_fd, EPOLL_CTL_ADD, STDIN_FILENO, &ev);
+    }
+    return 0;
+}
+
+/*
+ * Arm the deadline of a `timeout` job: a timerfd in deadline_fd, an epoll
+ * set next to signal_fd. deadline_fd is itself in event_fd, so deadlines
+ * pass while the shell waits at the prompt too; a foreground job is
+ * waited for on deadline_fd alone, which leaves typed-ahead input be.
+ */
+static int watch_deadline(struct job* job, long long timeout_ns, long long kill_after_ns) {
+    struct epoll_event ev = { .events = EPOLLIN };
+    struct itimerspec when = { { 0, 0 }, { timeout_ns / 1000000000, timeout_ns % 1000000000 } };
 
-    debug_log("Shell exiting\n");
+    if (deadline_fd == -1 && (event_fd != -1 || init_events() == 0) &&
+        (deadline_fd = epoll_create1(EPOLL_CLOEXEC)) != -1) {
+        ev.data.fd = signal_fd;
+        epoll_ctl(deadline_fd, EPOLL_CTL_ADD, signal_fd, &ev);
+        ev.data.fd = deadline_fd;
+        epoll_ctl(event_fd, EPOLL_CTL_ADD, deadline_fd, &ev);
+    }
+    if (deadline_fd == -1 || (job->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1) {
+        perror("miell: timeout");
+        return -1;
+    }
+    timerfd_settime(job->timer_fd, 0, &when, NULL);
+    ev.data.fd = job->timer_fd;
+    epoll_ctl(deadline_fd, EPOLL_CTL_ADD, job->timer_fd, &ev);
+    job->kill_after_ns = kill_after_ns;
+    deadline_count++;
     return 0;
 }
 
-void display_prompt(void) {
-    printf("\nmiell> ");
-    fflush(stdout);
+// A job's deadline passed: SIGTERM to its process group, and SIGKILL
+// kill_after_ns later if it is still there
+static void expire_deadline(int timer_fd) {
+    struct job* job = NULL;
+    uint64_t ticks;
+
+    for (int i = 0; i < job_count && job == NULL; i++) {
+        job = jobs[i]->timer_fd == timer_fd ? jobs[i] : NULL;
+    }
+    if (job == NULL || read(timer_fd, &ticks, sizeof(ticks)) != sizeof(ticks) || job->pgid <= 0) {
+        return;
+    }
+    int sig = job->expired++ ? SIGKILL : SIGTERM;
+    trace(TRACE_TIMEOUT, job->pgid, sig, job->command);
+    kill(-job->pgid, sig);
+    if (sig == SIGTERM) {
+        // A stopped stage only sees SIGTERM once it runs
+        kill(-job->pgid, SIGCONT);
+        if (job->kill_after_ns > 0) {
+            struct itimerspec when = { { 0, 0 }, { job->kill_after_ns / 1000000000, job->kill_after_ns % 1000000000 } };
+            timerfd_settime(timer_fd, 0, &when, NULL);
+        }
+    }
+}
+
+// Wait up to timeout_ms (-1: as long as it takes) for a deadline or a
+// child, and act on the deadlines that passed. Callers reap.
+static int run_deadlines(int timeout_ms) {
+    struct epoll_event events[16];
+    int n = epoll_wait(deadline_fd, events, 16, timeout_ms);
+
+    if (n == -1) {
+        return errno == EINTR ? 0 : -1;
+    }
+    for (int i = 0; i < n; i++) {
+        if (events[i].data.fd != signal_fd) {
+            expire_deadline(events[i].data.fd);
+        }
+    }
+    return n;
 }
 
-void execute_background_commands(char* input) {
-    char* saveptr;
-    char* token = strtok_r(input, "&", &saveptr);
-    int job_number = 1;
-
-    while (token != NULL) {
-        // Trim leading and trailing whitespace
-        while (*token == ' ' || *token == '\t') token++;
-        char* end = token + strlen(token) - 1;
-        while (end > token && (*end == ' ' || *end == '\t')) end--;
-        *(end + 1) = '\0';
-
-        if (strlen(token) > 0) {
-            // Parse the command into pipes
-            char*** commands = malloc(MAX_PIPE_COUNT * sizeof(char**));
-            int command_count = 0;
-            char* pipe_saveptr;
-            char* pipe_token = strtok_r(token, "|", &pipe_saveptr);
-            while (pipe_token != NULL && command_count < MAX_PIPE_COUNT) {
-                commands[command_count] = parse_input(pipe_token, NULL);
-                command_count++;
-                pipe_token = strtok_r(NULL, "|", &pipe_saveptr);
-            }
-
-            pid_t pid = fork();
-            if (pid == 0) {
-                // Child process
-                handle_pipes(commands, command_count, 1);
-                exit(0);
-            } else if (pid > 0) {
-                // Parent process
-                printf("[%d] %d\n", job_number++, pid);
-                debug_log("Started background job %d (PID: %d): %s\n", job_number - 1, pid, token);
+/*
+ * Block until a line can be read. Job completions that arrive in the
+ * meantime are reaped and reported straight away. Returns 0 on error.
+ */
+int wait_for_input(struct line_reader* reader) {
+    struct epoll_event events[2];
+
+    if (!shell_interactive || reader_has_line(reader)) {
+        return 1;
+    }
+    while (1) {
+        int n = epoll_wait(event_fd, events, 2, -1);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            return 0;
+        }
+        int have_input = 0;
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.fd == signal_fd) {
+                reap_children();
+            } else if (events[i].data.fd == deadline_fd) {
+                run_deadlines(0);
+                reap_children();
             } else {
-                perror("fork");
+                have_input = 1;
             }
+        }
+        if (have_input) {
+            notify_jobs();
+            return 1;
+        }
+        for (int i = 0; i < job_count; i++) {
+            if (jobs[i]->state == JOB_DONE || (jobs[i]->state == JOB_STOPPED && !jobs[i]->notified)) {
+                printf("\n");
+                notify_jobs();
+                display_prompt();
+                break;
+            }
+        }
+    }
+}
+
+static struct job* find_job_by_pid(pid_t pid, int* stage) {
+    for (int i = 0; i < job_count; i++) {
+        for (int j = 0; j < jobs[i]->count; j++) {
+            if (jobs[i]->pids[j] == pid) {
+                *stage = j;
+                return jobs[i];
+            }
+        }
+    }
+    return NULL;
+}
 
-            // Free allocated memory
-            free_commands(commands, command_count);
+static void mark_stage_done(struct job* job, int stage, int status, const struct rusage* usage) {
+    if (job->timing != NULL) {
+        job->timing[stage].reaped_ns = monotonic_ns();
+        if (usage != NULL) {
+            job->timing[stage].usage = *usage;
         }
+    }
+    job->pids[stage] = -1;
+    job->statuses[stage] = status;
+    if (--job->live == 0) {
+        job->state = JOB_DONE;
+    }
+}
 
-        token = strtok_r(NULL, "&", &saveptr);
+static void stage_changed(struct job* job, int stage, int status, const struct rusage* usage) {
+    if (WIFSTOPPED(status)) {
+        job->state = JOB_STOPPED;
+    } else if (WIFCONTINUED(status)) {
+        job->state = JOB_RUNNING;
+        job->notified = 0;
+    } else {
+        trace(TRACE_REAP, job->pids[stage], status, NULL);
+        mark_stage_done(job, stage, status, usage);
     }
 }
 
-char** parse_input(char* input, int* arg_count) {
-    char** args = malloc(MAX_ARG_COUNT * sizeof(char*));
-    int count = 0;
-    char* token;
-    char* saveptr;
+static void drain_signals(void) {
+    struct signalfd_siginfo info;
 
-    token = strtok_r(input, " \t", &saveptr);
-    while (token != NULL && count < MAX_ARG_COUNT - 1) {
-        args[count] = strdup(token);
-        count++;
-        token = strtok_r(NULL, " \t", &saveptr);
+    while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+        // Signals coalesce, so the count is meaningless; drain and poll
     }
-    args[count] = NULL;
-    if (arg_count) {
-        *arg_count = count;
+}
+
+// Collect every child that has changed state, without blocking
+void reap_children(void) {
+    struct rusage usage;
+    pid_t pid;
+    int status;
+
+    if (signal_fd == -1) {
+        return;
+    }
+    drain_signals();
+    while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage)) > 0) {
+        int stage;
+        struct job* job = find_job_by_pid(pid, &stage);
+        if (job != NULL) {
+            stage_changed(job, stage, status, &usage);
+        }
     }
-    debug_log("Parsed %d arguments\n", count);
+}
 
-    // Expand wildcards
-    args = expand_wildcards(args, &count);
-    if (arg_count) {
-        *arg_count = count;
+// reap_children() for the stages of jobs only: process substitutions and
+// fan-outs are left for finish_substitutions() to wait for
+static void reap_jobs(void) {
+    struct rusage usage;
+    int status;
+
+    drain_signals();
+    for (int i = 0; i < job_count; i++) {
+        for (int j = 0; j < jobs[i]->count; j++) {
+            if (jobs[i]->pids[j] > 0 &&
+                wait4(jobs[i]->pids[j], &status, WNOHANG | WUNTRACED | WCONTINUED, &usage) > 0) {
+                stage_changed(jobs[i], j, status, &usage);
+            }
+        }
     }
-    debug_log("After wildcard expansion: %d arguments\n", count);
+}
 
-    return args;
+static int status_code(int status) {
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
 }
 
-char** expand_wildcards(char** args, int* arg_count) {
-    char** new_args = malloc(MAX_ARG_COUNT * sizeof(char*));
-    int new_count = 0;
-    glob_t glob_result;
+static char job_marker(struct job* job) {
+    if (job_count > 0 && jobs[job_count - 1] == job) {
+        return '+';
+    }
+    if (job_count > 1 && jobs[job_count - 2] == job) {
+        return '-';
+    }
+    return ' ';
+}
 
-    for (int i = 0; i < *arg_count; i++) {
-        if (strchr(args[i], '*') || strchr(args[i], '?')) {
-            // Perform wildcard expansion
-            int glob_flags = GLOB_NOCHECK | GLOB_TILDE;
-            if (glob(args[i], glob_flags, NULL, &glob_result) == 0) {
-                for (size_t j = 0; j < glob_result.gl_pathc && new_count < MAX_ARG_COUNT - 1; j++) {
-                    new_args[new_count] = strdup(glob_result.gl_pathv[j]);
-                    new_count++;
-                }
-                globfree(&glob_result);
+// Report finished and newly stopped background jobs, dropping the former.
+// Scripts drop finished jobs silently.
+void notify_jobs(void) {
+    for (int i = 0; i < job_count; i++) {
+        struct job* job = jobs[i];
+        if (job->foreground) {
+            continue;
+        }
+        if (job->state == JOB_DONE && !shell_interactive) {
+            remove_job(job);
+            i--;
+        } else if (job->state == JOB_DONE) {
+            int code = status_code(job->statuses[job->count - 1]);
+            if (job->expired) {
+                printf("[%d]%c  Timed out               %s\n", job->id, job_marker(job), job->command);
+            } else if (code == 0) {
+                printf("[%d]%c  Done                    %s\n", job->id, job_marker(job), job->command);
+            } else {
+                printf("[%d]%c  Exit %-3d                %s\n", job->id, job_marker(job), code, job->command);
             }
-        } else {
-            // No wildcard, just copy the argument
-            new_args[new_count] = strdup(args[i]);
-            new_count++;
+            remove_job(job);
+            i--;
+        } else if (job->state == JOB_STOPPED && !job->notified) {
+            printf("[%d]%c  Stopped                 %s\n", job->id, job_marker(job), job->command);
+            job->notified = 1;
         }
     }
+    fflush(stdout);
+}
 
-    new_args[new_count] = NULL;
-    *arg_count = new_count;
+struct job* add_job(const char* command, int command_count, const pid_t* pids, pid_t pgid, int is_background) {
+    struct job* job = calloc(1, sizeof(*job));
 
-    // Free the old args
-    for (int i = 0; args[i] != NULL; i++) {
-        free(args[i]);
+    // Job numbers grow from the highest one in use, as in other shells
+    job->id = 1;
+    for (int i = 0; i < job_count; i++) {
+        if (!jobs[i]->foreground && jobs[i]->id >= job->id) {
+            job->id = jobs[i]->id + 1;
+        }
+    }
+    job->pgid = pgid;
+    job->count = command_count;
+    job->foreground = !is_background;
+    job->timer_fd = -1;
+    job->state = JOB_RUNNING;
+    job->pids = malloc(command_count * sizeof(pid_t));
+    job->statuses = malloc(command_count * sizeof(int));
+    for (int i = 0; i < command_count; i++) {
+        job->pids[i] = pids[i];
+        // A stage that never started counts as "command not found"
+        job->statuses[i] = 127 << 8;
+        if (pids[i] > 0) {
+            job->live++;
+        }
+    }
+    if (job->live == 0) {
+        job->state = JOB_DONE;
     }
-    free(args);
 
-    return new_args;
+    job->command = strdup(command);
+
+    if (job_count == job_capacity) {
+        job_capacity = job_capacity ? job_capacity * 2 : 16;
+        jobs = realloc(jobs, job_capacity * sizeof(struct job*));
+    }
+    jobs[job_count++] = job;
+    return job;
 }
 
-int execute_builtin(char** args) {
-    if (strcmp(args[0], "cd") == 0) {
-        if (args[1] == NULL) {
-            fprintf(stderr, "cd: missing argument\n");
-            debug_log("cd: missing argument\n");
-        } else if (chdir(args[1]) != 0) {
-            perror("cd");
-            debug_log("cd failed: %s\n", strerror(errno));
-        } else {
-            debug_log("Changed directory to %s\n", args[1]);
+void remove_job(struct job* job) {
+    for (int i = 0; i < job_count; i++) {
+        if (jobs[i] == job) {
+            memmove(&jobs[i], &jobs[i + 1], (job_count - i - 1) * sizeof(struct job*));
+            job_count--;
+            break;
         }
-        return 1;
     }
-    return 0;
+    if (job->timing != NULL) {
+        for (int i = 0; i < job->count; i++) {
+            free(job->timing[i].name);
+        }
+        free(job->timing);
+    }
+    if (job->timer_fd != -1) {
+        close(job->timer_fd);
+        deadline_count--;
+    }
+    free(job->pids);
+    free(job->statuses);
+    free(job->command);
+    free(job);
 }
 
-void execute_command(char** args, int input_fd, int output_fd, int is_background) {
-    debug_log("Executing command: %s (background: %d)\n", args[0], is_background);
-    pid_t pid = fork();
+/*
+ * Wait for the remaining stages of a job by PID. A foreground job gets
+ * the terminal while it runs; if it is stopped it stays in the table as
+ * a background job. Returns the exit status of the last stage.
+ */
+int wait_for_job(struct job* job, int foreground) {
+    int give_terminal = foreground && shell_interactive && job->pgid > 0;
 
-    if (pid == 0) {  // Child process
-        debug_log("Child process started (PID: %d)\n", getpid());
-        if (input_fd != STDIN_FILENO) {
-            dup2(input_fd, STDIN_FILENO);
-            close(input_fd);
-            debug_log("Redirected input (fd: %d)\n", input_fd);
-        }
-        if (output_fd != STDOUT_FILENO) {
-            dup2(output_fd, STDOUT_FILENO);
-            close(output_fd);
-            debug_log("Redirected output (fd: %d)\n", output_fd);
-        }
-        
-        // Remove redirection to /dev/null for background processes
-        /*
-        if (is_background) {
-            int devnull = open("/dev/null", O_RDONLY);
-            if (devnull == -1) {
-                perror("open");
-                debug_log("Failed to open /dev/null: %s\n", strerror(errno));
-                exit(1);
+    if (give_terminal) {
+        tcsetpgrp(STDIN_FILENO, job->pgid);
+    }
+    // With deadlines pending, this job or another may have to be stopped
+    // while we wait, so wait on the event loop instead of in wait4()
+    while (deadline_count > 0 && job->state == JOB_RUNNING) {
+        reap_jobs();
+        if (job->state == JOB_RUNNING && run_deadlines(-1) == -1) {
+            perror("epoll_wait");
+            break;
+        }
+    }
+    for (int i = 0; i < job->count && job->state != JOB_DONE && deadline_count == 0; i++) {
+        struct rusage usage;
+        int status;
+        if (job->pids[i] <= 0) {
+            continue;
+        }
+        if (wait4(job->pids[i], &status, foreground ? WUNTRACED : 0, &usage) == -1) {
+            if (errno == EINTR) {
+                i--;
+                continue;
             }
-            dup2(devnull, STDIN_FILENO);
-            close(devnull);
-            debug_log("Redirected background process input to /dev/null\n");
+            // Already collected elsewhere; nothing left to wait for
+            mark_stage_done(job, i, 0, NULL);
+            continue;
+        }
+        if (WIFSTOPPED(status)) {
+            job->state = JOB_STOPPED;
+            break;
         }
-        */
+        trace(TRACE_REAP, job->pids[i], status, NULL);
+        mark_stage_done(job, i, status, &usage);
+    }
+    if (give_terminal) {
+        tcsetpgrp(STDIN_FILENO, shell_pgid);
+    }
 
-        execvp(args[0], args);
-        fprintf(stderr, "Error: command not found: %s\n", args[0]);
-        debug_log("execvp failed: %s\n", strerror(errno));
-        exit(1);
-    } else if (pid > 0) {  // Parent process
-        debug_log("Parent process: child PID is %d\n", pid);
-        if (is_background) {
-            printf("[1] %d\n", pid);
-            debug_log("Background process started (PID: %d)\n", pid);
-        } else {
-            int status;
-            waitpid(pid, &status, 0);
-            debug_log("Waited for child process (PID: %d, Status: %d)\n", pid, status);
+    if (job->state == JOB_STOPPED) {
+        if (job->foreground) {
+            job->foreground = 0;
+            job->id = 0;
+            for (int i = 0; i < job_count; i++) {
+                if (jobs[i] != job && !jobs[i]->foreground && jobs[i]->id > job->id) {
+                    job->id = jobs[i]->id;
+                }
+            }
+            job->id++;
         }
-    } else {
-        perror("fork");
-        debug_log("Fork failed: %s\n", strerror(errno));
-        exit(1);
+        printf("\n[%d]%c  Stopped                 %s\n", job->id, job_marker(job), job->command);
+        job->notified = 1;
+        return 128 + SIGTSTP;
+    }
+
+    int code = job->expired ? TIMEOUT_STATUS : status_code(job->statuses[job->count - 1]);
+    job_timed_out = job->expired;
+    if (job->timing != NULL) {
+        report_timing(job->timed, monotonic_ns() - job->started_ns, job->timing, job->count, job->statuses);
     }
+    remove_job(job);
+    return code;
 }
 
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wunused-but-set-variable"
-void handle_pipes(char*** commands, int command_count, int is_background) {
-    debug_log("Handling pipes (command_count: %d, background: %d)\n", command_count, is_background);
-    int pipes[MAX_PIPE_COUNT-1][2];
-    int i;
-    pid_t last_pid = 0;
+// Resolve "%N", "N" or nothing (the current job) to a background job
+static struct job* find_job(const char* spec, const char* builtin) {
+    if (spec == NULL || strcmp(spec, "%+") == 0 || strcmp(spec, "%%") == 0) {
+        for (int i = job_count - 1; i >= 0; i--) {
+            if (!jobs[i]->foreground) {
+                return jobs[i];
+            }
+        }
+        fprintf(stderr, "%s: no current job\n", builtin);
+        return NULL;
+    }
+    int id = atoi(spec[0] == '%' ? spec + 1 : spec);
+    for (int i = 0; i < job_count; i++) {
+        if (!jobs[i]->foreground && jobs[i]->id == id) {
+            return jobs[i];
+        }
+    }
+    fprintf(stderr, "%s: %s: no such job\n", builtin, spec);
+    return NULL;
+}
 
-    for (i = 0; i < command_count - 1; i++) {
-        if (pipe(pipes[i]) == -1) {
-            perror("pipe");
-            debug_log("Pipe creation failed: %s\n", strerror(errno));
-            exit(1);
+int builtin_jobs(char** args) {
+    int show_pids = args[1] != NULL && strcmp(args[1], "-l") == 0;
+
+    reap_children();
+    for (int i = 0; i < job_count; i++) {
+        struct job* job = jobs[i];
+        const char* state = job->state == JOB_RUNNING ? "Running" :
+                            job->state == JOB_STOPPED ? "Stopped" :
+                            job->expired ? "Timed out" : "Done";
+        if (job->foreground) {
+            continue;
+        }
+        printf("[%d]%c  ", job->id, job_marker(job));
+        if (show_pids) {
+            printf("%d ", job->pgid > 0 ? job->pgid : job->pids[0]);
         }
-        debug_log("Created pipe %d: read_fd=%d, write_fd=%d\n", i, pipes[i][0], pipes[i][1]);
+        printf("%-22s  %s%s\n", state, job->command, job->state == JOB_RUNNING ? " &" : "");
     }
+    notify_jobs();
+    return 0;
+}
 
-    for (i = 0; i < command_count; i++) {
-        int input_fd = (i == 0) ? STDIN_FILENO : pipes[i-1][0];
-        int output_fd = (i == command_count-1) ? STDOUT_FILENO : pipes[i][1];
+int builtin_fg_bg(char** args, int foreground) {
+    struct job* job = find_job(args[1], args[0]);
 
-        int arg_count;
-        for (arg_count = 0; commands[i][arg_count] != NULL; arg_count++);
-        debug_log("Command %d has %d arguments\n", i, arg_count);
-        
-        handle_redirection(commands[i], &arg_count, &input_fd, &output_fd);
+    if (job == NULL) {
+        return 1;
+    }
+    if (job->state == JOB_DONE) {
+        notify_jobs();
+        return 0;
+    }
+    if (foreground) {
+        printf("%s\n", job->command);
+    } else {
+        printf("[%d]%c %s &\n", job->id, job_marker(job), job->command);
+    }
+    fflush(stdout);
 
-        pid_t pid = fork();
-        if (pid == 0) {  // Child process
-            // Close all unused pipe ends
-            for (int j = 0; j < command_count - 1; j++) {
-                if (j != i - 1) close(pipes[j][0]);
-                if (j != i) close(pipes[j][1]);
+    if (job->state == JOB_STOPPED) {
+        if (job->pgid > 0) {
+            kill(-job->pgid, SIGCONT);
+        } else {
+            for (int i = 0; i < job->count; i++) {
+                if (job->pids[i] > 0) {
+                    kill(job->pids[i], SIGCONT);
+                }
             }
+        }
+        job->state = JOB_RUNNING;
+        job->notified = 0;
+    }
+    if (foreground) {
+        // Keeps its number; wait_for_job() removes it when it finishes
+        job->foreground = 1;
+        return wait_for_job(job, 1);
+    }
+    return 0;
+}
 
-            if (input_fd != STDIN_FILENO) {
-                dup2(input_fd, STDIN_FILENO);
-                close(input_fd);
-            }
-            if (output_fd != STDOUT_FILENO) {
-                dup2(output_fd, STDOUT_FILENO);
-                close(output_fd);
-            }
+int builtin_wait(char** args) {
+    int code = 0;
 
-            execvp(commands[i][0], commands[i]);
-            fprintf(stderr, "Error: command not found: %s\n", commands[i][0]);
-            exit(1);
-        } else if (pid > 0) {  // Parent process
-            debug_log("Started process for command %d (PID: %d)\n", i, pid);
-            if (i == command_count - 1) {
-                last_pid = pid;
+    if (args[1] == NULL) {
+        for (int i = 0; i < job_count; i++) {
+            if (!jobs[i]->foreground) {
+                code = wait_for_job(jobs[i], 0);
+                i = -1;  // the table shrank; start over
             }
+        }
+        return code;
+    }
+    for (int i = 1; args[i] != NULL; i++) {
+        struct job* job = NULL;
+        if (args[i][0] == '%') {
+            job = find_job(args[i], "wait");
         } else {
-            perror("fork");
-            exit(1);
+            int stage;
+            job = find_job_by_pid((pid_t)atoi(args[i]), &stage);
+            if (job == NULL) {
+                fprintf(stderr, "wait: pid %s is not a child of this shell\n", args[i]);
+            }
         }
+        code = job ? wait_for_job(job, 0) : 127;
+    }
+    return code;
+}
+
+/*
+ * Record an event if tracing is on. This is the only cost on the hot
+ * path: a flag test when off, and a clock read plus a few stores when on.
+ */
+void trace(enum trace_type type, long a, long b, const char* text) {
+    if (!trace_enabled) {
+        return;
     }
+    uint64_t index = __atomic_fetch_add(&trace_ring->head, 1, __ATOMIC_RELAXED);
+    struct trace_event* ev = &trace_ring->events[index & (TRACE_EVENTS - 1)];
 
-    // Close all pipe ends in the parent process
-    for (i = 0; i < command_count - 1; i++) {
-        close(pipes[i][0]);
-        close(pipes[i][1]);
+    __atomic_store_n(&ev->seq, 0, __ATOMIC_RELAXED);
+    ev->ns = monotonic_ns();
+    ev->pid = trace_pid;
+    ev->type = type;
+    ev->a = a;
+    ev->b = b;
+    ev->text[0] = '\0';
+    if (text != NULL) {
+        strncat(ev->text, text, sizeof(ev->text) - 1);
     }
+    __atomic_store_n(&ev->seq, index + 1, __ATOMIC_RELEASE);
+}
+
+// First thing a forked child does: note who it is now
+void trace_child(const char* role) {
+    if (trace_enabled) {
+        pid_t parent = trace_pid;
+        trace_pid = getpid();
+        trace(TRACE_CHILD, parent, 0, role);
+    }
+}
 
-    // Wait for all child processes
-    if (!is_background) {
-        for (i = 0; i < command_count; i++) {
-            int status;
-            waitpid(-1, &status, 0);
-            debug_log("Child process exited with status: %d\n", status);
+static void trace_start(void) {
+    if (trace_ring == NULL) {
+        trace_ring = mmap(NULL, sizeof(*trace_ring), PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (trace_ring == MAP_FAILED) {
+            perror("trace: mmap");
+            trace_ring = NULL;
+            return;
         }
+        trace_ring->base_ns = monotonic_ns();
     }
+    trace_pid = getpid();
+    trace_enabled = 1;
 }
-#pragma GCC diagnostic pop
 
-void handle_redirection(char** args, int* arg_count, int* input_fd, int* output_fd) {
-    for (int i = 0; i < *arg_count; i++) {
-        if (strcmp(args[i], "<") == 0) {
-            *input_fd = open(args[i+1], O_RDONLY);
-            if (*input_fd == -1) {
-                perror("open");
-                debug_log("Input redirection failed: %s\n", strerror(errno));
-                exit(1);
-            }
-            debug_log("Input redirected from file: %s (fd: %d)\n", args[i+1], *input_fd);
-            free(args[i]);
-            free(args[i+1]);
-            for (int j = i; j < *arg_count - 2; j++) {
-                args[j] = args[j+2];
-            }
-            *arg_count -= 2;
-            i--;
-        } else if (strcmp(args[i], ">") == 0) {
-            *output_fd = open(args[i+1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
-            if (*output_fd == -1) {
-                perror("open");
-                debug_log("Output redirection failed: %s\n", strerror(errno));
-                exit(1);
-            }
-            debug_log("Output redirected to file: %s (fd: %d)\n", args[i+1], *output_fd);
-            free(args[i]);
-            free(args[i+1]);
-            for (int j = i; j < *arg_count - 2; j++) {
-                args[j] = args[j+2];
-            }
-            *arg_count -= 2;
-            i--;
-        } else if (strcmp(args[i], ">>") == 0) {
-            *output_fd = open(args[i+1], O_WRONLY | O_CREAT | O_APPEND, 0644);
-            if (*output_fd == -1) {
-                perror("open");
-                debug_log("Output redirection (append) failed: %s\n", strerror(errno));
-                exit(1);
-            }
-            debug_log("Output redirected (append) to file: %s (fd: %d)\n", args[i+1], *output_fd);
-            free(args[i]);
-            free(args[i+1]);
-            for (int j = i; j < *arg_count - 2; j++) {
-                args[j] = args[j+2];
-            }
-            *arg_count -= 2;
-            i--;
+static void trace_clear(void) {
+    if (trace_ring != NULL) {
+        for (int i = 0; i < TRACE_EVENTS; i++) {
+            __atomic_store_n(&trace_ring->events[i].seq, 0, __ATOMIC_RELAXED);
         }
+        __atomic_store_n(&trace_ring->head, 0, __ATOMIC_RELEASE);
+        trace_ring->base_ns = monotonic_ns();
     }
-    args[*arg_count] = NULL;
 }
 
-void free_commands(char*** commands, int command_count) {
-    for (int i = 0; i < command_count; i++) {
-        for (int j = 0; commands[i][j] != NULL; j++) {
-            free(commands[i][j]);
+// Write the events still in the ring, oldest first, one per line
+static void trace_dump(FILE* out) {
+    static const char* names[] = {
+        "line", "pipeline", "pipe", "redirect", "spawn", "child", "builtin", "reap", "job", "hash", "cache", "timeout", "error"
+    };
+    static const char* hash_events[] = { "added", "stale", "cleared" };
+
+    if (trace_ring == NULL) {
+        return;
+    }
+    uint64_t head = __atomic_load_n(&trace_ring->head, __ATOMIC_ACQUIRE);
+    uint64_t first = head > TRACE_EVENTS ? head - TRACE_EVENTS : 0;
+    if (first > 0) {
+        fprintf(out, "# %llu older events overwritten\n", (unsigned long long)first);
+    }
+    for (uint64_t i = first; i < head; i++) {
+        const struct trace_event* ev = &trace_ring->events[i & (TRACE_EVENTS - 1)];
+        if (__atomic_load_n(&ev->seq, __ATOMIC_ACQUIRE) != i + 1) {
+            continue;   // still being written, or already reused
+        }
+        long long ns = (long long)(ev->ns - trace_ring->base_ns);
+        fprintf(out, "%5lld.%09lld %7d %-9s", ns / 1000000000, ns % 1000000000, ev->pid,
+                ev->type < sizeof(names) / sizeof(names[0]) ? names[ev->type] : "?");
+        switch (ev->type) {
+        case TRACE_LINE:
+        case TRACE_BUILTIN:
+            fprintf(out, "%s\n", ev->text);
+            break;
+        case TRACE_PIPELINE:
+            fprintf(out, "%lld stages%s\n", (long long)ev->a, ev->b ? ", background" : "");
+            break;
+        case TRACE_PIPE:
+            fprintf(out, "read %lld write %lld\n", (long long)ev->a, (long long)ev->b);
+            break;
+        case TRACE_REDIRECT:
+            fprintf(out, "fd %lld -> %s (fd %lld)\n", (long long)ev->a, ev->text, (long long)ev->b);
+            break;
+        case TRACE_SPAWN:
+            fprintf(out, "pid %lld %s\n", (long long)ev->a, ev->text);
+            break;
+        case TRACE_CHILD:
+            fprintf(out, "%s, parent %lld\n", ev->text, (long long)ev->a);
+            break;
+        case TRACE_REAP:
+            fprintf(out, "pid %lld status %d\n", (long long)ev->a, status_code((int)ev->b));
+            break;
+        case TRACE_JOB:
+            fprintf(out, "[%lld] pgid %lld %s\n", (long long)ev->a, (long long)ev->b, ev->text);
+            break;
+        case TRACE_HASH:
+            fprintf(out, "%s %s\n", ev->a >= 0 && ev->a <= HASH_CLEARED ? hash_events[ev->a] : "?", ev->text);
+            break;
+        case TRACE_CACHE:
+            if (ev->a) {
+                fprintf(out, "hit %s status %lld\n", ev->text, (long long)ev->b);
+            } else {
+                fprintf(out, "miss %s\n", ev->text);
+            }
+            break;
+        case TRACE_TIMEOUT:
+            fprintf(out, "pgid %lld %s %s\n", (long long)ev->a, ev->b == SIGKILL ? "SIGKILL" : "SIGTERM", ev->text);
+            break;
+        case TRACE_ERROR:
+            fprintf(out, "%s: %s\n", ev->text, strerror((int)ev->a));
+            break;
+        default:
+            fprintf(out, "%lld %lld %s\n", (long long)ev->a, (long long)ev->b, ev->text);
+            break;
         }
-        free(commands[i]);
     }
-    free(commands);
-    debug_log("Freed memory for %d commands\n", command_count);
 }
 
-void debug_log(const char* format, ...) {
-    if (!DEBUG) return;
+// atexit handler for MIELL_TRACE; forked children exit without writing
+static void trace_write_file(void) {
+    if (getpid() != trace_owner || trace_file == NULL) {
+        return;
+    }
+    FILE* out = fopen(trace_file, "we");
+    if (out == NULL) {
+        fprintf(stderr, "miell: %s: %s\n", trace_file, strerror(errno));
+        return;
+    }
+    trace_dump(out);
+    fclose(out);
+}
 
-    va_list args;
-    va_start(args, format);
+// Trace to the file named by MIELL_TRACE, if set, from startup to exit
+void init_trace(void) {
+    const char* file = var_get("MIELL_TRACE");
 
-    time_t now = time(NULL);
-    struct tm *t = localtime(&now);
-    char timestamp[20];
-    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", t);
+    if (file == NULL || *file == '\0') {
+        return;
+    }
+    trace_start();
+    trace_file = strdup(file);
+    trace_owner = getpid();
+    atexit(trace_write_file);
+}
 
-    fprintf(stderr, "[DEBUG %s] ", timestamp);
-    vfprintf(stderr, format, args);
-    va_end(args);
+/*
+ * trace [on|off|dump|clear]: start or stop recording, print what has
+ * been recorded, or empty the ring. With no argument, report the state.
+ */
+int builtin_trace(char** args) {
+    if (args[1] == NULL) {
+        printf("trace %s, %llu events recorded\n", trace_enabled ? "on" : "off",
+               trace_ring ? (unsigned long long)trace_ring->head : 0ULL);
+    } else if (strcmp(args[1], "on") == 0) {
+        trace_start();
+        return trace_enabled ? 0 : 1;
+    } else if (strcmp(args[1], "off") == 0) {
+        trace_enabled = 0;
+    } else if (strcmp(args[1], "dump") == 0) {
+        trace_dump(stdout);
+    } else if (strcmp(args[1], "clear") == 0) {
+        trace_clear();
+    } else {
+        fprintf(stderr, "trace: usage: trace [on|off|dump|clear]\n");
+        return 2;
+    }
+    return 0;
 }
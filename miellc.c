@@ -0,0 +1,94 @@
+/*
+ * Client for a shell started with `miell --serve SOCKET`.
+ *
+ * Sends one command line to the server together with this process's
+ * stdin, stdout and stderr, so the command reads and writes them
+ * directly, and exits with the command's status. The arguments after
+ * the socket are joined with spaces, like `miell -c`.
+ *
+ * Usage: miellc SOCKET command [args...]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+int main(int argc, char** argv) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    struct msghdr msg = { 0 };
+    struct iovec iov;
+    int32_t status;
+    uint32_t len = 0;
+    int sock;
+
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s SOCKET command [args...]\n", argv[0]);
+        return 2;
+    }
+    if (strlen(argv[1]) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "miellc: %s: socket path too long\n", argv[1]);
+        return 2;
+    }
+    strcpy(addr.sun_path, argv[1]);
+
+    for (int i = 2; i < argc; i++) {
+        len += strlen(argv[i]) + 1;
+    }
+    char* text = malloc(len);
+    char* p = text;
+    for (int i = 2; i < argc; i++) {
+        size_t n = strlen(argv[i]);
+        memcpy(p, argv[i], n);
+        p[n] = (i + 1 < argc) ? ' ' : '\n';
+        p += n + 1;
+    }
+
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1 || connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        fprintf(stderr, "miellc: %s: %s\n", argv[1], strerror(errno));
+        return 255;
+    }
+
+    // The length goes first, carrying our stdio descriptors with it
+    int fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+    iov.iov_base = &len;
+    iov.iov_len = sizeof(len);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr* c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(c), fds, sizeof(fds));
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) != sizeof(len)) {
+        perror("miellc: sendmsg");
+        return 255;
+    }
+    for (uint32_t sent = 0; sent < len; ) {
+        ssize_t n = send(sock, text + sent, len - sent, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("miellc: send");
+            return 255;
+        }
+        sent += n;
+    }
+
+    ssize_t n;
+    while ((n = recv(sock, &status, sizeof(status), MSG_WAITALL)) == -1 && errno == EINTR) {
+    }
+    if (n != sizeof(status)) {
+        fprintf(stderr, "miellc: connection closed without a status\n");
+        return 255;
+    }
+    return status & 0xff;
+}